@@ -0,0 +1,79 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "fs.h"
+
+// Checks that a batch which fails leaves the disk as it found it, run with
+// `make batchtest`. Runs on a memory disk. Exits with 1 if a check fails.
+
+static int failures = 0;
+
+// Counts a failed check and says which
+static void
+check(bool ok, const std::string& what)
+{
+    if(!ok){
+        std::cout << "FAIL: " << what << "\n";
+        failures++;
+    }
+}
+
+static batch_op
+op(int type, const std::string& arg1, const std::string& arg2 = "")
+{
+    batch_op o;
+    o.type = type;
+    o.arg1 = arg1;
+    o.arg2 = arg2;
+    return o;
+}
+
+// Removing a directory reaps the orphans in it, whose blocks must not be
+// discarded before the batch is on disk: the rollback gives them back
+static void
+test_rollback_after_reap(FS& filesystem)
+{
+    std::string data(6000, 'A');
+    check(filesystem.format() == FS_OK, "format");
+    check(filesystem.mkdir("d") == FS_OK, "mkdir d");
+    check(filesystem.create("d/f", data) == FS_OK, "create d/f");
+
+    std::vector<batch_op> ops;
+    ops.push_back(op(BATCH_RM, "d/f"));
+    ops.push_back(op(BATCH_RM, "d"));
+    ops.push_back(op(BATCH_MKDIR, "x"));
+    ops.push_back(op(BATCH_MKDIR, "x"));
+    unsigned failed_op = 0;
+    check(filesystem.batch(ops, &failed_op) == FS_EEXIST && failed_op == 3, "batch fails at the second mkdir x");
+
+    std::string out;
+    check(filesystem.cat("d/f", &out) == FS_OK && out == data, "d/f unchanged after the rollback");
+
+    // and once a batch like it succeeds, a file it creates in the freed
+    // blocks keeps its data
+    std::string other(5000, 'B');
+    ops.clear();
+    ops.push_back(op(BATCH_RM, "d/f"));
+    ops.push_back(op(BATCH_RM, "d"));
+    ops.push_back(op(BATCH_CREATE, "g", other));
+    check(filesystem.batch(ops, &failed_op) == FS_OK, "batch rm d/f, rm d, create g");
+    check(filesystem.cat("g", &out) == FS_OK && out == other, "g intact");
+}
+
+int
+main()
+{
+    // the memory disk starts empty as long as there is no such image
+    std::string image = "batchtest-" + std::to_string(getpid()) + ".bin";
+    disk_config config;
+    config.backend = DISK_BACKEND_MEMORY;
+    FS filesystem(image, config);
+    check(filesystem.mounted(), "mount " + image);
+
+    if(failures == 0)
+        test_rollback_after_reap(filesystem);
+
+    std::cout << (failures == 0 ? "All batch tests passed\n" : "Batch tests failed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "fs.h"
+
+// Microbenchmarks for the file system, run with `make bench`.
+//
+// bench [-o results.json] [-i image] [-l label] [-q] [-E device]
+//   -o  where to write the JSON results (default bench.json)
+//   -i  disk image to run on, it is formatted and removed afterwards
+//   -l  label stored in the JSON, e.g. the commit the results belong to
+//   -q  quick run with fewer repetitions
+//   -E  run on an emulated device, see parse_device_model
+//
+// Each benchmark times single FS calls and reports ops/s, MB/s of logical
+// data, p50/p99 latency and the blocks read and written per operation.
+// Setup and cleanup between the timed calls are not counted.
+
+typedef std::chrono::steady_clock bench_clock;
+
+// The largest file that fits on an empty disk, the '\0' needs a byte too
+#define FULL_DISK_FILE ((2048 - 2) * BLOCK_SIZE - 1)
+
+struct bench_result {
+    std::string name;
+    uint64_t bytes_per_op;      // logical bytes one operation handles
+    std::vector<double> lat_us; // latency of every operation
+    uint64_t reads;             // blocks read by all operations
+    uint64_t writes;            // blocks written by all operations
+    int failures;
+};
+
+static std::vector<bench_result> results;
+static unsigned reps_scale = 1;
+
+// Starts a new result to record operations into
+static bench_result *
+new_result(std::string name, uint64_t bytes_per_op)
+{
+    bench_result r;
+    r.name = name;
+    r.bytes_per_op = bytes_per_op;
+    r.reads = 0;
+    r.writes = 0;
+    r.failures = 0;
+    results.push_back(r);
+    return &results.back();
+}
+
+// Runs op once and records its latency and block I/O in r
+template<typename F>
+static int
+timed(FS& fs, bench_result *r, F op)
+{
+    io_stats before, after;
+    fs.get_io_stats(&before);
+    bench_clock::time_point start = bench_clock::now();
+    int ret_val = op();
+    bench_clock::time_point end = bench_clock::now();
+    fs.get_io_stats(&after);
+
+    r->lat_us.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    r->reads += after.disk.reads - before.disk.reads;
+    r->writes += after.disk.writes - before.disk.writes;
+    if(ret_val != FS_OK)
+        r->failures++;
+    return ret_val;
+}
+
+static unsigned
+reps_for(uint64_t size)
+{
+    unsigned reps;
+    if(size <= BLOCK_SIZE)
+        reps = 400;
+    else if(size <= 64 * 1024)
+        reps = 100;
+    else if(size <= 1024 * 1024)
+        reps = 20;
+    else
+        reps = 4;
+    return std::max(1u, reps / reps_scale);
+}
+
+static std::string
+size_name(uint64_t size)
+{
+    return size == FULL_DISK_FILE ? "full" : std::to_string(size);
+}
+
+// create, cat and rm of one file of every size
+static void
+bench_file_sizes(FS& fs, const std::vector<uint64_t>& sizes)
+{
+    for(unsigned s = 0; s < sizes.size(); s++){
+        uint64_t size = sizes[s];
+        std::string data(size, 'x');
+        std::string out;
+        unsigned reps = reps_for(size);
+
+        fs.format();
+        bench_result *create = new_result("create/" + size_name(size), size);
+        for(unsigned i = 0; i < reps; i++){
+            timed(fs, create, [&]{ return fs.create("f", data); });
+            fs.rm("f");
+        }
+
+        bench_result *rm = new_result("rm/" + size_name(size), size);
+        for(unsigned i = 0; i < reps; i++){
+            fs.create("f", data);
+            timed(fs, rm, [&]{ return fs.rm("f"); });
+        }
+
+        fs.create("f", data);
+        bench_result *cat = new_result("cat/" + size_name(size), size);
+        for(unsigned i = 0; i < reps; i++)
+            timed(fs, cat, [&]{ return fs.cat("f", &out); });
+
+        // cp and append need room for a second copy
+        if(size > FULL_DISK_FILE / 2)
+            continue;
+
+        bench_result *cp = new_result("cp/" + size_name(size), size);
+        for(unsigned i = 0; i < reps; i++){
+            timed(fs, cp, [&]{ return fs.cp("f", "g"); });
+            fs.rm("g");
+        }
+
+        bench_result *append = new_result("append/" + size_name(size), size);
+        for(unsigned i = 0; i < reps; i++){
+            fs.create("g", "");
+            timed(fs, append, [&]{ return fs.append("f", "g"); });
+            fs.rm("g");
+        }
+    }
+}
+
+// mv as a rename and as a move into a directory, and mkdir
+static void
+bench_namespace(FS& fs)
+{
+    unsigned reps = reps_for(1);
+    fs.format();
+    fs.create("f", "x");
+    fs.mkdir("d");
+
+    bench_result *rename = new_result("mv/rename", 0);
+    for(unsigned i = 0; i < reps; i++){
+        timed(fs, rename, [&]{ return fs.mv("f", "g"); });
+        fs.mv("g", "f");
+    }
+
+    bench_result *move = new_result("mv/to-dir", 0);
+    for(unsigned i = 0; i < reps; i++){
+        timed(fs, move, [&]{ return fs.mv("f", "d"); });
+        fs.mv("d/f", "/");
+    }
+
+    bench_result *mkdir = new_result("mkdir", 0);
+    for(unsigned i = 0; i < reps; i++){
+        timed(fs, mkdir, [&]{ return fs.mkdir("e"); });
+        fs.rm("e");
+    }
+}
+
+// stat and cd through paths of growing depth
+static void
+bench_path_resolution(FS& fs)
+{
+    unsigned depths[] = { 1, 4, 16, 64 };
+    unsigned reps = reps_for(1);
+    for(unsigned d = 0; d < sizeof(depths) / sizeof(depths[0]); d++){
+        fs.format();
+        std::string path;
+        for(unsigned i = 0; i < depths[d]; i++){
+            path += "/d";
+            fs.mkdir(path);
+        }
+        fs.create(path + "/f", "x");
+
+        std::string file = path + "/f";
+        dir_entry entry;
+        bench_result *stat = new_result("resolve/stat-depth-" + std::to_string(depths[d]), 0);
+        for(unsigned i = 0; i < reps; i++)
+            timed(fs, stat, [&]{ return fs.stat(file, &entry); });
+
+        bench_result *cd = new_result("resolve/cd-depth-" + std::to_string(depths[d]), 0);
+        for(unsigned i = 0; i < reps; i++){
+            timed(fs, cd, [&]{ return fs.cd(path); });
+            fs.cd("/");
+        }
+    }
+}
+
+// create, lookup and rm in a directory that is already partly filled
+static void
+bench_dir_fill(FS& fs)
+{
+    unsigned fills[] = { 0, 16, 32, 62 };
+    unsigned reps = reps_for(1);
+    for(unsigned f = 0; f < sizeof(fills) / sizeof(fills[0]); f++){
+        fs.format();
+        for(unsigned i = 0; i < fills[f]; i++)
+            fs.create("fill" + std::to_string(i), "x");
+
+        std::string suffix = "/fill-" + std::to_string(fills[f]);
+        bench_result *create = new_result("create" + suffix, 1);
+        for(unsigned i = 0; i < reps; i++){
+            timed(fs, create, [&]{ return fs.create("f", "x"); });
+            fs.rm("f");
+        }
+
+        // the entry last in the directory is the slowest one to find
+        std::string last = fills[f] > 0 ? "fill" + std::to_string(fills[f] - 1) : "f";
+        if(fills[f] == 0)
+            fs.create("f", "x");
+        dir_entry entry;
+        bench_result *lookup = new_result("lookup" + suffix, 0);
+        for(unsigned i = 0; i < reps; i++)
+            timed(fs, lookup, [&]{ return fs.stat(last, &entry); });
+    }
+}
+
+// Fills the disk with one block files in sub-directories and removes every
+// other one, leaving only single block holes for new files
+static void
+fragment(FS& fs)
+{
+    fs.format();
+    std::string block(BLOCK_SIZE - 1, 'x');
+    for(unsigned d = 0; ; d++){
+        std::string dir = "/frag" + std::to_string(d);
+        if(fs.mkdir(dir) != FS_OK)
+            break;
+        bool full = false;
+        for(unsigned i = 0; i < DIR_ENTRIES - 1 && !full; i++)
+            full = fs.create(dir + "/" + std::to_string(i), block) != FS_OK;
+        if(full)
+            break;
+    }
+    for(unsigned d = 0; ; d++){
+        std::string dir = "/frag" + std::to_string(d);
+        dir_entry entry;
+        if(fs.stat(dir, &entry) != FS_OK)
+            break;
+        for(unsigned i = 0; i < DIR_ENTRIES - 1; i += 2)
+            fs.rm(dir + "/" + std::to_string(i));
+    }
+}
+
+// create and cat of files on a fresh disk compared to a fragmented one
+static void
+bench_fragmentation(FS& fs)
+{
+    uint64_t sizes[] = { 64 * 1024 - 1, 1024 * 1024 - 1 };
+    const char *states[] = { "fresh", "fragmented" };
+    for(unsigned st = 0; st < 2; st++){
+        for(unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+            if(st == 0)
+                fs.format();
+            else
+                fragment(fs);
+
+            uint64_t size = sizes[s];
+            std::string data(size, 'x');
+            std::string out;
+            unsigned reps = reps_for(size);
+            std::string suffix = std::string("/") + states[st] + "/" + size_name(size);
+
+            bench_result *create = new_result("create" + suffix, size);
+            for(unsigned i = 0; i < reps; i++){
+                timed(fs, create, [&]{ return fs.create("/f", data); });
+                fs.rm("/f");
+            }
+
+            fs.create("/f", data);
+            bench_result *cat = new_result("cat" + suffix, size);
+            for(unsigned i = 0; i < reps; i++)
+                timed(fs, cat, [&]{ return fs.cat("/f", &out); });
+        }
+    }
+}
+
+// p in [0, 1] of sorted latencies
+static double
+percentile(const std::vector<double>& sorted, double p)
+{
+    if(sorted.empty())
+        return 0;
+    size_t idx = (size_t)std::ceil(p * sorted.size());
+    return sorted[idx == 0 ? 0 : idx - 1];
+}
+
+static std::string
+json_escape(const std::string& s)
+{
+    std::string out;
+    for(unsigned i = 0; i < s.length(); i++){
+        if(s[i] == '"' || s[i] == '\\')
+            out += '\\';
+        out += s[i];
+    }
+    return out;
+}
+
+static void
+report(std::string label, std::string json_path)
+{
+    std::ostringstream json;
+    json << "{\n  \"label\": \"" << json_escape(label) << "\",\n";
+    json << "  \"block_size\": " << BLOCK_SIZE << ",\n  \"results\": [\n";
+
+    printf("%-32s %8s %12s %10s %10s %10s %9s %9s\n",
+           "benchmark", "ops", "ops/s", "MB/s", "p50 us", "p99 us", "rd/op", "wr/op");
+    for(unsigned i = 0; i < results.size(); i++){
+        bench_result& r = results[i];
+        std::vector<double> sorted = r.lat_us;
+        std::sort(sorted.begin(), sorted.end());
+        double total_us = 0;
+        for(unsigned j = 0; j < sorted.size(); j++)
+            total_us += sorted[j];
+        size_t ops = sorted.size();
+        double ops_per_sec = total_us > 0 ? ops / (total_us / 1e6) : 0;
+        double mb_per_sec = total_us > 0 ? r.bytes_per_op * ops / total_us : 0; // bytes/us == MB/s
+        double p50 = percentile(sorted, 0.50);
+        double p99 = percentile(sorted, 0.99);
+        double reads_per_op = ops ? (double)r.reads / ops : 0;
+        double writes_per_op = ops ? (double)r.writes / ops : 0;
+
+        printf("%-32s %8zu %12.0f %10.2f %10.1f %10.1f %9.2f %9.2f%s\n",
+               r.name.c_str(), ops, ops_per_sec, mb_per_sec, p50, p99,
+               reads_per_op, writes_per_op, r.failures ? "  FAILED" : "");
+
+        json << "    {\"name\": \"" << json_escape(r.name) << "\""
+             << ", \"ops\": " << ops
+             << ", \"bytes_per_op\": " << r.bytes_per_op
+             << ", \"ops_per_sec\": " << ops_per_sec
+             << ", \"mb_per_sec\": " << mb_per_sec
+             << ", \"p50_us\": " << p50
+             << ", \"p99_us\": " << p99
+             << ", \"reads_per_op\": " << reads_per_op
+             << ", \"writes_per_op\": " << writes_per_op
+             << ", \"failures\": " << r.failures << "}"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+
+    std::ofstream out(json_path.c_str());
+    out << json.str();
+    if(!out.good())
+        std::cerr << "Could not write " << json_path << "\n";
+    else
+        printf("Results written to %s\n", json_path.c_str());
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string json_path = "bench.json";
+    std::string image = "bench.bin";
+    std::string label;
+    disk_config config;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            json_path = argv[++i];
+        else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            image = argv[++i];
+        else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            label = argv[++i];
+        else if(strcmp(argv[i], "-q") == 0)
+            reps_scale = 10;
+        else if(strcmp(argv[i], "-E") == 0 && i + 1 < argc && parse_device_model(argv[i + 1], &config.model)){
+            config.emulate = true;
+            i++;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [-o results.json] [-i image] [-l label] [-q] [-E device]\n";
+            return 2;
+        }
+    }
+
+    // results holds pointers handed out by new_result, it must not move
+    results.reserve(256);
+    {
+        FS fs(image, config);
+        if(!fs.mounted()){
+            std::cerr << "Could not open " << image << "\n";
+            return 1;
+        }
+
+        std::vector<uint64_t> sizes;
+        sizes.push_back(1);
+        sizes.push_back(BLOCK_SIZE - 1);
+        sizes.push_back(64 * 1024 - 1);
+        sizes.push_back(1024 * 1024 - 1);
+        sizes.push_back(FULL_DISK_FILE);
+
+        bench_file_sizes(fs, sizes);
+        bench_namespace(fs);
+        bench_path_resolution(fs);
+        bench_dir_fill(fs);
+        bench_fragmentation(fs);
+    }
+    std::remove(image.c_str());
+
+    report(label, json_path);
+    return 0;
+}
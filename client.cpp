@@ -0,0 +1,200 @@
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "client.h"
+
+FSClient::FSClient()
+{
+    fd = -1;
+}
+
+FSClient::~FSClient()
+{
+    disconnect();
+}
+
+// connects to the daemon listening on socket_path
+int
+FSClient::connect(std::string socket_path)
+{
+    struct sockaddr_un addr;
+    if(socket_path.length() >= sizeof(addr.sun_path))
+        return -1;
+
+    disconnect();
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    if(::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1){
+        disconnect();
+        return -1;
+    }
+    return 0;
+}
+
+void
+FSClient::disconnect()
+{
+    if(fd != -1){
+        close(fd);
+        fd = -1;
+    }
+}
+
+// Sends one request and waits for its response
+int
+FSClient::call(uint8_t op, const std::vector<std::string>& args, std::string *out)
+{
+    if(fd == -1)
+        return -1;
+
+    std::string payload;
+    fsd_pack_args(args, &payload);
+    if(payload.length() > FSD_MAX_PAYLOAD)
+        return -1;
+
+    fsd_request_hdr req;
+    req.magic = FSD_MAGIC;
+    req.op = op;
+    req.nargs = args.size();
+    req.len = payload.length();
+
+    // Header and payload in one write so small requests are a single syscall
+    payload.insert(0, (const char*)&req, sizeof(req));
+    fsd_response_hdr resp;
+    if(fsd_write_full(fd, payload.data(), payload.length()) == -1 ||
+       fsd_read_full(fd, &resp, sizeof(resp)) == -1 ||
+       resp.magic != FSD_MAGIC || resp.len > FSD_MAX_PAYLOAD){
+        disconnect();
+        return -1;
+    }
+
+    out->resize(resp.len);
+    if(resp.len > 0 && fsd_read_full(fd, &(*out)[0], resp.len) == -1){
+        disconnect();
+        return -1;
+    }
+    return resp.status;
+}
+
+int
+FSClient::format()
+{
+    std::string out;
+    return call(FSD_FORMAT, std::vector<std::string>(), &out);
+}
+
+int
+FSClient::create(std::string filepath, std::string data)
+{
+    std::string out;
+    std::vector<std::string> args;
+    args.push_back(filepath);
+    args.push_back(data);
+    return call(FSD_CREATE, args, &out);
+}
+
+int
+FSClient::cat(std::string filepath, std::string *data)
+{
+    return call(FSD_CAT, std::vector<std::string>(1, filepath), data);
+}
+
+int
+FSClient::ls(std::vector<dir_entry> *entries)
+{
+    std::string out;
+    int ret_val = call(FSD_LS, std::vector<std::string>(), &out);
+    entries->clear();
+    if(ret_val == FS_OK){
+        entries->resize(out.length() / sizeof(dir_entry));
+        if(!entries->empty())
+            memcpy(&(*entries)[0], out.data(), entries->size() * sizeof(dir_entry));
+    }
+    return ret_val;
+}
+
+int
+FSClient::stat(std::string path, dir_entry *entry)
+{
+    std::string out;
+    int ret_val = call(FSD_STAT, std::vector<std::string>(1, path), &out);
+    if(ret_val == FS_OK){
+        if(out.length() != sizeof(dir_entry))
+            return FSD_ERR_PROTOCOL;
+        memcpy(entry, out.data(), sizeof(dir_entry));
+    }
+    return ret_val;
+}
+
+int
+FSClient::cp(std::string sourcepath, std::string destpath)
+{
+    std::string out;
+    std::vector<std::string> args;
+    args.push_back(sourcepath);
+    args.push_back(destpath);
+    return call(FSD_CP, args, &out);
+}
+
+int
+FSClient::mv(std::string sourcepath, std::string destpath)
+{
+    std::string out;
+    std::vector<std::string> args;
+    args.push_back(sourcepath);
+    args.push_back(destpath);
+    return call(FSD_MV, args, &out);
+}
+
+int
+FSClient::rm(std::string filepath)
+{
+    std::string out;
+    return call(FSD_RM, std::vector<std::string>(1, filepath), &out);
+}
+
+int
+FSClient::append(std::string filepath1, std::string filepath2)
+{
+    std::string out;
+    std::vector<std::string> args;
+    args.push_back(filepath1);
+    args.push_back(filepath2);
+    return call(FSD_APPEND, args, &out);
+}
+
+int
+FSClient::mkdir(std::string dirpath)
+{
+    std::string out;
+    return call(FSD_MKDIR, std::vector<std::string>(1, dirpath), &out);
+}
+
+int
+FSClient::cd(std::string dirpath)
+{
+    std::string out;
+    return call(FSD_CD, std::vector<std::string>(1, dirpath), &out);
+}
+
+int
+FSClient::pwd(std::string *path)
+{
+    return call(FSD_PWD, std::vector<std::string>(), path);
+}
+
+int
+FSClient::chmod(std::string accessrights, std::string filepath)
+{
+    std::string out;
+    std::vector<std::string> args;
+    args.push_back(accessrights);
+    args.push_back(filepath);
+    return call(FSD_CHMOD, args, &out);
+}
@@ -0,0 +1,40 @@
+#include <string>
+#include <vector>
+#include "fatfs.h"
+#include "protocol.h"
+
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+// Thin client for the filesystem daemon. Each FSClient is one session on the
+// daemon with its own working directory. Every call returns FS_OK or an FS_E*
+// code from fatfs.h just like the FS does, or -1 if the daemon could not be
+// reached.
+class FSClient {
+private:
+    int fd;
+    int call(uint8_t op, const std::vector<std::string>& args, std::string *out);
+public:
+    FSClient();
+    ~FSClient();
+    // connects to the daemon listening on socket_path
+    int connect(std::string socket_path);
+    void disconnect();
+    bool connected() { return fd != -1; }
+
+    int format();
+    int create(std::string filepath, std::string data);
+    int cat(std::string filepath, std::string *data);
+    int ls(std::vector<dir_entry> *entries);
+    int stat(std::string path, dir_entry *entry);
+    int cp(std::string sourcepath, std::string destpath);
+    int mv(std::string sourcepath, std::string destpath);
+    int rm(std::string filepath);
+    int append(std::string filepath1, std::string filepath2);
+    int mkdir(std::string dirpath);
+    int cd(std::string dirpath);
+    int pwd(std::string *path);
+    int chmod(std::string accessrights, std::string filepath);
+};
+
+#endif // __CLIENT_H__
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstring>
+#include "defrag.h"
+
+Defragmenter::Defragmenter(FS& fs, std::mutex& fs_lock) : filesystem(fs), fs_lock(fs_lock)
+{
+    stopping = false;
+    active = false;
+    io_per_sec = 0;
+    memset(&progress, 0, sizeof(progress));
+    status = FS_OK;
+}
+
+Defragmenter::~Defragmenter()
+{
+    stop();
+}
+
+void
+Defragmenter::start(unsigned io_per_sec)
+{
+    stop();
+    std::lock_guard<std::mutex> guard(state_lock);
+    this->io_per_sec = io_per_sec;
+    memset(&progress, 0, sizeof(progress));
+    status = FS_OK;
+    stopping = false;
+    active = true;
+    thread = std::thread(&Defragmenter::run, this);
+}
+
+void
+Defragmenter::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+bool
+Defragmenter::running(defrag_progress *progress, int *status)
+{
+    std::lock_guard<std::mutex> guard(state_lock);
+    *progress = this->progress;
+    *status = this->status;
+    return active;
+}
+
+void
+Defragmenter::run()
+{
+    // A background budget slows the steps down too, while fs_lock is held,
+    // io_per_sec is the better way to keep defrag in check
+    Disk::set_io_class(IO_BACKGROUND);
+    std::unique_lock<std::mutex> state(state_lock);
+    while (!stopping) {
+        defrag_progress step = progress;
+        state.unlock();
+        int ret_val;
+        {
+            std::lock_guard<std::mutex> guard(fs_lock);
+            ret_val = filesystem.defrag_step(&step);
+        }
+        state.lock();
+
+        uint64_t spent = step.io - progress.io;
+        progress = step;
+        status = ret_val;
+        if (ret_val != FS_OK || step.done)
+            break;
+        // pay for the I/O just spent before the next step
+        if (io_per_sec > 0) {
+            std::chrono::microseconds pause(spent * 1000000 / io_per_sec);
+            wakeup.wait_for(state, pause, [this]{ return stopping; });
+        }
+    }
+    active = false;
+}
@@ -0,0 +1,42 @@
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "fs.h"
+
+#ifndef __DEFRAG_H__
+#define __DEFRAG_H__
+
+// Online defragmentation. A background thread runs FS::defrag_step until
+// the disk is laid out, holding fs_lock for each step, the lock the owner
+// of the FS serializes every other call with. After each step it sleeps as
+// long as the disk I/O of the step takes out of a budget of io_per_sec
+// reads and writes a second, so foreground calls only ever wait for one
+// file to be moved.
+class Defragmenter {
+private:
+    FS& filesystem;
+    std::mutex& fs_lock;
+    std::thread thread;
+
+    std::mutex state_lock;          // guards everything below
+    std::condition_variable wakeup;
+    bool stopping;
+    bool active;
+    unsigned io_per_sec;            // 0 for no limit
+    defrag_progress progress;
+    int status;                     // of the last step
+
+    void run();
+public:
+    Defragmenter(FS& fs, std::mutex& fs_lock);
+    ~Defragmenter();
+    // starts a pass from the beginning of the disk, stopping one that is
+    // running first. Neither start nor stop may be called with fs_lock held.
+    void start(unsigned io_per_sec);
+    void stop();
+    // whether a pass is running, with how far it got and the status of its
+    // last step
+    bool running(defrag_progress *progress, int *status);
+};
+
+#endif // __DEFRAG_H__
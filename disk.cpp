@@ -1,66 +1,907 @@
 #include <iostream>
+#include <fstream>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+// linux/fs.h has a BLOCK_SIZE of its own, ours comes from disk.h
+#undef BLOCK_SIZE
 #include "disk.h"
+#include "trace.h"
 
-Disk::Disk()
+int
+DiskBackend::copy(unsigned from, unsigned to, unsigned count, bool *offloaded)
 {
-    // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
-        std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
-        f.write("", 1);
+    uint8_t blk[BLOCK_SIZE];
+    *offloaded = false;
+    for (unsigned i = 0; i < count; i++) {
+        if (read(from + i, blk) != 0 || write(to + i, blk) != 0)
+            return -1;
     }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
-        exit(-1);
+    return 0;
+}
+
+int
+DiskBackend::read_run(unsigned first, unsigned count, uint8_t *buf)
+{
+    for (unsigned i = 0; i < count; i++) {
+        if (read(first + i, buf + (size_t)i * BLOCK_SIZE) != 0)
+            return -1;
     }
+    return 0;
 }
 
-Disk::~Disk()
+int
+DiskBackend::write_run(unsigned first, unsigned count, const uint8_t *buf)
+{
+    for (unsigned i = 0; i < count; i++) {
+        if (write(first + i, buf + (size_t)i * BLOCK_SIZE) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+FileBackend::FileBackend(const std::string& name, unsigned disk_size)
+{
+    can_clone = true;
+    can_copy_range = true;
+    can_punch = true;
+    // the disk is simulated as a binary file, created if it does not exist
+    fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size < (off_t)disk_size && ftruncate(fd, disk_size) == -1)) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+FileBackend::~FileBackend()
+{
+    if (fd != -1)
+        close(fd);
+}
+
+int
+FileBackend::read(unsigned block_no, uint8_t *blk)
 {
-    diskfile.close();
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    size_t done = 0;
+    while (done < BLOCK_SIZE) {
+        ssize_t n = pread(fd, blk + done, BLOCK_SIZE - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+int
+FileBackend::read_run(unsigned first, unsigned count, uint8_t *buf)
+{
+    off_t offset = (off_t)first * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE, done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+int
+FileBackend::write(unsigned block_no, const uint8_t *blk)
+{
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    size_t done = 0;
+    while (done < BLOCK_SIZE) {
+        ssize_t n = pwrite(fd, blk + done, BLOCK_SIZE - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+int
+FileBackend::write_run(unsigned first, unsigned count, const uint8_t *buf)
+{
+    off_t offset = (off_t)first * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE, done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// A clone makes the host share the blocks, which is as good as it gets and
+// only works on file systems that can reflink (btrfs, XFS). copy_file_range
+// still copies, but inside the kernel. Either may refuse for reasons of the
+// host, the plain copy is the last resort.
+int
+FileBackend::copy(unsigned from, unsigned to, unsigned count, bool *offloaded)
+{
+    off_t src = (off_t)from * BLOCK_SIZE, dst = (off_t)to * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    *offloaded = true;
+    if (can_clone) {
+        struct file_clone_range range;
+        range.src_fd = fd;
+        range.src_offset = src;
+        range.src_length = len;
+        range.dest_offset = dst;
+        if (ioctl(fd, FICLONERANGE, &range) == 0)
+            return 0;
+        can_clone = false;
+    }
+    if (can_copy_range) {
+        size_t done = 0;
+        while (done < len) {
+            loff_t in = src + done, out = dst + done;
+            ssize_t n = copy_file_range(fd, &in, fd, &out, len - done, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        if (done == len)
+            return 0;
+        if (done > 0)
+            return -1;
+        can_copy_range = false;
+    }
+    return DiskBackend::copy(from, to, count, offloaded);
+}
+
+// Not every host file system can punch holes, if it cannot the blocks just
+// stay allocated
+int
+FileBackend::discard(unsigned first, unsigned count)
+{
+    if (!can_punch)
+        return 0;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)first * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) == 0)
+        return 0;
+    if (errno == EOPNOTSUPP || errno == ENOSYS)
+        can_punch = false;
+    return can_punch ? -1 : 0;
+}
+
+MemoryBackend::MemoryBackend(const std::string& name, unsigned disk_size)
+    : data(disk_size, 0)
+{
+    std::ifstream f(name.c_str(), std::ios::binary);
+    if (f.is_open())
+        f.read((char*)&data[0], disk_size);
+}
+
+int
+MemoryBackend::read(unsigned block_no, uint8_t *blk)
+{
+    memcpy(blk, &data[(size_t)block_no * BLOCK_SIZE], BLOCK_SIZE);
+    return 0;
+}
+
+int
+MemoryBackend::read_run(unsigned first, unsigned count, uint8_t *buf)
+{
+    memcpy(buf, &data[(size_t)first * BLOCK_SIZE], (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+int
+MemoryBackend::write(unsigned block_no, const uint8_t *blk)
+{
+    memcpy(&data[(size_t)block_no * BLOCK_SIZE], blk, BLOCK_SIZE);
+    return 0;
+}
+
+int
+MemoryBackend::write_run(unsigned first, unsigned count, const uint8_t *buf)
+{
+    memcpy(&data[(size_t)first * BLOCK_SIZE], buf, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+int
+MemoryBackend::copy(unsigned from, unsigned to, unsigned count, bool *offloaded)
+{
+    memcpy(&data[(size_t)to * BLOCK_SIZE], &data[(size_t)from * BLOCK_SIZE], (size_t)count * BLOCK_SIZE);
+    *offloaded = false;
+    return 0;
+}
+
+int
+MemoryBackend::discard(unsigned first, unsigned count)
+{
+    memset(&data[(size_t)first * BLOCK_SIZE], 0, (size_t)count * BLOCK_SIZE);
+    return 0;
 }
 
 bool
-Disk::disk_file_exists (const std::string& name) {
-    std::ifstream f(name.c_str());
-    return f.good();
+parse_device_model(const std::string& spec, device_model *model)
+{
+    // a spinning disk, a SATA SSD and an NVMe drive, roughly
+    static const struct {
+        const char *name;
+        device_model model;
+    } presets[] = {
+        { "hdd", { 4000, 8000, 150, 1 } },
+        { "ssd", { 80, 0, 500, 8 } },
+        { "nvme", { 20, 0, 3000, 32 } },
+    };
+    for (size_t i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+        if (spec == presets[i].name) {
+            *model = presets[i].model;
+            return true;
+        }
+    }
+
+    unsigned *fields[] = { &model->latency_us, &model->seek_us, &model->mb_per_sec, &model->queue_depth };
+    memset(model, 0, sizeof(*model));
+    model->queue_depth = 1;
+    const char *p = spec.c_str();
+    for (size_t i = 0; i < 4; i++) {
+        char *end;
+        unsigned long value = strtoul(p, &end, 10);
+        if (end == p)
+            return false;
+        *fields[i] = value;
+        if (*end == '\0')
+            return true;
+        if (*end != ',')
+            return false;
+        p = end + 1;
+    }
+    return false;
+}
+
+EmulatedBackend::EmulatedBackend(DiskBackend *inner, const device_model& model, unsigned no_blocks)
+    : inner(inner), model(model), no_blocks(no_blocks)
+{
+    busy_slots = 0;
+    head = 0;
+    bus_free = std::chrono::steady_clock::now();
+}
+
+EmulatedBackend::~EmulatedBackend()
+{
+    delete inner;
+}
+
+// Takes a slot in the queue and sleeps as long as the device takes for
+// count blocks from first
+void
+EmulatedBackend::begin(unsigned first, unsigned count)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    slot_free.wait(guard, [this] { return busy_slots < queue_depth(); });
+    busy_slots++;
+
+    double us = model.latency_us;
+    unsigned distance = first > head ? first - head : head - first;
+    if (model.seek_us > 0 && distance > 0)
+        us += model.seek_us * std::sqrt((double)distance / no_blocks);
+    head = first + count;
+    std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now() +
+        std::chrono::microseconds((uint64_t)us);
+    if (model.mb_per_sec > 0) {
+        // the transfer starts once the bus is free
+        if (bus_free > done)
+            done = bus_free;
+        done += std::chrono::microseconds((uint64_t)count * BLOCK_SIZE / model.mb_per_sec);
+        bus_free = done;
+    }
+    guard.unlock();
+    TraceSpan span("EmulatedBackend::wait", "disk", first);
+    std::this_thread::sleep_until(done);
+}
+
+void
+EmulatedBackend::end()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    busy_slots--;
+    slot_free.notify_one();
+}
+
+int
+EmulatedBackend::read(unsigned block_no, uint8_t *blk)
+{
+    return read_run(block_no, 1, blk);
+}
+
+int
+EmulatedBackend::write(unsigned block_no, const uint8_t *blk)
+{
+    return write_run(block_no, 1, blk);
+}
+
+int
+EmulatedBackend::read_run(unsigned first, unsigned count, uint8_t *buf)
+{
+    begin(first, count);
+    int ret_val = inner->read_run(first, count, buf);
+    end();
+    return ret_val;
+}
+
+int
+EmulatedBackend::write_run(unsigned first, unsigned count, const uint8_t *buf)
+{
+    begin(first, count);
+    int ret_val = inner->write_run(first, count, buf);
+    end();
+    return ret_val;
+}
+
+int
+EmulatedBackend::copy(unsigned from, unsigned to, unsigned count, bool *offloaded)
+{
+    std::vector<uint8_t> buf((size_t)count * BLOCK_SIZE);
+    *offloaded = false;
+    if (read_run(from, count, &buf[0]) != 0)
+        return -1;
+    return write_run(to, count, &buf[0]);
+}
+
+// the I/O class of the calling thread's requests, see set_io_class
+static thread_local int thread_io_class = IO_FOREGROUND;
+
+Disk::Disk(const std::string& name, const disk_config& config)
+    : dirty_age(config.dirty_age_ms)
+{
+    if (config.backend == DISK_BACKEND_MEMORY)
+        backend = new MemoryBackend(name, disk_size);
+    else
+        backend = new FileBackend(name, disk_size);
+    if (config.emulate)
+        backend = new EmulatedBackend(backend, config.model, no_blocks);
+    sched = new IoScheduler(backend);
+    sched->set_depth(backend->queue_depth());
+    reset_stats();
+    sched->set_budget(IO_READAHEAD, config.readahead_budget);
+    sched->set_budget(IO_BACKGROUND, config.background_budget);
+    cache_capacity = config.cache_blocks;
+    readahead_max = config.readahead_blocks;
+    ra_stop = false;
+    write_back = config.write_back;
+    dirty_limit = std::max(1u, no_blocks * config.dirty_ratio / 100);
+    dirty_gen = 0;
+    flusher_stop = false;
+    flusher_kick = false;
+    if (write_back && backend->is_open())
+        flusher = std::thread(&Disk::flusher_worker, this);
+}
+
+Disk::~Disk()
+{
+    if (ra_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(ra_lock);
+            ra_stop = true;
+        }
+        ra_work.notify_all();
+        ra_thread.join();
+    }
+    if (flusher.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(dirty_lock);
+            flusher_stop = true;
+        }
+        flusher_wake.notify_all();
+        flusher.join();
+        write_out(true, NULL);
+    }
+    delete sched;
+    delete backend;
 }
 
-// writes one block to the disk
+// writes one block to the disk, flushing it unless told not to
 int
-Disk::write(unsigned block_no, uint8_t *blk)
+Disk::write(unsigned block_no, uint8_t *blk, bool flush)
 {
+    TraceSpan span("Disk::write", "disk", block_no);
     if (DEBUG)
         std::cout << "Disk::write(" << block_no << ")\n";
     // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+    if (block_no >= no_blocks)
+        return -1;
+    ra_drop(block_no);
+    if (write_back) {
+        bool kick;
+        {
+            std::lock_guard<std::mutex> guard(dirty_lock);
+            dirty_block& d = dirty[block_no];
+            if (d.data.empty())
+                d.since = std::chrono::steady_clock::now();
+            d.data.assign(blk, blk + BLOCK_SIZE);
+            d.gen = ++dirty_gen;
+            kick = dirty.size() >= dirty_limit && !flusher_kick;
+            if (kick)
+                flusher_kick = true;
+        }
+        if (kick)
+            flusher_wake.notify_one();
+        flush = false;
+    } else if (sched->write(block_no, 1, blk, thread_io_class) != 0) {
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    if (flush && backend->flush() != 0)
+        return -1;
+    cache_insert(block_no, blk);
+    count_access(block_no);
+    stats.writes++;
+    stats.bytes_written += BLOCK_SIZE;
+    if (flush)
+        stats.flushes++;
     return 0;
 }
 
+// flushes all earlier unflushed writes to the disk
+void
+Disk::flush()
+{
+    if (write_back)
+        return;
+    TraceSpan span("Disk::flush", "disk");
+    backend->flush();
+    stats.flushes++;
+}
+
+void
+Disk::reset_stats()
+{
+    memset(&stats, 0, sizeof(stats));
+    written_back = 0;
+    write_runs = 0;
+    sched->reset_stats();
+    last_block = -1;
+}
+
+// The counters of the flusher and the scheduler are kept apart, they are
+// counted on other threads too
+const disk_stats&
+Disk::get_stats()
+{
+    iosched_stats s;
+    sched->get_stats(&s);
+    stats.written_back = written_back;
+    stats.write_runs = write_runs;
+    stats.dispatches = s.dispatches;
+    stats.merged = s.merged;
+    stats.throttled = s.throttled;
+    return stats;
+}
+
+// Sorts an access into sequential or random
+void
+Disk::count_access(unsigned block_no)
+{
+    int next = last_block + 1;
+    if ((int)block_no == next || (int)block_no == last_block) {
+        stats.sequential++;
+    } else {
+        stats.random++;
+        stats.seeks++;
+        stats.seek_distance += (int)block_no > next ? block_no - next : next - block_no;
+    }
+    last_block = block_no;
+}
+
+// Copies a cached block into blk and makes it the most recently used
+bool
+Disk::cache_lookup(unsigned block_no, uint8_t *blk)
+{
+    std::unordered_map<unsigned, std::list<cache_entry>::iterator>::iterator it = cache_index.find(block_no);
+    if (it == cache_index.end())
+        return false;
+    cache.splice(cache.begin(), cache, it->second);
+    memcpy(blk, &it->second->data[0], BLOCK_SIZE);
+    return true;
+}
+
+// Puts a block first in the cache, evicting the least recently used block
+// if the cache is full. The evicted node is reused for the new block.
+void
+Disk::cache_insert(unsigned block_no, const uint8_t *blk)
+{
+    if (cache_capacity == 0)
+        return;
+    std::unordered_map<unsigned, std::list<cache_entry>::iterator>::iterator it = cache_index.find(block_no);
+    if (it != cache_index.end()) {
+        cache.splice(cache.begin(), cache, it->second);
+    } else if (cache.size() < cache_capacity) {
+        cache.push_front(cache_entry());
+        cache.front().data.resize(BLOCK_SIZE);
+    } else {
+        cache_index.erase(cache.back().block_no);
+        cache.splice(cache.begin(), cache, --cache.end());
+    }
+    cache.front().block_no = block_no;
+    memcpy(&cache.front().data[0], blk, BLOCK_SIZE);
+    cache_index[block_no] = cache.begin();
+}
+
+// Drops a block from the cache, after it changed behind the cache's back
+void
+Disk::cache_erase(unsigned block_no)
+{
+    std::unordered_map<unsigned, std::list<cache_entry>::iterator>::iterator it = cache_index.find(block_no);
+    if (it == cache_index.end())
+        return;
+    cache.erase(it->second);
+    cache_index.erase(it);
+}
+
 // reads one block from the disk
 int
 Disk::read(unsigned block_no, uint8_t *blk)
 {
+    TraceSpan span("Disk::read", "disk", block_no);
     if (DEBUG)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+    if (block_no >= no_blocks)
         return -1;
+    if (cache_lookup(block_no, blk) || (write_back && dirty_lookup(block_no, blk))) {
+        stats.cache_hits++;
+        return 0;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    if (ra_take(block_no, blk))
+        stats.readahead_hits++;
+    else if (sched->read(block_no, 1, blk, thread_io_class) != 0)
+        return -1;
+    cache_insert(block_no, blk);
+    count_access(block_no);
+    stats.reads++;
+    stats.bytes_read += BLOCK_SIZE;
     return 0;
 }
+
+// copies count blocks starting at from to the blocks starting at to
+int
+Disk::copy(unsigned from, unsigned to, unsigned count, bool flush)
+{
+    TraceSpan span("Disk::copy", "disk", from);
+    if (DEBUG)
+        std::cout << "Disk::copy(" << from << ", " << to << ", " << count << ")\n";
+    if (count == 0)
+        return 0;
+    if (from + count > no_blocks || to + count > no_blocks ||
+        (from < to + count && to < from + count))
+        return -1;
+    // the backend copies what it has, so it must have the sources. What
+    // is dirty of the targets is overwritten by the copy and must not be
+    // written out after it.
+    if (write_back) {
+        std::vector<unsigned> sources;
+        for (unsigned i = 0; i < count; i++)
+            sources.push_back(from + i);
+        if (write_out(false, &sources) != 0)
+            return -1;
+        std::lock_guard<std::mutex> out_guard(write_out_lock);
+        std::lock_guard<std::mutex> guard(dirty_lock);
+        for (unsigned i = 0; i < count; i++)
+            dirty.erase(to + i);
+    }
+    for (unsigned i = 0; i < count; i++)
+        ra_drop(to + i);
+    bool offloaded;
+    if (sched->copy(from, to, count, &offloaded, thread_io_class) != 0)
+        return -1;
+    if (flush && backend->flush() != 0)
+        return -1;
+
+    // the copies are only as fresh in the cache as their sources
+    uint8_t blk[BLOCK_SIZE];
+    for (unsigned i = 0; i < count; i++) {
+        std::unordered_map<unsigned, std::list<cache_entry>::iterator>::iterator it = cache_index.find(from + i);
+        if (it != cache_index.end()) {
+            memcpy(blk, &it->second->data[0], BLOCK_SIZE);
+            cache_insert(to + i, blk);
+        } else {
+            cache_erase(to + i);
+        }
+    }
+    for (unsigned i = 0; i < count; i++)
+        count_access(from + i);
+    for (unsigned i = 0; i < count; i++)
+        count_access(to + i);
+    stats.reads += count;
+    stats.writes += count;
+    stats.bytes_read += (uint64_t)count * BLOCK_SIZE;
+    stats.bytes_written += (uint64_t)count * BLOCK_SIZE;
+    if (offloaded)
+        stats.offloaded += 2 * count;
+    if (flush)
+        stats.flushes++;
+    return 0;
+}
+
+// tells the backend count blocks from first are free. A write out that
+// is running could put a dropped dirty block back over the hole, so it is
+// waited for.
+int
+Disk::discard(unsigned first, unsigned count)
+{
+    TraceSpan span("Disk::discard", "disk", first);
+    if (first + count > no_blocks)
+        return -1;
+    if (write_back) {
+        std::lock_guard<std::mutex> out_guard(write_out_lock);
+        std::lock_guard<std::mutex> guard(dirty_lock);
+        for (unsigned i = 0; i < count; i++)
+            dirty.erase(first + i);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        ra_drop(first + i);
+        cache_erase(first + i);
+    }
+    if (sched->discard(first, count, thread_io_class) != 0)
+        return -1;
+    stats.discarded += count;
+    return 0;
+}
+
+// starts reading blocks in the background, in the order given
+void
+Disk::prefetch(const std::vector<unsigned>& blocks)
+{
+    std::lock_guard<std::mutex> guard(ra_lock);
+    // what is no longer asked for goes, except the block being read
+    std::unordered_set<unsigned> wanted(blocks.begin(), blocks.end());
+    for (std::unordered_map<unsigned, ra_block>::iterator it = ra_blocks.begin(); it != ra_blocks.end(); ) {
+        if (it->second.state == RA_READING || wanted.count(it->first)) {
+            ++it;
+            continue;
+        }
+        if (it->second.state == RA_READY)
+            stats.readahead_unused++;
+        it = ra_blocks.erase(it);
+    }
+
+    ra_queue.clear();
+    for (size_t i = 0; i < blocks.size(); i++) {
+        unsigned block_no = blocks[i];
+        if (block_no >= no_blocks || cache_index.count(block_no))
+            continue;
+        if (write_back) {
+            std::lock_guard<std::mutex> dirty_guard(dirty_lock);
+            if (dirty.count(block_no))
+                continue;
+        }
+        std::unordered_map<unsigned, ra_block>::iterator it = ra_blocks.find(block_no);
+        if (it == ra_blocks.end())
+            ra_blocks[block_no].state = RA_QUEUED;
+        else if (it->second.state != RA_QUEUED)
+            continue;
+        ra_queue.push_back(block_no);
+    }
+    if (ra_queue.empty())
+        return;
+    if (!ra_thread.joinable())
+        ra_thread = std::thread(&Disk::readahead_worker, this);
+    ra_work.notify_one();
+}
+
+// Reads the queued blocks until the Disk goes away. The backend is only
+// used without ra_lock held, so reads and writes of other blocks go on.
+void
+Disk::readahead_worker()
+{
+    set_io_class(IO_READAHEAD);
+    std::vector<uint8_t> buf;
+    std::vector<ra_block*> run;
+    std::unique_lock<std::mutex> guard(ra_lock);
+    while (true) {
+        ra_work.wait(guard, [this] { return ra_stop || !ra_queue.empty(); });
+        if (ra_stop)
+            return;
+
+        // the queued blocks that follow the first on the disk come along
+        unsigned first = ra_queue.front();
+        run.clear();
+        while (!ra_queue.empty() && ra_queue.front() == first + run.size()) {
+            std::unordered_map<unsigned, ra_block>::iterator it = ra_blocks.find(ra_queue.front());
+            if (it == ra_blocks.end() || it->second.state != RA_QUEUED)
+                break;
+            it->second.state = RA_READING;
+            run.push_back(&it->second);
+            ra_queue.pop_front();
+        }
+        if (run.empty()) {
+            ra_queue.pop_front();
+            continue;
+        }
+
+        // nobody drops a block while it is being read, and the nodes of
+        // ra_blocks stay where they are, so the run is ours until it is ready
+        buf.resize(run.size() * BLOCK_SIZE);
+        guard.unlock();
+        bool ok = sched->read(first, run.size(), &buf[0], IO_READAHEAD) == 0;
+        guard.lock();
+        for (size_t i = 0; i < run.size(); i++) {
+            run[i]->ok = ok;
+            run[i]->data.assign(&buf[i * BLOCK_SIZE], &buf[(i + 1) * BLOCK_SIZE]);
+            run[i]->state = RA_READY;
+        }
+        ra_done.notify_all();
+    }
+}
+
+// Copies a block read ahead into blk, waiting for it if it is being read.
+// False if it was not read ahead, or could not be, and must be read now.
+bool
+Disk::ra_take(unsigned block_no, uint8_t *blk)
+{
+    std::unique_lock<std::mutex> guard(ra_lock);
+    std::unordered_map<unsigned, ra_block>::iterator it = ra_blocks.find(block_no);
+    if (it == ra_blocks.end())
+        return false;
+    if (it->second.state == RA_READING) {
+        TraceSpan span("Disk::readahead_wait", "disk", block_no);
+        ra_done.wait(guard, [&] { return it->second.state == RA_READY; });
+    }
+    bool ok = it->second.state == RA_READY && it->second.ok;
+    if (ok)
+        memcpy(blk, &it->second.data[0], BLOCK_SIZE);
+    ra_blocks.erase(it);
+    return ok;
+}
+
+// Forgets a block read ahead, before it is written. One being read is
+// waited for, so the backend never reads and writes a block at once.
+void
+Disk::ra_drop(unsigned block_no)
+{
+    std::unique_lock<std::mutex> guard(ra_lock);
+    std::unordered_map<unsigned, ra_block>::iterator it = ra_blocks.find(block_no);
+    if (it == ra_blocks.end())
+        return;
+    if (it->second.state == RA_READING)
+        ra_done.wait(guard, [&] { return it->second.state == RA_READY; });
+    if (it->second.state == RA_READY)
+        stats.readahead_unused++;
+    ra_blocks.erase(it);
+}
+
+// Copies a dirty block into blk, if it is one
+bool
+Disk::dirty_lookup(unsigned block_no, uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(dirty_lock);
+    std::map<unsigned, dirty_block>::iterator it = dirty.find(block_no);
+    if (it == dirty.end())
+        return false;
+    memcpy(blk, &it->second.data[0], BLOCK_SIZE);
+    return true;
+}
+
+// Wakes up every half dirty age to write out the blocks that have been
+// dirty for long enough, and writes out all of them when kicked
+void
+Disk::flusher_worker()
+{
+    set_io_class(IO_BACKGROUND);
+    std::chrono::milliseconds period = std::max(dirty_age / 2, std::chrono::milliseconds(1));
+    std::unique_lock<std::mutex> guard(dirty_lock);
+    while (!flusher_stop) {
+        flusher_wake.wait_for(guard, period, [this] { return flusher_stop || flusher_kick; });
+        if (flusher_stop)
+            break;
+        bool all = flusher_kick;
+        guard.unlock();
+        write_out(all, NULL);
+        guard.lock();
+        if (all)
+            flusher_kick = false;
+    }
+}
+
+// Writes out the dirty blocks, all of them, those in only (sorted), or
+// else those dirty for dirty_age, and flushes. The blocks are taken in
+// block order so that blocks in a row go to the backend as one request.
+// A block written again meanwhile stays dirty, as does one that failed.
+int
+Disk::write_out(bool all, const std::vector<unsigned> *only)
+{
+    std::lock_guard<std::mutex> out_guard(write_out_lock);
+    std::vector<std::pair<unsigned, uint64_t> > taken;
+    std::vector<uint8_t> buf;
+    {
+        std::lock_guard<std::mutex> guard(dirty_lock);
+        std::chrono::steady_clock::time_point old = std::chrono::steady_clock::now() - dirty_age;
+        for (std::map<unsigned, dirty_block>::iterator it = dirty.begin(); it != dirty.end(); ++it) {
+            if (only ? !std::binary_search(only->begin(), only->end(), it->first) :
+                !all && it->second.since > old)
+                continue;
+            taken.push_back(std::make_pair(it->first, it->second.gen));
+            buf.insert(buf.end(), it->second.data.begin(), it->second.data.end());
+        }
+    }
+    if (taken.empty())
+        return 0;
+
+    TraceSpan span("Disk::write_out", "disk", taken.size());
+    int ret_val = 0;
+    std::vector<bool> done(taken.size(), false);
+    for (size_t i = 0; i < taken.size(); ) {
+        size_t n = 1;
+        while (i + n < taken.size() && taken[i + n].first == taken[i].first + n)
+            n++;
+        if (sched->write(taken[i].first, n, &buf[i * BLOCK_SIZE], thread_io_class) == 0) {
+            std::fill(done.begin() + i, done.begin() + i + n, true);
+            written_back += n;
+            write_runs++;
+        } else {
+            ret_val = -1;
+        }
+        i += n;
+    }
+    if (backend->flush() != 0)
+        return -1;
+
+    std::lock_guard<std::mutex> guard(dirty_lock);
+    for (size_t i = 0; i < taken.size(); i++) {
+        std::map<unsigned, dirty_block>::iterator it = dirty.find(taken[i].first);
+        if (done[i] && it != dirty.end() && it->second.gen == taken[i].second)
+            dirty.erase(it);
+    }
+    return ret_val;
+}
+
+// writes every dirty block out and flushes
+int
+Disk::sync()
+{
+    if (!write_back)
+        return 0;
+    return write_out(true, NULL);
+}
+
+// writes the given blocks out, if dirty, and flushes
+int
+Disk::sync(const std::vector<unsigned>& blocks)
+{
+    if (!write_back)
+        return 0;
+    std::vector<unsigned> sorted(blocks);
+    std::sort(sorted.begin(), sorted.end());
+    return write_out(false, &sorted);
+}
+
+unsigned
+Disk::get_dirty_blocks()
+{
+    std::lock_guard<std::mutex> guard(dirty_lock);
+    return dirty.size();
+}
+
+void
+Disk::set_io_class(int io_class)
+{
+    thread_io_class = io_class;
+}
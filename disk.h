@@ -1,5 +1,17 @@
 #include <iostream>
-#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "iosched.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
@@ -8,21 +20,297 @@
 #define BLOCK_SIZE 4096
 #define DEBUG false
 
+// Where the blocks of a Disk are kept
+#define DISK_BACKEND_FILE 0     // the image file, through pread/pwrite
+#define DISK_BACKEND_MEMORY 1   // a copy of the image in memory, never written back
+
+// A device for EmulatedBackend to act like. Every request takes
+// latency_us, plus up to seek_us to get to its first block from where the
+// last request ended, growing with the square root of the distance as a
+// disk arm does. Then its bytes go over a bus of mb_per_sec that requests
+// take turns on. queue_depth requests are served at once, the others wait.
+// A 0 leaves that part out.
+struct device_model {
+    unsigned latency_us;
+    unsigned seek_us;           // to cross the whole disk
+    unsigned mb_per_sec;
+    unsigned queue_depth;
+};
+
+// fills in *model from "hdd", "ssd", "nvme", or
+// "latency_us[,seek_us[,mb_per_sec[,queue_depth]]]". False if it is none of them.
+bool parse_device_model(const std::string& spec, device_model *model);
+
+#define READAHEAD_MAX 32         // default largest readahead window, in blocks
+#define DIRTY_AGE_MS 1000         // default age at which a dirty block is written back
+#define DIRTY_RATIO 10            // default percentage of the disk that may be dirty
+
+// How a Disk is set up, the defaults are the plain image file. With write
+// back, writes only go to memory and a flusher thread writes the blocks
+// out once they have been dirty for dirty_age_ms, or all of them once
+// dirty_ratio percent of the disk is dirty, or on sync. What was written
+// less than that long ago is lost if the process dies.
+struct disk_config {
+    int backend;                // DISK_BACKEND_*
+    unsigned cache_blocks;      // size of the LRU block cache, 0 for none
+    unsigned readahead_blocks;  // most blocks read ahead of a file read, 0 for none
+    bool write_back;
+    unsigned dirty_age_ms;
+    unsigned dirty_ratio;
+    // blocks a second the readahead and background classes may move, 0 for
+    // no limit, see IoScheduler
+    unsigned readahead_budget;
+    unsigned background_budget;
+    // makes the backend as slow as model, see EmulatedBackend
+    bool emulate;
+    device_model model;
+    disk_config() : backend(DISK_BACKEND_FILE), cache_blocks(0), readahead_blocks(READAHEAD_MAX),
+                    write_back(false), dirty_age_ms(DIRTY_AGE_MS), dirty_ratio(DIRTY_RATIO),
+                    readahead_budget(0), background_budget(0), emulate(false) {}
+};
+
+// What the disk has been asked to do. An access is sequential if it is to
+// the block right after (or the same block as) the access before it, any
+// other access is random and costs a seek. Reads served by the block
+// cache never reach the backend and only count as cache hits.
+struct disk_stats {
+    uint64_t reads;             // blocks read
+    uint64_t writes;            // blocks written
+    uint64_t flushes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t seeks;             // same as random, kept for readability
+    uint64_t seek_distance;     // blocks skipped over by all seeks
+    uint64_t sequential;
+    uint64_t random;
+    uint64_t cache_hits;        // reads served by the block cache
+    uint64_t readahead_hits;    // of the reads, those already read ahead
+    uint64_t readahead_unused;  // blocks read ahead and dropped unread, not in reads
+    uint64_t offloaded;         // of the blocks read and written, those copied by
+                                // the host kernel without passing through us
+    uint64_t written_back;      // blocks the flusher or a sync wrote out later
+    uint64_t write_runs;        // requests they took, blocks in a row go together
+    uint64_t dispatches;        // requests the backend got from the scheduler
+    uint64_t merged;            // requests that went along with another one
+    uint64_t throttled;         // times the scheduler held requests back for budget
+    uint64_t discarded;         // blocks given back to the host, see Disk::discard
+};
+
+// Storage for the blocks of a Disk. Blocks are always whole and in range,
+// Disk checks that before calling.
+class DiskBackend {
+public:
+    virtual ~DiskBackend() {}
+    virtual bool is_open() = 0;
+    virtual int read(unsigned block_no, uint8_t *blk) = 0;
+    virtual int write(unsigned block_no, const uint8_t *blk) = 0;
+    virtual int flush() = 0;
+    // copies count blocks from from to to, the ranges do not overlap. Sets
+    // *offloaded if the copy never passed through our memory. The default
+    // goes through read and write one block at a time.
+    virtual int copy(unsigned from, unsigned to, unsigned count, bool *offloaded);
+    // reads count blocks in a row from first into buf as one request. The
+    // default reads them one at a time.
+    virtual int read_run(unsigned first, unsigned count, uint8_t *buf);
+    // writes count blocks in a row from first, the same way
+    virtual int write_run(unsigned first, unsigned count, const uint8_t *buf);
+    // tells the storage count blocks from first are no longer used, so it
+    // can drop them. They read as anything after. The default keeps them.
+    virtual int discard(unsigned first, unsigned count) { return 0; }
+    // how many requests it serves at once
+    virtual unsigned queue_depth() { return 1; }
+};
+
+// The image file. pwrite hands the data to the kernel right away, so there
+// is nothing to flush on our side.
+class FileBackend : public DiskBackend {
+private:
+    int fd;
+    // cleared once the host says no, so it is not asked on every copy
+    bool can_clone;
+    bool can_copy_range;
+    bool can_punch;
+public:
+    // opens the image `name`, creating it at disk_size bytes if needed
+    FileBackend(const std::string& name, unsigned disk_size);
+    ~FileBackend();
+    bool is_open() { return fd != -1; }
+    int read(unsigned block_no, uint8_t *blk);
+    int write(unsigned block_no, const uint8_t *blk);
+    int flush() { return 0; }
+    // shares the blocks with FICLONERANGE where the host file system can
+    // reflink, else moves them inside the kernel with copy_file_range
+    int copy(unsigned from, unsigned to, unsigned count, bool *offloaded);
+    int read_run(unsigned first, unsigned count, uint8_t *buf);
+    int write_run(unsigned first, unsigned count, const uint8_t *buf);
+    // punches a hole in the image, so the host frees the space
+    int discard(unsigned first, unsigned count);
+};
+
+// The whole disk in memory. Starts as a copy of the image `name` if it
+// exists, else zeroed. Nothing is written back, the image is left alone.
+class MemoryBackend : public DiskBackend {
+private:
+    std::vector<uint8_t> data;
+public:
+    MemoryBackend(const std::string& name, unsigned disk_size);
+    bool is_open() { return true; }
+    int read(unsigned block_no, uint8_t *blk);
+    int write(unsigned block_no, const uint8_t *blk);
+    int flush() { return 0; }
+    int copy(unsigned from, unsigned to, unsigned count, bool *offloaded);
+    int read_run(unsigned first, unsigned count, uint8_t *buf);
+    int write_run(unsigned first, unsigned count, const uint8_t *buf);
+    // zeroes the blocks, as a hole in the image would read
+    int discard(unsigned first, unsigned count);
+};
+
+// Another backend, slowed down to act like a device_model. Each request
+// waits for a free slot in the queue, then sleeps as long as the device
+// would take, then goes to the backend underneath. Copies go through
+// memory, a device has no host to offload them to.
+class EmulatedBackend : public DiskBackend {
+private:
+    DiskBackend *inner;
+    device_model model;
+    unsigned no_blocks;
+    std::mutex lock;                // everything below
+    std::condition_variable slot_free;
+    unsigned busy_slots;
+    unsigned head;                  // block after the last request
+    std::chrono::steady_clock::time_point bus_free; // when the booked transfers are done
+    void begin(unsigned first, unsigned count);
+    void end();
+public:
+    // takes over inner, which is deleted with it
+    EmulatedBackend(DiskBackend *inner, const device_model& model, unsigned no_blocks);
+    ~EmulatedBackend();
+    bool is_open() { return inner->is_open(); }
+    int read(unsigned block_no, uint8_t *blk);
+    int write(unsigned block_no, const uint8_t *blk);
+    int flush() { return inner->flush(); }
+    int copy(unsigned from, unsigned to, unsigned count, bool *offloaded);
+    int read_run(unsigned first, unsigned count, uint8_t *buf);
+    int write_run(unsigned first, unsigned count, const uint8_t *buf);
+    // a discard is only a hint to the device and is not made to wait
+    int discard(unsigned first, unsigned count) { return inner->discard(first, count); }
+    unsigned queue_depth() { return model.queue_depth ? model.queue_depth : 1; }
+};
+
 class Disk {
 private:
-    std::fstream diskfile;
+    DiskBackend *backend;
+    // every read and write of the backend goes through it, but flushes
+    IoScheduler *sched;
     const unsigned no_blocks = 2048;
     const unsigned disk_size = BLOCK_SIZE * no_blocks;
-    bool disk_file_exists (const std::string& name);
+    disk_stats stats;
+    int last_block;             // block of the last access, -1 before the first
+
+    // LRU block cache, write-through. Most recently used block first, the
+    // index finds a block's node in the list.
+    struct cache_entry {
+        unsigned block_no;
+        std::vector<uint8_t> data;
+    };
+    unsigned cache_capacity;
+    std::list<cache_entry> cache;
+    std::unordered_map<unsigned, std::list<cache_entry>::iterator> cache_index;
+    bool cache_lookup(unsigned block_no, uint8_t *blk);
+    void cache_insert(unsigned block_no, const uint8_t *blk);
+    void cache_erase(unsigned block_no);
+
+    // Readahead. prefetch queues blocks for the readahead thread, which
+    // reads them from the backend into ra_blocks, blocks next to each other
+    // on the disk as one request. read takes
+    // a block from there, waiting for it if it is being read, and a write
+    // drops it. The thread is started by the first prefetch.
+    enum ra_state { RA_QUEUED, RA_READING, RA_READY };
+    struct ra_block {
+        ra_state state;
+        bool ok;
+        std::vector<uint8_t> data;
+    };
+    unsigned readahead_max;
+    std::thread ra_thread;
+    std::mutex ra_lock;
+    std::condition_variable ra_work;    // blocks queued, or ra_stop set
+    std::condition_variable ra_done;    // a block is RA_READY
+    std::deque<unsigned> ra_queue;      // may hold blocks no longer RA_QUEUED
+    std::unordered_map<unsigned, ra_block> ra_blocks;
+    bool ra_stop;
+    void readahead_worker();
+    bool ra_take(unsigned block_no, uint8_t *blk);
+    void ra_drop(unsigned block_no);
+
+    // Write back, see disk_config. Written blocks wait in dirty, in block
+    // order, until write_out writes them in runs. gen tells whether a block
+    // was written again while it was being written out. Only one write_out
+    // runs at a time, the flusher's or a sync's.
+    struct dirty_block {
+        std::vector<uint8_t> data;
+        std::chrono::steady_clock::time_point since;    // when it became dirty
+        uint64_t gen;
+    };
+    bool write_back;
+    std::chrono::milliseconds dirty_age;
+    unsigned dirty_limit;               // dirty blocks that start a write out of all
+    std::thread flusher;
+    std::mutex dirty_lock;              // everything down to flusher_kick
+    std::condition_variable flusher_wake;
+    std::map<unsigned, dirty_block> dirty;
+    uint64_t dirty_gen;
+    bool flusher_stop;
+    bool flusher_kick;                  // write out all, not just the old blocks
+    std::mutex write_out_lock;
+    std::atomic<uint64_t> written_back;
+    std::atomic<uint64_t> write_runs;
+    void flusher_worker();
+    int write_out(bool all, const std::vector<unsigned> *only);
+    bool dirty_lookup(unsigned block_no, uint8_t *blk);
+
+    void count_access(unsigned block_no);
 public:
-    Disk();
+    // opens the disk image `name`, creating it if it does not exist
+    Disk(const std::string& name = DISKNAME, const disk_config& config = disk_config());
     ~Disk();
+    // whether the disk image could be opened
+    bool is_open() { return backend->is_open(); }
     unsigned get_no_blocks() { return no_blocks; }
     unsigned get_disk_size() { return disk_size; }
-    // writes one block to the disk
-    int write(unsigned block_no, uint8_t *blk);
+    // I/O done since the disk was opened or the stats were last reset
+    const disk_stats& get_stats();
+    void reset_stats();
+    // writes one block to the disk, flushing it unless told not to. With
+    // write back it is only marked dirty, and flush is ignored.
+    int write(unsigned block_no, uint8_t *blk, bool flush = true);
+    // flushes all earlier unflushed writes to the disk, with write back
+    // that is left to the flusher
+    void flush();
+    // writes every dirty block out and flushes, as the flusher does when
+    // it is time. Without write back there is nothing to write.
+    int sync();
+    // the same for the given blocks only
+    int sync(const std::vector<unsigned>& blocks);
+    unsigned get_dirty_blocks();
+    // the IO_* class of the requests of the calling thread from now on,
+    // IO_FOREGROUND until set
+    static void set_io_class(int io_class);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // copies count blocks starting at from to the blocks starting at to,
+    // letting the host kernel move the data where it can. The ranges must
+    // not overlap. Counts as count reads and writes, flushed unless told not to.
+    int copy(unsigned from, unsigned to, unsigned count, bool flush = true);
+    // tells the backend count blocks from first are free, dropping them
+    // from the cache and whatever writes of them have not gone out yet
+    int discard(unsigned first, unsigned count);
+    // starts reading blocks in the background, in the order given, so a
+    // read of them finds them ready. Replaces what the last call asked for
+    // and was not read yet. Cached blocks are skipped.
+    void prefetch(const std::vector<unsigned>& blocks);
+    // the largest window prefetch is meant to be given, 0 if readahead is off
+    unsigned get_readahead_max() { return readahead_max; }
 };
 
 #endif // __DISK_H__
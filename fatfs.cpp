@@ -0,0 +1,186 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "fatfs.h"
+#include "fs.h"
+
+// The C handle is just the C++ file system
+struct fatfs {
+    FS filesystem;
+    fatfs(const std::string& image) : filesystem(image) {}
+};
+
+// Copies len bytes into a new malloc'd buffer with a '\0' after them
+static char *
+copy_out(const char *data, size_t len)
+{
+    char *copy = (char*)malloc(len + 1);
+    if(copy == NULL)
+        return NULL;
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+fatfs *
+fatfs_open(const char *image)
+{
+    fatfs *fs = new (std::nothrow) fatfs(image ? image : DISKNAME);
+    if(fs != NULL && !fs->filesystem.mounted()){
+        delete fs;
+        return NULL;
+    }
+    return fs;
+}
+
+void
+fatfs_close(fatfs *fs)
+{
+    delete fs;
+}
+
+const char *
+fatfs_strerror(int status)
+{
+    switch(status){
+    case FS_OK:             return "Success";
+    case FS_ENOENT:         return "No such file or directory";
+    case FS_EEXIST:         return "File exists";
+    case FS_EACCES:         return "Permission denied";
+    case FS_EISDIR:         return "Is a directory";
+    case FS_ENOTDIR:        return "Not a directory";
+    case FS_ENOSPC:         return "No space left on disk";
+    case FS_EDIRFULL:       return "Directory is full";
+    case FS_ENAMETOOLONG:   return "File name too long";
+    case FS_EINVAL:         return "Invalid argument";
+    case FS_ENOTEMPTY:      return "Directory not empty";
+    case FS_EIO:            return "Input/output error";
+    case FS_ENOMEM:         return "Out of memory";
+    default:                return "Unknown error";
+    }
+}
+
+void
+fatfs_free(void *ptr)
+{
+    free(ptr);
+}
+
+int
+fatfs_format(fatfs *fs)
+{
+    return fs->filesystem.format();
+}
+
+int
+fatfs_create(fatfs *fs, const char *filepath, const char *data, size_t len)
+{
+    return fs->filesystem.create(filepath, std::string(data, len));
+}
+
+int
+fatfs_cat(fatfs *fs, const char *filepath, char **data, size_t *len)
+{
+    std::string content;
+    int ret_val = fs->filesystem.cat(filepath, &content);
+    if(ret_val != FS_OK)
+        return ret_val;
+    *data = copy_out(content.data(), content.length());
+    if(*data == NULL)
+        return FS_ENOMEM;
+    *len = content.length();
+    return FS_OK;
+}
+
+int
+fatfs_ls(fatfs *fs, struct dir_entry **entries, size_t *count)
+{
+    std::vector<dir_entry> list;
+    int ret_val = fs->filesystem.ls(&list);
+    if(ret_val != FS_OK)
+        return ret_val;
+    *entries = (dir_entry*)malloc(list.size() * sizeof(dir_entry) + 1);
+    if(*entries == NULL)
+        return FS_ENOMEM;
+    if(!list.empty())
+        memcpy(*entries, &list[0], list.size() * sizeof(dir_entry));
+    *count = list.size();
+    return FS_OK;
+}
+
+int
+fatfs_stat(fatfs *fs, const char *path, struct dir_entry *entry)
+{
+    return fs->filesystem.stat(path, entry);
+}
+
+int
+fatfs_cp(fatfs *fs, const char *sourcepath, const char *destpath)
+{
+    return fs->filesystem.cp(sourcepath, destpath);
+}
+
+int
+fatfs_mv(fatfs *fs, const char *sourcepath, const char *destpath)
+{
+    return fs->filesystem.mv(sourcepath, destpath);
+}
+
+int
+fatfs_rm(fatfs *fs, const char *filepath)
+{
+    return fs->filesystem.rm(filepath);
+}
+
+int
+fatfs_append(fatfs *fs, const char *filepath1, const char *filepath2)
+{
+    return fs->filesystem.append(filepath1, filepath2);
+}
+
+int
+fatfs_mkdir(fatfs *fs, const char *dirpath)
+{
+    return fs->filesystem.mkdir(dirpath);
+}
+
+int
+fatfs_cd(fatfs *fs, const char *dirpath)
+{
+    return fs->filesystem.cd(dirpath);
+}
+
+int
+fatfs_pwd(fatfs *fs, char **path)
+{
+    std::string cwd;
+    int ret_val = fs->filesystem.pwd(&cwd);
+    if(ret_val != FS_OK)
+        return ret_val;
+    *path = copy_out(cwd.data(), cwd.length());
+    return *path == NULL ? FS_ENOMEM : FS_OK;
+}
+
+int
+fatfs_chmod(fatfs *fs, int accessrights, const char *filepath)
+{
+    return fs->filesystem.chmod(accessrights, filepath);
+}
+
+int
+fatfs_sync(fatfs *fs)
+{
+    return fs->filesystem.sync();
+}
+
+int
+fatfs_fsync(fatfs *fs, const char *filepath)
+{
+    return fs->filesystem.fsync(filepath);
+}
+
+int
+fatfs_fallocate(fatfs *fs, const char *filepath, uint32_t size)
+{
+    return fs->filesystem.fallocate(filepath, size);
+}
@@ -0,0 +1,88 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __FATFS_H__
+#define __FATFS_H__
+
+// Public interface of libfatfs, usable from both C and C++. None of the
+// calls print anything, they return one of the status codes below and
+// hand back any data through their out parameters.
+
+#define FS_OK 0
+#define FS_ENOENT 1         // file or directory does not exist
+#define FS_EEXIST 2         // a file or directory with that name already exists
+#define FS_EACCES 3         // access rights do not allow the operation
+#define FS_EISDIR 4         // operation needs a file but got a directory
+#define FS_ENOTDIR 5        // a path component is not a directory
+#define FS_ENOSPC 6         // no free blocks left on the disk
+#define FS_EDIRFULL 7       // no free entry left in the directory
+#define FS_ENAMETOOLONG 8   // name does not fit in a dir_entry
+#define FS_EINVAL 9         // malformed argument
+#define FS_ENOTEMPTY 10     // directory is not empty
+#define FS_EIO 11           // the disk could not be read or written
+#define FS_ENOMEM 12        // out of memory (C API only)
+
+#define TYPE_FILE 0
+#define TYPE_DIR 1
+#define TYPE_EXT 2          // holds part of the entry before it, never listed
+#define TYPE_ORPHAN 3       // a removed file whose blocks are not free yet, never listed
+#define READ 0x04
+#define WRITE 0x02
+#define EXECUTE 0x01
+#define COMPRESS 0x10       // compress the file when it is written whole
+#define COMPRESSED 0x20     // the blocks of the file hold its compressed form
+#define INLINE 0x40         // the content is in the directory, it has no blocks
+#define TAIL 0x80           // the end of the content is in a shared tail block
+
+#define FS_MAX_NAME 55      // longest file name, file_name holds the '\0' too
+
+struct dir_entry {
+    char file_name[56]; // name of the file / sub-directory
+    uint32_t size; // size of the file in bytes
+    uint16_t first_blk; // index in the FAT for the first block of the file
+    uint8_t type; // directory (1) or file (0), or an extension of the entry before (2)
+    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01), compression flags
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fatfs fatfs;
+
+// mounts the disk image, NULL for the default one. Returns NULL if the image
+// could not be opened.
+fatfs *fatfs_open(const char *image);
+void fatfs_close(fatfs *fs);
+// returns a short description of a status code
+const char *fatfs_strerror(int status);
+// frees data returned by fatfs_cat, fatfs_ls and fatfs_pwd
+void fatfs_free(void *ptr);
+
+int fatfs_format(fatfs *fs);
+int fatfs_create(fatfs *fs, const char *filepath, const char *data, size_t len);
+// *data is the file content, *len its length in bytes
+int fatfs_cat(fatfs *fs, const char *filepath, char **data, size_t *len);
+// *entries is the content of the current directory
+int fatfs_ls(fatfs *fs, struct dir_entry **entries, size_t *count);
+int fatfs_stat(fatfs *fs, const char *path, struct dir_entry *entry);
+int fatfs_cp(fatfs *fs, const char *sourcepath, const char *destpath);
+int fatfs_mv(fatfs *fs, const char *sourcepath, const char *destpath);
+int fatfs_rm(fatfs *fs, const char *filepath);
+int fatfs_append(fatfs *fs, const char *filepath1, const char *filepath2);
+int fatfs_mkdir(fatfs *fs, const char *dirpath);
+int fatfs_cd(fatfs *fs, const char *dirpath);
+// *path is a '\0' terminated string
+int fatfs_pwd(fatfs *fs, char **path);
+int fatfs_chmod(fatfs *fs, int accessrights, const char *filepath);
+// with write back, writes out everything held back, or what one file needs
+int fatfs_sync(fatfs *fs);
+int fatfs_fsync(fatfs *fs, const char *filepath);
+// preallocates blocks for the file to grow to size bytes
+int fatfs_fallocate(fatfs *fs, const char *filepath, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FATFS_H__
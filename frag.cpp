@@ -0,0 +1,263 @@
+#include <cstdio>
+#include <cstring>
+#include "frag.h"
+
+// Follows one FAT chain from first_blk and counts its blocks, extents and
+// seek distance. If map is given the blocks are marked in it, + for the
+// first block of an extent and # for the rest. The walk is bounded in case
+// the chain is damaged.
+static void
+scan_chain(const int16_t *fat, unsigned no_blocks, int first_blk, frag_file *file, char *map)
+{
+    file->blocks = 0;
+    file->extents = 0;
+    file->seek_distance = 0;
+    // inline files and those that are only a tail have no chain
+    if(first_blk == ROOT_BLOCK)
+        return;
+    int prev = -1;
+    for(int b = first_blk; b >= 0 && (unsigned)b < no_blocks; b = fat[b]){
+        bool new_extent = prev == -1 || b != prev + 1;
+        if(new_extent)
+            file->extents++;
+        if(prev != -1)
+            file->seek_distance += b > prev ? b - prev - 1 : prev - b + 1;
+        if(map)
+            map[b] = new_extent ? '+' : '#';
+        file->blocks++;
+        prev = b;
+        if(file->blocks > no_blocks)
+            break;
+    }
+}
+
+// Fills in summary, and files with every file if it is not NULL
+static int
+scan(FS& fs, frag_summary *summary, std::vector<frag_file> *files)
+{
+    const int16_t *fat = fs.get_fat();
+    unsigned no_blocks = fs.get_no_blocks();
+    memset(summary, 0, sizeof(frag_summary));
+
+    int ret_val = fs.walk([&](const std::string& path, const dir_entry& entry){
+        if(entry.type == TYPE_DIR){
+            summary->no_dirs++;
+            return;
+        }
+        frag_file file;
+        scan_chain(fat, no_blocks, entry.first_blk, &file, NULL);
+        summary->no_files++;
+        summary->extents += file.extents;
+        summary->file_blocks += file.blocks;
+        if(files){
+            file.path = path;
+            files->push_back(file);
+        }
+    });
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    // blocks 0 and 1 are the root directory and the FAT
+    summary->data_blocks = no_blocks - 2;
+    for(unsigned b = 2; b < no_blocks; b++){
+        if(fat[b] != FAT_FREE)
+            summary->used_blocks++;
+    }
+    // removed files are not using theirs, they only wait to be freed
+    summary->orphan_blocks = fs.orphan_blocks();
+    summary->used_blocks -= summary->orphan_blocks;
+    summary->utilization = (double)summary->used_blocks / summary->data_blocks;
+
+    // every file has one extent it can't avoid
+    uint64_t steps = summary->file_blocks - summary->no_files;
+    summary->score = steps > 0 ? (double)(summary->extents - summary->no_files) / steps : 0;
+    return FS_OK;
+}
+
+int
+frag_summarize(FS& fs, frag_summary *summary)
+{
+    return scan(fs, summary, NULL);
+}
+
+int
+frag_analyze(FS& fs, frag_report *report)
+{
+    report->files.clear();
+    int ret_val = scan(fs, &report->summary, &report->files);
+    if(ret_val != FS_OK)
+        return ret_val;
+    report->seek_distance = 0;
+    for(size_t i = 0; i < report->files.size(); i++)
+        report->seek_distance += report->files[i].seek_distance;
+
+    report->free_blocks = 0;
+    report->free_runs = 0;
+    report->largest_free_run = 0;
+    memset(report->free_run_hist, 0, sizeof(report->free_run_hist));
+    const int16_t *fat = fs.get_fat();
+    unsigned no_blocks = fs.get_no_blocks();
+    for(unsigned b = 2; b < no_blocks; ){
+        if(fat[b] != FAT_FREE){
+            b++;
+            continue;
+        }
+        unsigned run = 0;
+        while(b < no_blocks && fat[b] == FAT_FREE){
+            run++;
+            b++;
+        }
+        report->free_blocks += run;
+        report->free_runs++;
+        if(run > report->largest_free_run)
+            report->largest_free_run = run;
+        unsigned bucket = 31 - __builtin_clz(run);
+        if(bucket >= FRAG_HIST_BUCKETS)
+            bucket = FRAG_HIST_BUCKETS - 1;
+        report->free_run_hist[bucket]++;
+    }
+    report->free_score = report->free_blocks > 0 ?
+        1 - (double)report->largest_free_run / report->free_blocks : 0;
+    return FS_OK;
+}
+
+void
+frag_write_report(std::ostream& out, const frag_report& report, bool per_file)
+{
+    const frag_summary& s = report.summary;
+    char line[160];
+    snprintf(line, sizeof(line), "Files: %u in %u directories, %llu blocks in %llu extents\n",
+             s.no_files, s.no_dirs, (unsigned long long)s.file_blocks,
+             (unsigned long long)s.extents);
+    out << line;
+    snprintf(line, sizeof(line), "Utilization: %llu of %llu data blocks (%.1f%%)\n",
+             (unsigned long long)s.used_blocks, (unsigned long long)s.data_blocks,
+             100 * s.utilization);
+    out << line;
+    if(s.orphan_blocks > 0){
+        snprintf(line, sizeof(line), "Reclaimable: %llu blocks of removed files\n",
+                 (unsigned long long)s.orphan_blocks);
+        out << line;
+    }
+    uint64_t steps = s.file_blocks - s.no_files;
+    snprintf(line, sizeof(line), "Fragmentation: score %.3f, average run %.1f blocks, "
+             "seek distance %llu (%.1f per step)\n",
+             s.score, s.extents ? (double)s.file_blocks / s.extents : 0,
+             (unsigned long long)report.seek_distance,
+             steps ? (double)report.seek_distance / steps : 0);
+    out << line;
+    snprintf(line, sizeof(line), "Free space: %llu blocks in %llu runs, largest %llu, score %.3f\n",
+             (unsigned long long)report.free_blocks, (unsigned long long)report.free_runs,
+             (unsigned long long)report.largest_free_run, report.free_score);
+    out << line;
+    for(unsigned i = 0; i < FRAG_HIST_BUCKETS; i++){
+        if(report.free_run_hist[i] == 0)
+            continue;
+        if(i == 0)
+            snprintf(line, sizeof(line), "  %5u       %6llu runs\n", 1u,
+                     (unsigned long long)report.free_run_hist[i]);
+        else if(i == FRAG_HIST_BUCKETS - 1)
+            snprintf(line, sizeof(line), "  %5u+      %6llu runs\n", 1u << i,
+                     (unsigned long long)report.free_run_hist[i]);
+        else
+            snprintf(line, sizeof(line), "  %5u-%-5u %6llu runs\n", 1u << i, (2u << i) - 1,
+                     (unsigned long long)report.free_run_hist[i]);
+        out << line;
+    }
+    if(!per_file)
+        return;
+    snprintf(line, sizeof(line), "  %7s %7s %9s %9s  %s\n", "blocks", "extents", "avg run", "seek", "path");
+    out << line;
+    for(size_t i = 0; i < report.files.size(); i++){
+        const frag_file& f = report.files[i];
+        snprintf(line, sizeof(line), "  %7u %7u %9.1f %9llu  ", f.blocks, f.extents,
+                 f.extents ? (double)f.blocks / f.extents : 0, (unsigned long long)f.seek_distance);
+        out << line << f.path << "\n";
+    }
+}
+
+// Escapes the characters of a file name JSON does not take as they are
+static std::string
+json_string(const std::string& s)
+{
+    std::string escaped = "\"";
+    for(size_t i = 0; i < s.length(); i++){
+        if(s[i] == '"' || s[i] == '\\')
+            escaped += '\\';
+        if((unsigned char)s[i] < 0x20){
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", s[i]);
+            escaped += hex;
+        } else
+            escaped += s[i];
+    }
+    return escaped + "\"";
+}
+
+void
+frag_write_json(std::ostream& out, const frag_report& report)
+{
+    const frag_summary& s = report.summary;
+    out << "{\"files\": " << s.no_files
+        << ", \"dirs\": " << s.no_dirs
+        << ", \"data_blocks\": " << s.data_blocks
+        << ", \"used_blocks\": " << s.used_blocks
+        << ", \"orphan_blocks\": " << s.orphan_blocks
+        << ", \"file_blocks\": " << s.file_blocks
+        << ", \"extents\": " << s.extents
+        << ", \"utilization\": " << s.utilization
+        << ", \"score\": " << s.score
+        << ", \"seek_distance\": " << report.seek_distance
+        << ",\n \"free\": {\"blocks\": " << report.free_blocks
+        << ", \"runs\": " << report.free_runs
+        << ", \"largest_run\": " << report.largest_free_run
+        << ", \"score\": " << report.free_score
+        << ", \"run_hist\": [";
+    for(unsigned i = 0; i < FRAG_HIST_BUCKETS; i++)
+        out << (i ? ", " : "") << report.free_run_hist[i];
+    out << "]},\n \"per_file\": [";
+    for(size_t i = 0; i < report.files.size(); i++){
+        const frag_file& f = report.files[i];
+        out << (i ? ",\n  " : "\n  ") << "{\"path\": " << json_string(f.path)
+            << ", \"blocks\": " << f.blocks
+            << ", \"extents\": " << f.extents
+            << ", \"seek_distance\": " << f.seek_distance << "}";
+    }
+    out << "\n]}\n";
+}
+
+int
+frag_write_heatmap(std::ostream& out, FS& fs, unsigned width)
+{
+    const int16_t *fat = fs.get_fat();
+    unsigned no_blocks = fs.get_no_blocks();
+    if(width == 0)
+        width = 64;
+    // anything in use that the walk does not reach stays ?
+    std::vector<char> map(no_blocks);
+    for(unsigned b = 0; b < no_blocks; b++)
+        map[b] = fat[b] == FAT_FREE ? '.' : '?';
+    map[ROOT_BLOCK] = 'R';
+    map[FAT_BLOCK] = 'T';
+    int ret_val = fs.walk([&](const std::string& path, const dir_entry& entry){
+        if(entry.type == TYPE_DIR){
+            if(entry.first_blk < no_blocks)
+                map[entry.first_blk] = 'd';
+            return;
+        }
+        frag_file file;
+        scan_chain(fat, no_blocks, entry.first_blk, &file, &map[0]);
+    });
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    char label[16];
+    for(unsigned row = 0; row < no_blocks; row += width){
+        snprintf(label, sizeof(label), "%5u ", row);
+        out << label;
+        out.write(&map[row], row + width <= no_blocks ? width : no_blocks - row);
+        out << "\n";
+    }
+    out << "R root  T FAT  d directory  + extent start  # extent  . free  ? unreachable\n";
+    return FS_OK;
+}
@@ -0,0 +1,65 @@
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fs.h"
+
+#ifndef __FRAG_H__
+#define __FRAG_H__
+
+// Fragmentation of the files on a disk. An extent is a run of blocks that
+// follow each other on the disk, so a contiguous file is one extent.
+// The score is the share of a file's block-to-block steps that are not to
+// the next block, over all files: 0 when every file is contiguous, 1 when
+// no two blocks of any file are neighbours.
+struct frag_summary {
+    unsigned no_files;
+    unsigned no_dirs;
+    uint64_t data_blocks;       // blocks that can hold data, FAT and root excluded
+    uint64_t used_blocks;       // of those, in use by files and directories
+    uint64_t orphan_blocks;     // of those, left by rm for the reclaimer to free
+    uint64_t file_blocks;       // blocks in file chains
+    uint64_t extents;           // extents of all files
+    double utilization;         // used_blocks / data_blocks
+    double score;
+};
+
+// free runs of 1, 2-3, 4-7, ... blocks, the last bucket takes the rest
+#define FRAG_HIST_BUCKETS 12
+
+struct frag_file {
+    std::string path;
+    unsigned blocks;
+    unsigned extents;
+    // blocks skipped over or back between consecutive blocks of the
+    // file, 0 when it is contiguous
+    uint64_t seek_distance;
+};
+
+// Everything frag_analyze finds out: the summary, every file, and how the
+// free space is split up. A free run is a run of free blocks between used
+// ones, the free score is 1 - largest_free_run / free_blocks.
+struct frag_report {
+    frag_summary summary;
+    std::vector<frag_file> files;
+    uint64_t seek_distance;
+    uint64_t free_blocks;
+    uint64_t free_runs;
+    uint64_t largest_free_run;
+    uint64_t free_run_hist[FRAG_HIST_BUCKETS];
+    double free_score;
+};
+
+// Walks every file's FAT chain and sums up how fragmented the disk is
+int frag_summarize(FS& fs, frag_summary *summary);
+// The full analysis, per file and of the free space
+int frag_analyze(FS& fs, frag_report *report);
+// human readable report, with a row per file if per_file is set
+void frag_write_report(std::ostream& out, const frag_report& report, bool per_file);
+void frag_write_json(std::ostream& out, const frag_report& report);
+// One character per block, width blocks per row:
+//   R root  T FAT  d directory  + first block of an extent  # rest of it
+//   . free  ? in use in the FAT but not reachable from the root
+int frag_write_heatmap(std::ostream& out, FS& fs, unsigned width);
+
+#endif // __FRAG_H__
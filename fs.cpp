@@ -1,19 +1,57 @@
 #include <iostream>
 #include "fs.h"
+#include "trace.h"
+#include "lz.h"
+#include <algorithm>
+#include <atomic>
+#include <set>
 #include <string>
 #include <cstring>
+#include <thread>
 
-// Current directory 
-int blk_curr_dir = ROOT_BLOCK;
-
-FS::FS()
+FS::FS(const std::string& diskname, const disk_config& config) : disk(diskname, config)
 {
-    std::cout << "FS::FS()... Creating file system\n";
-    int16_t blk[BLOCK_SIZE];
-    disk.read(FAT_BLOCK, (uint8_t*)blk);
+    blk_curr_dir = ROOT_BLOCK;
+    in_batch = false;
+    dedup = false;
+    compress_new = false;
+    tail_blk = -1;
+    tail_fill = 0;
+    ra_last = -1;
+    ra_window = 0;
+    ra_left = 0;
+    delalloc = config.write_back;
+    goal_group = 0;
+    dir_group = 0;
+    logical_read = 0;
+    logical_written = 0;
+    if(disk.read(FAT_BLOCK, (uint8_t*)fat) != 0)
+        memset(fat, 0, sizeof(fat));
+
+    // Every file entry and every FAT entry pointing at a block is one
+    // reference to it
+    unsigned no_blocks = disk.get_no_blocks();
+    group_free.assign((no_blocks + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS, 0);
+    count_free_blocks();
+    std::vector<int> refs(no_blocks, 0);
+    std::vector<bool> seen(no_blocks, false);
+    count_refs(ROOT_BLOCK, &refs, &seen);
+    for(unsigned b = 2; b < no_blocks; b++){
+        if(fat[b] > 1 && (unsigned)fat[b] < no_blocks)
+            refs[fat[b]]++;
+    }
+    extra_refs.assign(no_blocks, 0);
+    reserved.assign(no_blocks, false);
+    for(unsigned b = 2; b < no_blocks; b++){
+        if(fat[b] != FAT_FREE && refs[b] > 1)
+            extra_refs[b] = refs[b] - 1;
+    }
 
-    for(int i = 0; i < BLOCK_SIZE/2; i++)
-        fat[i] = blk[i];
+    // finish what rm left to be freed before the last unmount
+    if(!orphans.empty() || !reaped.empty()){
+        reap_all();
+        write_fat();
+    }
 }
 
 FS::~FS()
@@ -25,6 +63,9 @@ FS::~FS()
 int
 FS::format()
 {
+    LatencyTimer timer(latency[LAT_FORMAT]);
+    TraceSpan span("FS::format");
+
     // Reset FAT
     fat[0] = FAT_EOF;
     fat[1] = FAT_EOF;
@@ -32,221 +73,157 @@ FS::format()
         fat[i] = FAT_FREE;
     }
 
+    extra_refs.assign(disk.get_no_blocks(), 0);
+    dedup_clear();
+    tail_blk = -1;
+    orphans.clear();
+    reaped.clear();
+    drop_reservations();
+    count_free_blocks();
+    dir_group = 0;
+
     // Reset all the data in the root block to completely empty
-    dir_entry blk[BLOCK_SIZE];
+    dir_entry blk[DIR_ENTRIES];
+    memset(blk, 0, sizeof(blk));
     blk_curr_dir = ROOT_BLOCK;
-    for(int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++){
-
-        blk[i].size = 0;
-        blk[i].first_blk = 0;
-        blk[i].type = 0;
-        blk[i].access_rights = 0;
-    }
 
     // Write data to disk
-    disk.write(ROOT_BLOCK, (uint8_t*)blk);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-
-    std::cout << "Formatted the disk successfully\n";
-    return 0;
+    if(write_block(ROOT_BLOCK, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    return write_fat();
 }
 
-// create <filepath> creates a new file on the disk, the data content is
-// written on the following rows (ended with an empty row)
+// create <filepath> creates a new file on the disk with the data content
 int
-FS::create(std::string filepath)
+FS::create(std::string filepath, std::string data)
 {
-    if(filepath.length() > 55){ // 56 - 1, -1 because string::length() does not take the \0 into account
-        std::cout << "Filename too long. The name of a file can be at most be 56 characters long\n";
-        return 1;
-    }
+    LatencyTimer timer(latency[LAT_CREATE]);
+    TraceSpan span("FS::create");
 
     // Get the file name
     std::string filename;
     get_file_name_from_path(filepath, &filename);
+    if(filename.empty())
+        return FS_EINVAL;
+    if(filename.length() > FS_MAX_NAME)
+        return FS_ENAMETOOLONG;
 
     // Find with directory block to load
     chop_file_name(&filepath);
     int dir_blk = find_final_block(current_directory_block(), filepath);
+    if(dir_blk == -1)
+        return FS_ENOENT;
 
-    // Check if the file already exists on the dir block
-    if(file_exists(dir_blk, filename) != -1){
-      std::cout << "File \"" << filename << "\" already exists.\n";
-      return 1;
-    }
-
-    // GATHER USER INPUT
-
-    std::string accum;
-    std::string line;
-    // A loop that accumulates user input text into one single line of text.
-    for(;;){
-        std::getline(std::cin, line);
-
-        if(line.empty()){
-            break;
-        } else {
-            if(!accum.empty())
-                accum += "\n";
-            accum += line;
-        }
-    }
-
-    // Write data
-    char *c_accum = (char*)accum.c_str();
-    int bytes_to_write = accum.length() + 1;
-    int first_block = -1,       // Keep track of which block the file starts on
-        block = -1,             // Which block we're writing to next
-        previous_block = -1;    // Which block we wrote to last iteration
-
-    while(bytes_to_write > 0){ // While there's data to write
-
-        // Find an empty block to write data to
-        block = find_empty_block_id();
-        disk.write(block, (uint8_t*)c_accum);
-
-        // Mark the fat table and mark the now-full block as EOF
-        fat[block] = FAT_EOF;
-
-        bytes_to_write -= BLOCK_SIZE;
-        c_accum += BLOCK_SIZE;
-
-        // If this is not our first loop
-        if(previous_block > 0)
-            fat[previous_block] = block;
-
-        // If this is our first loop, set first_block equal to block
-        if(first_block == -1)
-            first_block = block;
-        previous_block = block;
-    }
-
-    // UPDATE DIRECTORY DATA
-
-    // Load current directory entries
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(dir_blk, (uint8_t*)blk);
+    // Load the directory entries
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
 
-    // Find an empty entry to populate
-    int empty_entry_id = find_empty_dir_entry_id(blk);
+    // Check if the file already exists on the dir block
+    if(find_in_dir(blk, filename) != -1)
+        return FS_EEXIST;
+    goal_group = group_of(dir_blk);
+
+    // Find an empty entry to populate, preferably with room after it to
+    // store the content inline or name a tail
+    int empty_entry_id = find_free_run(blk, 1 + ext_wanted(data.length() + 1));
+    bool fat_changed;
+    if(empty_entry_id == -1)
+        empty_entry_id = claim_dir_entry(dir_blk, blk, &fat_changed);
+    if(empty_entry_id == -1)
+        return FS_EDIRFULL;
+
+    // UPDATE DIRECTORY DATA, and write data, the '\0' is stored as well
     dir_entry *empty_entry = blk + empty_entry_id;
-
+    memset(empty_entry, 0, sizeof(dir_entry));
     strcpy(empty_entry->file_name, filename.c_str());
-    empty_entry->size           = (uint32_t)(accum.length() + 1);
-    empty_entry->first_blk      = first_block;
     empty_entry->type           = TYPE_FILE;
-    empty_entry->access_rights  = READ | WRITE;
-
-    disk.write(dir_blk, (uint8_t*)blk);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    return 0;
+    empty_entry->access_rights  = READ | WRITE | (compress_new ? COMPRESS : 0);
+    int ret_val = store_file(blk, empty_entry_id, data.c_str(), data.length() + 1);
+    if(ret_val != FS_OK)
+        return ret_val;
+    logical_written += data.length();
+
+    if(write_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    return write_fat();
 }
 
-// cat <filepath> reads the content of a file and prints it on the screen
+// cat <filepath> reads the content of a file into data
 int
-FS::cat(std::string filepath)
+FS::cat(std::string filepath, std::string *data)
 {
-    std::string filename;                           
-    get_file_name_from_path(filepath, &filename);   // The file name
-    chop_file_name(&filepath);                      // The path to the file excluding the file's name
-
-    // Find the directory block id where the file resides
-    int file_block = find_final_block(current_directory_block(), filepath);
-
-    // If we cannot calculate which block the filepath leads to, something's wrong
-    if(file_block == -1){
-        std::cout << "File \"" << filename << "\" does not exist.\n";
-        return -1;
-    }
-
-    // Make sure the file exists
-    int file_idx = file_exists(file_block, filename);
-    if(file_idx == -1){
-        std::cout << "File \"" << filename << "\" does not exist.\n";
-        return 1;
-    }
-
-    // Load the directory block
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(file_block, (uint8_t*)blk);
-    dir_entry file_entry = blk[file_idx];
+    LatencyTimer timer(latency[LAT_CAT]);
+    TraceSpan span("FS::cat");
 
-    if((file_entry.access_rights & READ) == 0){
-        std::cout << "Invalid access rights, you do not have permission to read this file.\n";
-        return 1;
-    }
+    int dir_blk, file_idx;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(filepath, &dir_blk, &file_idx, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
+    dir_entry *file_entry = blk + file_idx;
 
     // Make sure the file is not a directory
-    if(file_entry.type == TYPE_DIR){
-        std::cout << "Cannot cat a directory\n";
-        return 1;
-    }
-
-    // Cat out the file contents
-    char *cblk = (char*)blk;
-    int block = file_entry.first_blk;
-    while(block != FAT_EOF){
-        disk.read(block, (uint8_t*)cblk);
-        block = fat[block];
-        std::cout << cblk;
-    }
-    std::cout << "\n"; // New line for good luck
-
-    return 0;
+    if(file_entry->type == TYPE_DIR)
+        return FS_EISDIR;
+    if((file_entry->access_rights & READ) == 0)
+        return FS_EACCES;
+
+    ret_val = read_file(file_entry, data);
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    // The '\0' stored at the end is not part of the content
+    if(!data->empty() && (*data)[data->length() - 1] == '\0')
+        data->erase(data->length() - 1);
+    logical_read += data->length();
+    return FS_OK;
 }
 
 // ls lists the content in the currect directory (files and sub-directories)
 int
-FS::ls()
+FS::ls(std::vector<dir_entry> *entries)
 {
-    // Load the current directory
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(current_directory_block(), (uint8_t*)blk);
-
-    std::string str;                            // String object of what to print out
-    std::cout << "  Type    Size    accessrights    Name\n";  // Layout
-    for(int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++){
-        if(!file_is_visible(blk + i))           // Ignore any files that are not used
-            continue;
-
-        if(blk[i].type == TYPE_DIR){                // If dir... 
-
-            str = "  ";
-            str.append("Dir");                      // type is dir
-
-            str.append(10 - str.length(), ' '); 
-            str.append("-");                        // size is -
-
-            str.append(18 - str.length(), ' ');
-            str.append((blk[i].access_rights & READ)    ? "r" : "-"); 
-            str.append((blk[i].access_rights & WRITE)   ? "w" : "-"); 
-            str.append((blk[i].access_rights & EXECUTE) ? "x" : "-"); 
+    LatencyTimer timer(latency[LAT_LS]);
+    TraceSpan span("FS::ls");
 
-            str.append(34 - str.length(), ' ');
-            str.append(blk[i].file_name);
-
-            std::cout << str << "\n";
-        } else if(blk[i].type == TYPE_FILE) {       // If file...
-
-            str = "  ";
-            str.append("File");                     // type is File
-
-            str.append(10 - str.length(), ' ');
-            str.append(std::to_string(blk[i].size));// size is the size of the file
+    // Load the current directory
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(current_directory_block(), (uint8_t*)blk) != 0)
+        return FS_EIO;
+
+    entries->clear();
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(file_is_visible(blk + i))           // Ignore any files that are not used
+            entries->push_back(blk[i]);
+    }
+    return FS_OK;
+}
 
-            str.append(18 - str.length(), ' ');
-            str.append((blk[i].access_rights & READ)    ? "r" : "-"); 
-            str.append((blk[i].access_rights & WRITE)   ? "w" : "-"); 
-            str.append((blk[i].access_rights & EXECUTE) ? "x" : "-"); 
-            
-            str.append(34 - str.length(), ' ');
-            str.append(blk[i].file_name);
+// stat <path> fetches the dir_entry of a file or directory
+int
+FS::stat(std::string path, dir_entry *entry)
+{
+    LatencyTimer timer(latency[LAT_STAT]);
+    TraceSpan span("FS::stat");
 
-            std::cout << str << "\n";
-        }
+    // The root directory has no dir_entry of its own
+    if(path == "/"){
+        memset(entry, 0, sizeof(dir_entry));
+        strcpy(entry->file_name, "/");
+        entry->size = 1;
+        entry->first_blk = ROOT_BLOCK;
+        entry->type = TYPE_DIR;
+        entry->access_rights = READ | WRITE | EXECUTE;
+        return FS_OK;
     }
 
-    return 0;
+    int dir_blk, idx;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(path, &dir_blk, &idx, blk);
+    if(ret_val == FS_OK)
+        *entry = blk[idx];
+    return ret_val;
 }
 
 // cp <sourcepath> <destpath> makes an exact copy of the file
@@ -254,148 +231,134 @@ FS::ls()
 int
 FS::cp(std::string sourcepath, std::string destpath)
 {
-    std::string org_sourcepath = sourcepath;
-    std::string org_destpath = destpath;
-
-    // Get the source's file name from the sourcepath
-    std::string source_filename;
-    get_file_name_from_path(sourcepath, &source_filename);
-
-    chop_file_name(&sourcepath);
-    int source_blk = find_final_block(current_directory_block(), sourcepath);
-
-    // Make sure the source file exists
-    int source_file_id = file_exists(source_blk, source_filename);
-    if(source_file_id == -1){
-      std::cout << "File \"" << source_filename << "\" does not exist.\n";
-      return 1;
-    }
-    
-    // Read source directory
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(source_blk, (uint8_t*)blk);
+    LatencyTimer timer(latency[LAT_CP]);
+    TraceSpan span("FS::cp");
+
+    // Find and read the source directory
+    int source_blk, source_file_id;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(sourcepath, &source_blk, &source_file_id, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
     dir_entry* source_file_entry = blk + source_file_id;
 
-
-    if(source_file_entry->type == TYPE_DIR){
-        std::cout << "Cannot copy directory\n";
-        return 1;
-    }
-    if((source_file_entry->access_rights & READ) == 0){
-        std::cout << "Invalid access rights, you do not have permission to read this file.\n";
-        return 1;
-    }
-
+    if(source_file_entry->type == TYPE_DIR)
+        return FS_EISDIR;
+    if((source_file_entry->access_rights & READ) == 0)
+        return FS_EACCES;
 
     std::string copied_filename;   // Final name of the new copied file
-    int dest_blk_id = -1;           // Block number of the directory we're copying to
-   
+    int dest_blk_id = -1;          // Block number of the directory we're copying to
+
     // The following if-else case determines the file name of the new file
     // as well as which directory to copy it to
-    if (destpath.find("/") != -1){                  
-        // If the destpath includes any "/" then we're copying a file to another directory                           
+    if (destpath.find("/") != std::string::npos){
+        // If the destpath includes any "/" then we're copying a file to another directory
 
         // Check if the path exists is valid
-        dest_blk_id = find_final_block(current_directory_block(), destpath);       
-        if(dest_blk_id == -1){
-            std::cout << "Invalid path for destination file\n";
-            return 1;
-        }
-
-        if(dest_blk_id == source_blk){                              
-            std::cout << "Destination sub-directory is the same directory as the source directory.\n";
-            return 1;
-        }
-        copied_filename = source_filename; //... so we put the name of the new file to the same name as source file
-    } else {                                                                    
-        // If the destpath does not include any "/" then we know we're either working 
+        dest_blk_id = find_final_block(current_directory_block(), destpath);
+        if(dest_blk_id == -1)
+            return FS_ENOENT;
+        if(dest_blk_id == source_blk)
+            return FS_EEXIST; // same directory and same name as the source
+        copied_filename = source_file_entry->file_name; //... so we put the name of the new file to the same name as source file
+    } else {
+        // If the destpath does not include any "/" then we know we're either working
         // with current directory or a sub-directory of current directory
-        
-        // What the destination's block number is (NOTE IF THIS IS NOT -1 THEN <destpath> IS A DIRECTORY)
-
-        int dest_file_exist = file_exists(current_directory_block(), destpath);
-        if(dest_file_exist != -1){                                      // If a file named <destpath> exists in current directory
-                                                                        // then we make sure it's a directory
-                                                                        // and put the name to <source_filename> and destination block to 
-                                                                        // the block of directory that <destpath> points to
-            dir_entry dest_blk[BLOCK_SIZE];
-            disk.read(current_directory_block(), (uint8_t*)dest_blk);
-            dir_entry* dest_file_entry = dest_blk + dest_file_exist;
-
-            if(dest_file_entry->type == TYPE_FILE){
-                std::cout << "A file with name " << dest_file_entry->file_name << " already exists.\n";
-                return 1;
-            }
-
-            // Else destination file is a directory 
-            // Copy the file to the new directory with name sourcepath
-            copied_filename = source_filename;
+        dir_entry cwd_blk[DIR_ENTRIES];
+        if(read_block(current_directory_block(), (uint8_t*)cwd_blk) != 0)
+            return FS_EIO;
+
+        int dest_file_exist = find_in_dir(cwd_blk, destpath);
+        if(dest_file_exist != -1){
+            // If a file named <destpath> exists in current directory it must be a
+            // directory, and the copy goes into it with the source's name
+            dir_entry* dest_file_entry = cwd_blk + dest_file_exist;
+            if(dest_file_entry->type == TYPE_FILE)
+                return FS_EEXIST;
+            copied_filename = source_file_entry->file_name;
             dest_blk_id = dest_file_entry->first_blk;
-        } else {                                                // Else we check 
-
-            // Name of new file is just <destpath> and destination block is source block                            
+        } else {
+            // Name of new file is just <destpath> and destination block is source block
+            if(destpath.length() > FS_MAX_NAME)
+                return FS_ENAMETOOLONG;
             copied_filename = destpath;
             dest_blk_id = source_blk;
         }
     }
 
-    if(file_exists(dest_blk_id, copied_filename) != -1){
-        std::cout << "File with name " << copied_filename << " already exists in destination sub-directory, aborting\n";
-        return 1;
-    }
-
     // Load destination directory
-    dir_entry dest_blk[BLOCK_SIZE];
-    disk.read(dest_blk_id, (uint8_t*)dest_blk);
-
-    int free_entry_id = find_empty_dir_entry_id(dest_blk);
+    dir_entry dest_blk_buf[DIR_ENTRIES];
+    dir_entry *dest_blk = dest_blk_buf;
+    if(dest_blk_id == source_blk)
+        dest_blk = blk; // same block, both copies must stay in sync
+    else if(read_block(dest_blk_id, (uint8_t*)dest_blk) != 0)
+        return FS_EIO;
+
+    if(find_in_dir(dest_blk, copied_filename) != -1)
+        return FS_EEXIST;
+    goal_group = group_of(dest_blk_id);
+
+    // The copy needs room for the TYPE_EXT entries of the source as well
+    unsigned no_ext = ext_entries(source_file_entry);
+    int free_entry_id = find_free_run(dest_blk, 1 + no_ext);
+    bool fat_changed = false;
+    if(free_entry_id == -1 && no_ext == 0){
+        free_entry_id = claim_dir_entry(dest_blk_id, dest_blk, &fat_changed);
+        if(free_entry_id == -1)
+            return FS_EDIRFULL;
+    }
     if(free_entry_id == -1){
-        std::cout << "No free space in directory to copy file." << "\n";
-        return 1;
+        // Without it the content is stored the way the room allows
+        std::string data;
+        ret_val = read_file(source_file_entry, &data);
+        if(ret_val != FS_OK)
+            return ret_val;
+        free_entry_id = claim_dir_entry(dest_blk_id, dest_blk, &fat_changed);
+        if(free_entry_id == -1)
+            return FS_EDIRFULL;
+        dir_entry *dest_entry = dest_blk + free_entry_id;
+        *dest_entry = *source_file_entry;
+        memset(dest_entry->file_name, 0, sizeof(dest_entry->file_name));
+        strcpy(dest_entry->file_name, copied_filename.c_str());
+        ret_val = store_file(dest_blk, free_entry_id, data.data(), data.length());
+        if(ret_val != FS_OK)
+            return ret_val;
+        logical_read += source_file_entry->size - 1;
+        logical_written += source_file_entry->size - 1;
+        if(write_block(dest_blk_id, (uint8_t*)dest_blk) != 0)
+            return FS_EIO;
+        return write_fat();
     }
 
-    // Update the free entry in destination directory with the new information
+    // The copy points at the source's chain and tail, which gain a
+    // reference. Data blocks are only copied once one of the two files is
+    // written to. Inline content is copied with the entries.
     dir_entry *dest_entry = dest_blk + free_entry_id;
+    memcpy(dest_entry, source_file_entry, (1 + no_ext) * sizeof(dir_entry));
+    memset(dest_entry->file_name, 0, sizeof(dest_entry->file_name));
     strcpy(dest_entry->file_name, copied_filename.c_str());
-    dest_entry->size = blk[source_file_id].size;
-    dest_entry->type = blk[source_file_id].type;
-    dest_entry->access_rights = blk[source_file_id].access_rights;
-
-    uint8_t blk_buf[BLOCK_SIZE];                 // A buffer for file contents
-    int blk_src = blk[source_file_id].first_blk; // The block we're reading from
-    int blk_dest = -1;                           // The block we're reading to
-
-    // This while loops copies the entire contents of a file to new blocks
-    // as well as updates the FAT with accurate information 
-    while(blk_src != FAT_EOF) { // While we have not reached EOF
-        // Find empty block
-        int blk_empty = find_empty_block_id();
-
-        fat[blk_empty] = FAT_EOF;
-        if(blk_dest == -1)
-            dest_entry->first_blk = blk_empty;
-        else 
-            fat[blk_dest] = blk_empty;
-        blk_dest = blk_empty;
-
-        if(blk_dest <= 1) { // This should never happen but who knows
-            std::cout << "Unaccounted-for error: blk_dest <= 1 (" << blk_dest << "). This may indicate that there's no more space on the disk.\n";
-            return 1;
-        }
-
-        // Copy the file contents by reading a block into our buffer and then writing our buffer to another block
-        disk.read(blk_src, blk_buf);
-        disk.write(blk_dest, blk_buf);
-
-        // Next block
-        blk_src = fat[blk_src];
+    tail_ref ref;
+    if(dest_entry->access_rights & TAIL){
+        memcpy(&ref, dest_entry[1].file_name, sizeof(ref));
+        extra_refs[ref.blk]++;
+    }
+    if(dest_entry->first_blk != ROOT_BLOCK)
+        extra_refs[dest_entry->first_blk]++;
+
+    // The content counts as read and written once, the '\0' is not part of it
+    logical_read += source_file_entry->size - 1;
+    logical_written += source_file_entry->size - 1;
+
+    // WRITE TO DISK, the FAT has not changed unless room was made
+    if(write_block(dest_blk_id, (uint8_t*)dest_blk) != 0){
+        if(dest_entry->access_rights & TAIL)
+            extra_refs[ref.blk]--;
+        if(dest_entry->first_blk != ROOT_BLOCK)
+            extra_refs[dest_entry->first_blk]--;
+        return FS_EIO;
     }
-                                  
-    // WRITE TO DISK
-    disk.write(dest_blk_id, (uint8_t*)dest_blk);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    std::cout << "Successfully copied " << org_sourcepath << " into " << org_destpath << "\n";
-   return 0;
+    return fat_changed ? write_fat() : FS_OK;
 }
 
 // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
@@ -403,180 +366,171 @@ FS::cp(std::string sourcepath, std::string destpath)
 int
 FS::mv(std::string sourcepath, std::string destpath)
 {
-    std::string org_sourcepath = sourcepath;
-    std::string org_destpath = destpath;
-
-    std::string source_filename;
-    get_file_name_from_path(sourcepath, &source_filename);
-
-    chop_file_name(&sourcepath);
-
-    int source_directory = find_final_block(current_directory_block(), sourcepath);
-
-    // Make sure the source file exists
-    int file_index = file_exists(source_directory, source_filename);
-    if(file_index == -1){
-        std::cout << "File \"" << source_filename << "\" does not exist.\n";
-        return 1;
-    }
+    LatencyTimer timer(latency[LAT_MV]);
+    TraceSpan span("FS::mv");
 
-    // Load the current directory
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(source_directory, (uint8_t*)blk);
+    // Make sure the source file exists and load its directory
+    int source_directory, file_index;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(sourcepath, &source_directory, &file_index, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
 
     // Check if the source file is a directory, we don't want to move directories around
-    dir_entry* source_file = blk + file_index;
-    if(source_file->type == TYPE_DIR){
-        std::cout << "Cannot mv file of type directory\n";
-        return 1;
-    }
+    dir_entry* source_entry = blk + file_index;
+    if(source_entry->type == TYPE_DIR)
+        return FS_EISDIR;
 
     int dest_idx = file_exists(current_directory_block(), destpath);
 
     // If there is not a "/" in the name and destpath does not exist, then we are renaming sourcefile
-    if(destpath.find('/') == -1 && dest_idx == -1) { 
-
-        // If a file with name destpath exists, abort
-        if(dest_idx != -1){
-            std::cout << "File \"" << destpath.c_str() << "\" already exists.\n";
-            return 1;
-        }
+    if(destpath.find('/') == std::string::npos && dest_idx == -1) {
 
         // Check if destination file name is not too long
-        if(destpath.length() >= 55){ // 56 - 1
-            std::cout << "Filename too long. The name of a file can be at most be 56 characters long\n";
-            return 1;
-        }
-        dir_entry *file_entry = blk + file_index;
-        // Copy the new name into the file's dir_entry
-        std::strcpy(file_entry->file_name, destpath.c_str());
-
-        disk.write(current_directory_block(), (uint8_t*)blk);
-        std::cout << "Successfully renamed " << org_sourcepath << " to " << file_entry->file_name << "\n";
-    }
-    else { // Else we're moving the file to a different directory 
+        if(destpath.empty())
+            return FS_EINVAL;
+        if(destpath.length() > FS_MAX_NAME)
+            return FS_ENAMETOOLONG;
 
-        // Check if it's a valid path
-        int new_blk_id = find_final_block(current_directory_block(), destpath);
-        if(new_blk_id == -1){
-            std::cout << "Invalid path for destination file\n";
-            return 1;
-        }
+        // The file keeps its directory, so the new name must be free there
+        if(find_in_dir(blk, destpath) != -1)
+            return FS_EEXIST;
 
-        // Load the block of the destination directory
-        dir_entry new_blk[BLOCK_SIZE];
-        disk.read(new_blk_id, (uint8_t*)new_blk);
+        // Copy the new name into the file's dir_entry
+        memset(source_entry->file_name, 0, sizeof(source_entry->file_name));
+        strcpy(source_entry->file_name, destpath.c_str());
 
-        // If a file with the same name as source already exists in the destination sub-directory, abort
-        if(file_exists(new_blk_id, sourcepath) != -1){
-            std::cout << "File \"" << destpath.c_str() << "\" already exists.\n";
-            return 1;
-        }
+        if(write_block(source_directory, (uint8_t*)blk) != 0)
+            return FS_EIO;
+        return FS_OK;
+    }
 
-        // If the destination sub-directory block is the same as current directory, we don't have to do anything
-        if(new_blk_id == current_directory_block()){
-            std::cout << "Destination sub-directory is the same directory as the current one.\n";
-            return 0;
-        }
-        
-        // Find an empty dir_entry in destination sub-directory
-        int empty_dir_entry = find_empty_dir_entry_id(new_blk);
-        if(empty_dir_entry == -1){
-            std::cout << "No free space for file in destination sub-directory\n";
-            return 1;
+    // Else we're moving the file to a different directory
+
+    // Check if it's a valid path
+    int new_blk_id = find_final_block(current_directory_block(), destpath);
+    if(new_blk_id == -1)
+        return dest_idx != -1 ? FS_EEXIST : FS_ENOENT; // an existing file is no directory
+
+    // If the destination sub-directory is the same as the source's, there is nothing to do
+    if(new_blk_id == source_directory)
+        return FS_OK;
+
+    // Load the block of the destination directory
+    dir_entry new_blk[DIR_ENTRIES];
+    if(read_block(new_blk_id, (uint8_t*)new_blk) != 0)
+        return FS_EIO;
+
+    // If a file with the same name as source already exists in the destination sub-directory, abort
+    if(find_in_dir(new_blk, source_entry->file_name) != -1)
+        return FS_EEXIST;
+    goal_group = group_of(new_blk_id);
+
+    // Find an empty dir_entry in destination sub-directory, with room
+    // for the TYPE_EXT entries of the source after it
+    unsigned no_ext = ext_entries(source_entry);
+    int empty_dir_entry = find_free_run(new_blk, 1 + no_ext);
+    bool fat_changed = false;
+    if(empty_dir_entry == -1){
+        // Without it the content is stored again the way the room allows
+        std::string data;
+        if(no_ext > 0 && (ret_val = read_file(source_entry, &data)) != FS_OK)
+            return ret_val;
+        empty_dir_entry = claim_dir_entry(new_blk_id, new_blk, &fat_changed);
+        if(empty_dir_entry == -1)
+            return FS_EDIRFULL;
+        new_blk[empty_dir_entry] = *source_entry;
+        if(no_ext > 0){
+            ret_val = store_file(new_blk, empty_dir_entry, data.data(), data.length());
+            if(ret_val != FS_OK)
+                return ret_val;
+            release_file(source_entry);
+            fat_changed = true;
         }
+    } else {
+        // Update the desination entry with the source entry data
+        memcpy(new_blk + empty_dir_entry, source_entry, (1 + no_ext) * sizeof(dir_entry));
+        memset(source_entry + 1, 0, no_ext * sizeof(dir_entry));
+    }
 
-        // Get pointers to the source and destination file entries
-        dir_entry *source_entry = blk + file_index;
-        dir_entry *dest_entry = new_blk + empty_dir_entry;
+    // Set source entry as empty
+    source_entry->size = 0;
+    source_entry->first_blk = 0;
 
-        // Update the desination entry with the source entry data
-        strcpy(dest_entry->file_name,  source_entry->file_name);
-        dest_entry->size             = source_entry->size;
-        dest_entry->first_blk        = source_entry->first_blk;
-        dest_entry->type             = source_entry->type;
-        dest_entry->access_rights    = source_entry->access_rights;
-
-        // Set source entry as empty
-        source_entry->size = 0;
-        source_entry->first_blk = 0;
-
-        // Write new data to disk
-        disk.write(current_directory_block(), (uint8_t*)blk);
-        disk.write(new_blk_id, (uint8_t*)new_blk);
-        std::cout << "Successfully moved " << org_sourcepath << " to " << org_destpath << "\n";
-    } 
-    return 0;
+    // Write new data to disk, the FAT only changed if the content was stored again
+    if(write_block(new_blk_id, (uint8_t*)new_blk) != 0 ||
+       write_block(source_directory, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    return fat_changed ? write_fat() : FS_OK;
 }
 
 // rm <filepath> removes / deletes the file <filepath>
 int
 FS::rm(std::string filepath)
 {
+    LatencyTimer timer(latency[LAT_RM]);
+    TraceSpan span("FS::rm");
 
-    std::string filename;
-    get_file_name_from_path(filepath, &filename);
-
-    chop_file_name(&filepath);
-
-    int source_directory = find_final_block(current_directory_block(), filepath);
+    // Make sure the file exists and load its directory
+    int source_directory, file_index;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(filepath, &source_directory, &file_index, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
 
-    // Make sure the file exists
-    int file_index = file_exists(source_directory, filename);
-    if(file_index == -1){
-        std::cout << "File " << filename << " does not exist.\n";
-        return 1;
-    }
-    
-    // Load the root directory
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(source_directory, (uint8_t*)blk);
-    
     // Grab a pointer to the file's dir_entry
     dir_entry *file_entry = blk + file_index;
 
-    if(file_entry->type == TYPE_FILE){
-        // Iterate through all the blocks taken up by the file and mark them as free
-        int blk_rm = file_entry->first_blk, tmp = 0;
-        while(blk_rm != FAT_EOF){
-            tmp = blk_rm;
-            blk_rm = fat[blk_rm];       // Next block
-            fat[tmp] = FAT_FREE;    
-        }
-
-        // Set first_blk and size to 0 to indicate this dir_entry is not used
-        file_entry->first_blk = 0;
-        file_entry->size = 0;
-
-
-        std::cout << "Successfully removed file " << filename << "\n";
-    } 
+    if(file_entry->type == TYPE_FILE && file_entry->first_blk != ROOT_BLOCK){
+        // Only the tail and the extra entries go now. The entry stays as an
+        // orphan holding the chain, which is freed later, see orphans.
+        int first_blk = file_entry->first_blk;
+        bool fat_changed = (file_entry->access_rights & TAIL) != 0;
+        file_entry->first_blk = ROOT_BLOCK;
+        release_file(file_entry);
+        memset(file_entry, 0, sizeof(dir_entry));
+        file_entry->type = TYPE_ORPHAN;
+        file_entry->first_blk = first_blk;
+        orphans[std::make_pair(source_directory, file_index)] = first_blk;
+
+        if(write_block(source_directory, (uint8_t*)blk) != 0)
+            return FS_EIO;
+        return fat_changed ? write_fat() : FS_OK;
+    }
+    else if(file_entry->type == TYPE_FILE){
+        // Mark the blocks taken up by the file as free, with its tail and inline content
+        release_file(file_entry);
+    }
     else { // If we're working with a directory
 
+        // ".." is not ours to remove, and neither is the directory we stand in
+        if(strcmp(file_entry->file_name, "..") == 0 || file_entry->first_blk == current_directory_block())
+            return FS_EINVAL;
+
         // Check if it is empty
-        dir_entry directory_entries[BLOCK_SIZE];
-        disk.read(file_entry->first_blk, (uint8_t*)directory_entries);
-        for(int i = 1; i < BLOCK_SIZE / sizeof(dir_entry); i++){ // start on 1 since file 0 is always ".." unless 
-                                                                 // we're root and we never want to remove root anyways
-            if(directory_entries[i].size != 0 || directory_entries[i].first_blk != 0){
-                std::cout << "Cannot remove directory: Directory " << file_entry->file_name << " is not empty.\n";
-                return 1;
-            }
+        dir_entry directory_entries[DIR_ENTRIES];
+        if(read_block(file_entry->first_blk, (uint8_t*)directory_entries) != 0)
+            return FS_EIO;
+        for(unsigned i = 1; i < DIR_ENTRIES; i++){ // start on 1 since file 0 is always ".." unless
+                                                   // we're root and we never want to remove root anyways
+            if(file_is_visible(directory_entries + i))
+                return FS_ENOTEMPTY;
         }
 
-        // Mark the block the directory leads to as free
+        // Mark the block the directory leads to as free, with the chains
+        // of the orphans it still has
+        reap_dir(file_entry->first_blk);
         fat[file_entry->first_blk] = FAT_FREE;
-
-        // Set first_blk and size to 0 to indicate this dir_entry is not used
-        file_entry->first_blk = 0;
-        file_entry->size = 0;
-
-        std::cout << "Successfully removed directory " << filename << "\n";
+        group_free[group_of(file_entry->first_blk)]++;
     }
-    disk.write(source_directory, (uint8_t*)blk);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
 
-    return 0;
+    // Set first_blk and size to 0 to indicate this dir_entry is not used
+    file_entry->first_blk = 0;
+    file_entry->size = 0;
+
+    if(write_block(source_directory, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    return write_fat();
 }
 
 // append <filepath1> <filepath2> appends the contents of file <filepath1> to
@@ -584,123 +538,94 @@ FS::rm(std::string filepath)
 int
 FS::append(std::string filepath1, std::string filepath2)
 {
-    std::string filename1;
-    get_file_name_from_path(filepath1, &filename1);
-    chop_file_name(&filepath1);
-    int file_directory1 = find_final_block(current_directory_block(), filepath1);
+    LatencyTimer timer(latency[LAT_APPEND]);
+    TraceSpan span("FS::append");
 
     // Make sure both files exists
-    int file_1_id = file_exists(file_directory1, filename1);
-    if(file_1_id == -1){
-        std::cout << "File " << filename1 << " does not exist\n";
-        return 1;
-    }
-
-    std::string filename2;
-    get_file_name_from_path(filepath2, &filename2);
-    chop_file_name(&filepath2);
-    int file_directory2 = find_final_block(current_directory_block(), filepath2);
-
-    int file_2_id = file_exists(file_directory2, filename2);
-    if(file_2_id == -1){
-        std::cout << "File " << filepath2 << " does not exist\n";
-        return 1;
-    }
-
-    // Load the first directory 
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(file_directory1, (uint8_t*)blk);
-
-    // Load the second directory
-
-    dir_entry sblk[BLOCK_SIZE];
-    disk.read(file_directory2, (uint8_t*)sblk);
+    int file_directory1, file_1_id;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(filepath1, &file_directory1, &file_1_id, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    int file_directory2, file_2_id;
+    dir_entry sblk[DIR_ENTRIES];
+    ret_val = find_entry(filepath2, &file_directory2, &file_2_id, sblk);
+    if(ret_val != FS_OK)
+        return ret_val;
 
     dir_entry *entry_from = blk + file_1_id;
     dir_entry *entry_to = sblk + file_2_id;
+    goal_group = group_of(file_directory2);
 
-    // Check access rights
-    if((entry_from->access_rights & READ) == 0){
-        std::cout << "Invalid access rights, you do not have permission to read \"" << entry_from->file_name << "\".\n";
-        return 1;
-    }
-
-    if((entry_to->access_rights & WRITE) == 0){
-        std::cout << "Invalid access rights, you do not have permission to write to \"" << entry_to->file_name << "\".\n";
-        return 1;
-    }
-
-    if((entry_to->access_rights & READ) == 0){
-        std::cout << "Invalid access rights, you do not have permission to read \"" << entry_to->file_name << "\".\n";
-        return 1;
-    }
-
-
-    int blk_from = entry_from->first_blk;       // The block we're reading from
-    int blk_to = entry_to->first_blk;           // The block we're writing to
-    while(fat[blk_to] != FAT_EOF){ blk_to = fat[blk_to]; } // Set the writing-to-block block to the last block of the file we're writing to
-
-    // Prepare some variables
-    uint8_t buf[BLOCK_SIZE * 2];                                                    // Buffer for our files
-    int bytes_to_append = entry_from->size + (entry_to->size % BLOCK_SIZE);         // Keeps track of how much data is left to write
-    int buf_end_pos = 0;                                                            // End position in our data
-
-    // Prepare buffer with the data in the last block of the file we're appending to
-    disk.read(blk_to, buf);
-    buf_end_pos = (entry_to->size % BLOCK_SIZE);
-    buf[buf_end_pos-1] = '\n';
-
-    // ... as well as the data in the first block of the file we're appending
-    disk.read(blk_from, buf + buf_end_pos);
+    if(entry_from->type == TYPE_DIR || entry_to->type == TYPE_DIR)
+        return FS_EISDIR;
 
-    // Increment the end of the buffer position by the size of the first block in f2
-    if(bytes_to_append > BLOCK_SIZE){
-        buf_end_pos += BLOCK_SIZE;
-    } else{
-        buf_end_pos += (entry_to->size % BLOCK_SIZE);
-    }
-
-    while(bytes_to_append > 0){             // While there's data to write
-        if(buf_end_pos >= BLOCK_SIZE){
-            disk.write(blk_to, buf);        // Write the data to the block
-            fat[blk_to] = FAT_EOF;          // ... and mark the FAT entry as EOF
-
-            // Shift data in buffer to the start
-            // It would be more efficient to not do this but this works, might update in the future
-            // UPDATE FROM FUTURE: Did not update.
-            for(int i = 0; i < BLOCK_SIZE; i++)
-                buf[i] = buf[BLOCK_SIZE + i];
-            buf_end_pos -= BLOCK_SIZE;
-            bytes_to_append -= BLOCK_SIZE;
-
-            blk_from = fat[blk_from];
-            if(blk_from != FAT_EOF){  // Read in new data from the next block unless we reached EOF
-                disk.read(blk_from, buf + buf_end_pos);
-
-                // Increment buf_end_pos with size of block data
-                if(fat[blk_from] == FAT_EOF)                             
-                    buf_end_pos += (entry_from->size % BLOCK_SIZE);
-                else
-                    buf_end_pos += BLOCK_SIZE;
-            }
-            // Find an empty block and mark the FAT table to point correctly
-            int blk_new = find_empty_block_id();
-            fat[blk_to] = blk_new;
-            blk_to = blk_new;
-        } else {
-            disk.write(blk_to, buf);
-            bytes_to_append = 0;
+    // Check access rights
+    if((entry_from->access_rights & READ) == 0 ||
+       (entry_to->access_rights & WRITE) == 0 ||
+       (entry_to->access_rights & READ) == 0)
+        return FS_EACCES;
+
+    // The appended data replaces the '\0' at the end of file 2 with a newline,
+    // and brings the '\0' of file 1 along as the new end
+    std::string data;
+    ret_val = read_file(entry_from, &data);
+    if(ret_val != FS_OK)
+        return ret_val;
+    if(!data.empty() && data[data.length() - 1] == '\0')
+        data.erase(data.length() - 1);
+    data.insert(0, "\n");
+    data.push_back('\0');
+
+    uint32_t new_size = entry_to->size + entry_from->size;
+    if(entry_to->access_rights & INLINE){
+        // Inline content is small, it is stored again as a whole
+        std::string content;
+        ret_val = read_file(entry_to, &content);
+        if(ret_val != FS_OK)
+            return ret_val;
+        content.erase(content.length() - 1);
+        content.append(data);
+        ret_val = rewrite_file(sblk, file_2_id, content.data(), content.length());
+    } else if(entry_to->access_rights & COMPRESSED){
+        ret_val = append_compressed(entry_to, data);
+    } else {
+        // Make sure the blocks we need are there before touching anything,
+        // including copies of the blocks file 2 shares with other files and
+        // one for a packed tail, which is moved back to the end of the chain.
+        // Blocks preallocated past the end of the content are used first.
+        int blocks_now = entry_to->first_blk == ROOT_BLOCK ? 0 : chain_length(entry_to->first_blk);
+        if(entry_to->access_rights & TAIL)
+            blocks_now++;
+        int blocks_after = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int shared = entry_to->first_blk == ROOT_BLOCK ? 0 : shared_blocks(entry_to->first_blk);
+        if(!ensure_free(std::max(blocks_after - blocks_now, 0) + shared + (entry_to->access_rights & TAIL ? 1 : 0)))
+            return FS_ENOSPC;
+
+        ret_val = unpack_tail(entry_to);
+        if(ret_val != FS_OK)
+            return ret_val;
+        ret_val = unshare(entry_to);
+        if(ret_val != FS_OK)
+            return ret_val;
+        ret_val = write_at(entry_to->first_blk, entry_to->size - 1, data.data(), data.length());
+        if(ret_val == FS_OK && dedup){
+            // dedup_tail goes by where the content ends now
+            entry_to->size = new_size;
+            ret_val = dedup_tail(entry_to);
         }
     }
-    fat[blk_to] = FAT_EOF;  // Finally mark the end of file
-
-    entry_to->size += entry_from->size; 
+    if(ret_val != FS_OK)
+        return ret_val;
 
-    disk.write(file_directory2, (uint8_t*)sblk);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+    entry_to->size = new_size;
+    logical_read += entry_from->size - 1;
+    logical_written += entry_from->size - 1;
 
-    std::cout << "Successfully appended " << entry_from->file_name << " to the end of " << entry_to->file_name << "\n";
-    return 0;
+    if(write_block(file_directory2, (uint8_t*)sblk) != 0)
+        return FS_EIO;
+    return write_fat();
 }
 
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
@@ -708,128 +633,133 @@ FS::append(std::string filepath1, std::string filepath2)
 int
 FS::mkdir(std::string dirpath)
 {
+    LatencyTimer timer(latency[LAT_MKDIR]);
+    TraceSpan span("FS::mkdir");
 
     std::string catname;
     get_file_name_from_path(dirpath, &catname);
+    if(catname.empty() || catname == "..")
+        return FS_EINVAL;
+    if(catname.length() > FS_MAX_NAME)
+        return FS_ENAMETOOLONG;
+
     chop_file_name(&dirpath);
     int directory_blk = find_final_block(current_directory_block(), dirpath);
-
-    if(directory_blk == -1){
-        std::cout << "Path does not exist\n";
-        return -1;
-    }
-    
-    // Load the current directory directory
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(directory_blk, (uint8_t*)blk);
-
-    int entry_id = find_empty_dir_entry_id(blk);
-    if(entry_id == -1){
-        std::cout << "Could not create directory: Not enough space in directory.\n";
-        return 1;
-    }
-
+    if(directory_blk == -1)
+        return FS_ENOENT;
+
+    // Load the parent directory
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(directory_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+
+    // Files and directories share one name space
+    if(find_in_dir(blk, catname) != -1)
+        return FS_EEXIST;
+
+    goal_group = group_of(directory_blk);
+    bool fat_changed;
+    int entry_id = claim_dir_entry(directory_blk, blk, &fat_changed);
+    if(entry_id == -1)
+        return FS_EDIRFULL;
+
+    // The new directory's block, in a group of its own if it can be
+    goal_group = pick_dir_group();
     int free_block = find_empty_block_id();
-    if(free_block == -1){
-        std::cout << "Could not create directory: No free blocks available.\n";
-        return 1;
-    }
+    if(free_block == -1)
+        return FS_ENOSPC;
 
     // Create directory entry
     dir_entry *entry = blk + entry_id;
-
+    memset(entry, 0, sizeof(dir_entry));
     strcpy(entry->file_name, catname.c_str());
     entry->size = 1;
     entry->first_blk = free_block;
     entry->type = TYPE_DIR;
     entry->access_rights = WRITE | READ | EXECUTE;
 
-    // Update the new directory's own block free_block
-    // with our file ".." that points to the current block
+    // Start the new directory's own block free_block from a "zero-state"
+    // with our file ".." that points to the parent directory
+    dir_entry dir_blk[DIR_ENTRIES];
+    memset(dir_blk, 0, sizeof(dir_blk));
 
-    // Revert the new directory to a "zero-state"
-    dir_entry dir_blk[BLOCK_SIZE];
-    disk.read(free_block, (uint8_t*)dir_blk);
-    for(int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++){
-        dir_blk[i].first_blk = 0;
-        dir_blk[i].size = 0;
-    }
-
-    // Create a ".." in the new directory that points to the current directory
-    dir_entry *parent_entry = dir_blk + 0;      // Explicit + 0 to indicate that the first dir_entry will be the ".." directory 
+    dir_entry *parent_entry = dir_blk + 0;      // Explicit + 0 to indicate that the first dir_entry will be the ".." directory
     strcpy(parent_entry->file_name, "..");
     parent_entry->size = 1;
     parent_entry->first_blk = directory_blk;
     parent_entry->type = TYPE_DIR;
     parent_entry->access_rights = READ | WRITE | EXECUTE;
 
-    // Update FAT 
+    // Update FAT
     fat[free_block] = FAT_EOF;
 
-    disk.write(directory_blk, (uint8_t*)blk);   // Write the current directory block to the disk
-    disk.write(FAT_BLOCK, (uint8_t*)fat);                   // Update the FAT 
-    disk.write(free_block, (uint8_t*)dir_blk);              // Write the new directory block to the disk
-    std::cout << "Successfully created directory " << entry->file_name << "\n";
-    return 0;
+    if(write_block(free_block, (uint8_t*)dir_blk) != 0 ||   // Write the new directory block to the disk
+       write_block(directory_blk, (uint8_t*)blk) != 0)      // Write the parent directory block to the disk
+        return FS_EIO;
+    return write_fat();                                     // Update the FAT
 }
 
 // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
 int
 FS::cd(std::string dirpath)
 {
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(current_directory_block(), (uint8_t*)blk);
+    LatencyTimer timer(latency[LAT_CD]);
+    TraceSpan span("FS::cd");
 
     int final_block = find_final_block(current_directory_block(), dirpath);
-    if(final_block == -1){
-        std::cout << "Path " << dirpath << " is not a valid path.\n";
-        return 1;
-    }
+    if(final_block == -1)
+        return FS_ENOENT;
 
     blk_curr_dir = final_block;
-    return 0;
+    return FS_OK;
 }
 
-// pwd prints the full path, i.e., from the root directory, to the current
+// pwd gets the full path, i.e., from the root directory, to the current
 // directory, including the currect directory name
 int
-FS::pwd()
+FS::pwd(std::string *path)
 {
+    LatencyTimer timer(latency[LAT_PWD]);
+    TraceSpan span("FS::pwd");
+
     int blk_id = current_directory_block();
 
+    path->clear();
     if(blk_id == ROOT_BLOCK){
-        std::cout << "/\n";
-        return 0;
-    } 
+        *path = "/";
+        return FS_OK;
+    }
 
-    std::string path;
-    dir_entry blk[BLOCK_SIZE];
+    dir_entry blk[DIR_ENTRIES];
     do {
-        disk.read(blk_id, (uint8_t*)blk);
+        if(read_block(blk_id, (uint8_t*)blk) != 0)
+            return FS_EIO;
         // First entry in a non-root directory should always be the .. directory
         dir_entry entry = blk[0];
 
         // Read the parent directory block
-        disk.read(entry.first_blk, (uint8_t*)blk);
+        if(read_block(entry.first_blk, (uint8_t*)blk) != 0)
+            return FS_EIO;
 
-        // Iterate over all dir entries in parent directory 
+        // Iterate over all dir entries in parent directory
         // and find which dir_entry points to the current block
         // and insert the name of that dir_entry
-        for(int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++){
-            if(!file_is_visible(blk + i))
+        for(unsigned i = 0; i < DIR_ENTRIES; i++){
+            if(!file_is_visible(blk + i) || blk[i].type != TYPE_DIR)
                 continue;
-            
-            if(blk[i].first_blk == blk_id)
-                path.insert(0, blk[i].file_name);
+
+            if(blk[i].first_blk == blk_id && strcmp(blk[i].file_name, "..") != 0){
+                path->insert(0, blk[i].file_name);
+                break;
+            }
         }
 
         // Insert a "/" and update the current block to the parent's block
-        path.insert(0, "/");
+        path->insert(0, "/");
         blk_id = entry.first_blk;
     } while(blk_id != ROOT_BLOCK);
-    std::cout << path << "\n";
-    
-    return 0;
+
+    return FS_OK;
 }
 
 // chmod <accessrights> <filepath> changes the access rights for the
@@ -837,100 +767,2288 @@ FS::pwd()
 int
 FS::chmod(std::string accessrights, std::string filepath)
 {
-    if(accessrights.at(0) < '0' || accessrights.at(0) > '7' ){
-        std::cout << "Invalid mode: " << accessrights << ".\n";
-        return 1;
-    }
-
+    // Make sure access rights are a single octal digit
+    if(accessrights.length() != 1 || accessrights.at(0) < '0' || accessrights.at(0) > '7')
+        return FS_EINVAL;
+    return chmod(accessrights.at(0) - '0', filepath);
+}
 
-    std::string file_name;
-    get_file_name_from_path(filepath, &file_name);
+int
+FS::chmod(int accessrights, std::string filepath)
+{
+    LatencyTimer timer(latency[LAT_CHMOD]);
+    TraceSpan span("FS::chmod");
 
-    chop_file_name(&filepath);
-    int file_directory_block = find_final_block(current_directory_block(), filepath);
+    if(accessrights < 0 || accessrights > 7)
+        return FS_EINVAL;
 
     // Make sure target destination file exists
-    int file_index = file_exists(file_directory_block, file_name);
-    if(file_index == -1){
-      std::cout << "File \"" << file_name << "\" does not exists.\n";
-      return 1;
-    }
+    int file_directory_block, file_index;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(filepath, &file_directory_block, &file_index, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
 
-    // Make sure access rights are valid
-    int new_access_rights = std::stoi(accessrights);
-    if(new_access_rights < 0 || new_access_rights > 7){
-        std::cout << "Access rights are not valid\n";
-        return 1;
-    }
-
-    // Load the root directory
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(file_directory_block, (uint8_t*)blk);
-
-    // Copy the new name into the file's dir_entry
+    // Copy the new rights into the file's dir_entry, the compression flags stay
     dir_entry *file_entry = blk + file_index;
-    file_entry->access_rights = new_access_rights;
+    file_entry->access_rights = (file_entry->access_rights & ~(READ | WRITE | EXECUTE)) | accessrights;
 
-    disk.write(file_directory_block, (uint8_t*)blk);
-    std::cout << "Changed permissions of " << file_name << " to " << std::to_string(file_entry->access_rights) << "\n";
-    return 0;
+    if(write_block(file_directory_block, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    return FS_OK;
 }
 
-// Returns the index of a file in a directory block
-// if the file does not exist then it returns -1
+// sync writes out everything the disk holds back
 int
-FS::file_exists(uint16_t directory_block, std::string filename)
-{       
-    if(filename.empty())
-        return -1;
+FS::sync()
+{
+    LatencyTimer timer(latency[LAT_SYNC]);
+    TraceSpan span("FS::sync");
 
-    // If it is an absolute path
-    if(filename.at(0) == '/'){
-        filename = filename.erase(0, 1);
-        return file_exists(ROOT_BLOCK, filename);
-    }
+    // what was written so far is where it will stay
+    drop_reservations();
+    return disk.sync() == 0 ? FS_OK : FS_EIO;
+}
 
-    dir_entry blk[BLOCK_SIZE];
-    disk.read(directory_block, (uint8_t*)blk);
+// fsync <filepath> writes out the blocks the file needs to be read back
+int
+FS::fsync(std::string filepath)
+{
+    LatencyTimer timer(latency[LAT_SYNC]);
+    TraceSpan span("FS::fsync");
+
+    int dir_blk, file_idx;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(filepath, &dir_blk, &file_idx, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
+    dir_entry *file_entry = blk + file_idx;
+
+    std::vector<unsigned> blocks;
+    blocks.push_back(dir_blk);
+    blocks.push_back(FAT_BLOCK);
+    if(file_entry->type == TYPE_DIR){
+        blocks.push_back(file_entry->first_blk);
+    } else {
+        if(file_entry->access_rights & TAIL){
+            tail_ref ref;
+            memcpy(&ref, file_entry[1].file_name, sizeof(ref));
+            blocks.push_back(ref.blk);
+        }
+        if(file_entry->first_blk != ROOT_BLOCK){
+            for(int b = file_entry->first_blk; b > FAT_BLOCK && blocks.size() < disk.get_no_blocks(); b = fat[b])
+                blocks.push_back(b);
+            std::map<int, std::pair<int, int> >::iterator res = reservations.find(blocks.back());
+            if(res != reservations.end())
+                drop_reservation(res);
+        }
+    }
+    return disk.sync(blocks) == 0 ? FS_OK : FS_EIO;
+}
 
-    for(int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++){
-        if(file_is_visible(blk + i) && std::string(blk[i].file_name) == filename){
-            return i;
+// fallocate <filepath> <size> preallocates the blocks for the file to grow
+// to size bytes, or gives back those past its content that it does not need
+int
+FS::fallocate(std::string filepath, uint32_t size)
+{
+    LatencyTimer timer(latency[LAT_FALLOCATE]);
+    TraceSpan span("FS::fallocate");
+
+    int dir_blk, file_idx;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(filepath, &dir_blk, &file_idx, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
+    dir_entry *file_entry = blk + file_idx;
+    if(file_entry->type == TYPE_DIR)
+        return FS_EISDIR;
+    if((file_entry->access_rights & WRITE) == 0)
+        return FS_EACCES;
+    // the index of a compressed file has to stay at the end of its chain
+    if(file_entry->access_rights & COMPRESSED)
+        return FS_EINVAL;
+    goal_group = group_of(dir_blk);
+
+    int wanted = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int content = (file_entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int have = file_entry->first_blk == ROOT_BLOCK ? 0 : chain_length(file_entry->first_blk);
+    if(wanted < content)
+        wanted = content;
+    // inline files and files with a tail have nothing past their content
+    if(wanted == have || (wanted == content && have <= content))
+        return FS_OK;
+
+    int shared = file_entry->first_blk == ROOT_BLOCK ? 0 : shared_blocks(file_entry->first_blk);
+    if(!ensure_free(std::max(wanted - have, 0) + shared))
+        return FS_ENOSPC;
+    if(file_entry->access_rights & INLINE){
+        // the content moves to a chain, as claim_dir_entry does it
+        std::string data;
+        int first_block;
+        ret_val = read_file(file_entry, &data);
+        if(ret_val == FS_OK)
+            ret_val = write_chain(data.data(), data.length(), &first_block);
+        if(ret_val != FS_OK)
+            return ret_val;
+        memset(file_entry + 1, 0, ext_entries(file_entry) * sizeof(dir_entry));
+        file_entry->first_blk = first_block;
+        file_entry->access_rights &= ~INLINE;
+    }
+    ret_val = unpack_tail(file_entry);
+    if(ret_val == FS_OK)
+        ret_val = unshare(file_entry);
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    int last = file_entry->first_blk;
+    if(wanted < have){
+        // the blocks of the chain past wanted go
+        for(int i = 1; i < wanted; i++)
+            last = fat[last];
+        std::vector<int> freed;
+        int rest = fat[last];
+        fat[last] = FAT_EOF;
+        free_chain(rest, &freed);
+        discard_blocks(&freed);
+    } else {
+        while(fat[last] != FAT_EOF)
+            last = fat[last];
+        std::vector<int> blocks;
+        ret_val = alloc_blocks(wanted - chain_length(file_entry->first_blk), last + 1, &blocks);
+        if(ret_val != FS_OK)
+            return ret_val;
+        for(size_t i = 0; i < blocks.size(); i++){
+            fat[last] = blocks[i];
+            last = blocks[i];
         }
+        fat[last] = FAT_EOF;
     }
-    return -1;
+
+    if(write_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    return write_fat();
 }
 
-// Returns an empty ID for a directory entry in a list of directory entries
-int 
-FS::find_empty_dir_entry_id(dir_entry* entries)
+// compress <filepath> sets (on) or clears the COMPRESS attribute of a
+// file and rewrites it to match
+int
+FS::compress(std::string filepath, bool on)
 {
-    for(int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++){
-        if(!file_is_visible(entries + i))
-            return i;
+    TraceSpan span("FS::compress");
+
+    int dir_blk, file_idx;
+    dir_entry blk[DIR_ENTRIES];
+    int ret_val = find_entry(filepath, &dir_blk, &file_idx, blk);
+    if(ret_val != FS_OK)
+        return ret_val;
+    dir_entry *file_entry = blk + file_idx;
+    if(file_entry->type == TYPE_DIR)
+        return FS_EISDIR;
+    if((file_entry->access_rights & (READ | WRITE)) != (READ | WRITE))
+        return FS_EACCES;
+    goal_group = group_of(dir_blk);
+
+    bool rewrite = on != ((file_entry->access_rights & COMPRESSED) != 0);
+    std::string data;
+    if(rewrite){
+        ret_val = read_file(file_entry, &data);
+        if(ret_val != FS_OK)
+            return ret_val;
     }
-    return -1;
+    if(on)
+        file_entry->access_rights |= COMPRESS;
+    else
+        file_entry->access_rights &= ~COMPRESS;
+    if(rewrite){
+        ret_val = rewrite_file(blk, file_idx, data.data(), data.length());
+        if(ret_val != FS_OK)
+            return ret_val;
+    }
+
+    if(write_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    return write_fat();
 }
 
-// Returns the block number of the first free block on the disk
-int 
-FS::find_empty_block_id()
+// batch runs a list of create/rm/mv/chmod/mkdir operations as one unit.
+// The operations run one after another exactly as if they were called on
+// their own, except that their block writes only land in staged_blocks.
+int
+FS::batch(const std::vector<batch_op>& ops, unsigned *failed_op)
 {
-    for(int i = 2; i < 2048; i++){
-        if(fat[i] == FAT_FREE)
-            return i;
+    LatencyTimer timer(latency[LAT_BATCH]);
+    TraceSpan span("FS::batch");
+
+    // Keep what we need to roll back if an operation fails
+    int16_t fat_backup[BLOCK_SIZE/2];
+    memcpy(fat_backup, fat, sizeof(fat));
+    std::vector<uint32_t> extra_refs_backup = extra_refs;
+    int blk_curr_dir_backup = blk_curr_dir;
+    int tail_blk_backup = tail_blk;
+    uint32_t tail_fill_backup = tail_fill;
+    std::map<std::pair<int, int>, int> orphans_backup = orphans;
+    std::set<std::pair<int, int> > reaped_backup = reaped;
+    std::map<int, std::pair<int, int> > reservations_backup = reservations;
+    std::vector<bool> reserved_backup = reserved;
+
+    in_batch = true;
+    int ret_val = FS_OK;
+    unsigned i;
+    for(i = 0; i < ops.size(); i++){
+        const batch_op& op = ops[i];
+        switch(op.type){
+        case BATCH_CREATE: ret_val = create(op.arg1, op.arg2); break;
+        case BATCH_RM:     ret_val = rm(op.arg1); break;
+        case BATCH_MV:     ret_val = mv(op.arg1, op.arg2); break;
+        case BATCH_CHMOD:  ret_val = chmod(op.arg1, op.arg2); break;
+        case BATCH_MKDIR:  ret_val = mkdir(op.arg1); break;
+        default:           ret_val = FS_EINVAL; break;
+        }
+        if(ret_val != FS_OK)
+            break;
     }
-    return -1;
+    in_batch = false;
+
+    if(ret_val != FS_OK){
+        memcpy(fat, fat_backup, sizeof(fat));
+        extra_refs = extra_refs_backup;
+        blk_curr_dir = blk_curr_dir_backup;
+        tail_blk = tail_blk_backup;
+        tail_fill = tail_fill_backup;
+        orphans = orphans_backup;
+        reaped = reaped_backup;
+        reservations = reservations_backup;
+        reserved = reserved_backup;
+        count_free_blocks();
+        // the index may name blocks of the failed operations, which are free
+        // again, and is rebuilt from what is on disk
+        if(dedup){
+            dedup = false;
+            set_dedup(true);
+        }
+        staged_blocks.clear();
+        staged_discards.clear();
+        if(failed_op)
+            *failed_op = i;
+        return ret_val;
+    }
+
+    // Write data and directory blocks in block order without flushing each,
+    // then the FAT last so it never points at blocks that are not on disk yet
+    std::map<unsigned, std::vector<uint8_t> >::iterator it;
+    for(it = staged_blocks.begin(); it != staged_blocks.end(); it++){
+        if(it->first != FAT_BLOCK && disk.write(it->first, &it->second[0], false) != 0)
+            ret_val = FS_EIO;
+    }
+    {
+        LatencyTimer flush_timer(latency[LAT_FLUSH]);
+        disk.flush();
+    }
+    it = staged_blocks.find(FAT_BLOCK);
+    if(it != staged_blocks.end() && disk.write(FAT_BLOCK, &it->second[0]) != 0)
+        ret_val = FS_EIO;
+    // the freed blocks may still hold files as far as the disk knows
+    // unless all of it got there. Later operations of the batch may have
+    // taken some of them again.
+    if(ret_val == FS_OK){
+        std::vector<int> freed;
+        for(size_t i = 0; i < staged_discards.size(); i++){
+            if(fat[staged_discards[i]] == FAT_FREE)
+                freed.push_back(staged_discards[i]);
+        }
+        discard_blocks(&freed);
+    }
+
+    staged_blocks.clear();
+    staged_discards.clear();
+    return ret_val;
 }
 
-// Returns the current directory block
+// defrag lays out every file contiguously, see defrag_next for how. The
+// map of the disk is built once and kept up to date by the moves.
 int
-FS::current_directory_block()
+FS::defrag(defrag_progress *progress)
 {
-    return blk_curr_dir;
+    LatencyTimer timer(latency[LAT_DEFRAG]);
+    TraceSpan span("FS::defrag");
+
+    if(in_batch)
+        return FS_EINVAL;
+    disk_stats before = disk.get_stats();
+    // the chains of orphans would be in the way, and the entries of reaped
+    // ones must be cleared before move_blocks writes the FAT
+    reap_all();
+    // so would reservations, the free space ends up in one run anyway
+    drop_reservations();
+    if(!reaped.empty() && write_fat() != FS_OK)
+        return FS_EIO;
+    defrag_map map;
+    int ret_val = build_defrag_map(&map);
+    while(ret_val == FS_OK && !progress->done)
+        ret_val = defrag_next(&map, progress);
+    disk_stats after = disk.get_stats();
+    progress->io += after.reads + after.writes - before.reads - before.writes;
+    return ret_val;
 }
 
-// Returns whether or not a file or directory is visible
+// One step of defrag. The map is built again every time since other
+// operations may have changed anything since the last step.
+int
+FS::defrag_step(defrag_progress *progress)
+{
+    LatencyTimer timer(latency[LAT_DEFRAG]);
+    TraceSpan span("FS::defrag_step");
+
+    if(in_batch)
+        return FS_EINVAL;
+    if(progress->done)
+        return FS_OK;
+    disk_stats before = disk.get_stats();
+    reap_all();
+    // the step may move blocks into reserved ones, or the last block of a
+    // file that a reservation hangs off, so they go as in defrag
+    drop_reservations();
+    if(!reaped.empty() && write_fat() != FS_OK)
+        return FS_EIO;
+    defrag_map map;
+    int ret_val = build_defrag_map(&map);
+    if(ret_val == FS_OK)
+        ret_val = defrag_next(&map, progress);
+    disk_stats after = disk.get_stats();
+    progress->io += after.reads + after.writes - before.reads - before.writes;
+    return ret_val;
+}
+
+// reclaim_step frees the blocks of one file rm left to be freed later.
+// Clearing its entry and writing the FAT are what takes time, the chain
+// is only walked in memory.
+int
+FS::reclaim_step(bool *done)
+{
+    LatencyTimer timer(latency[LAT_RECLAIM]);
+    TraceSpan span("FS::reclaim_step");
+
+    if(in_batch)
+        return FS_EINVAL;
+    if(!orphans.empty())
+        reap(orphans.begin());
+    *done = orphans.empty();
+    return reaped.empty() ? FS_OK : write_fat();
+}
+
+// Counts what reaping every orphan would free, up to the first block of
+// each chain that some other file still refers to
+unsigned
+FS::orphan_blocks()
+{
+    unsigned no_blocks = 0;
+    std::map<std::pair<int, int>, int>::iterator it;
+    for(it = orphans.begin(); it != orphans.end(); it++){
+        unsigned steps = 0;
+        for(int b = it->second; b > FAT_BLOCK && extra_refs[b] == 0 && steps < disk.get_no_blocks(); b = fat[b])
+            steps++;
+        no_blocks += steps;
+    }
+    return no_blocks;
+}
+
+// set_dedup turns deduplication on or off. Turning it on indexes every
+// block of every file, which reads them all.
+int
+FS::set_dedup(bool on)
+{
+    TraceSpan span("FS::set_dedup");
+
+    dedup_clear();
+    dedup = on;
+    if(!on)
+        return FS_OK;
+    std::vector<std::pair<int, int> > files;
+    std::vector<bool> seen(disk.get_no_blocks(), false);
+    int ret_val = dedup_collect(ROOT_BLOCK, &files, &seen);
+    if(ret_val != FS_OK)
+        return ret_val;
+    dir_entry blk[DIR_ENTRIES];
+    uint8_t buf[BLOCK_SIZE];
+    for(size_t i = 0; i < files.size(); i++){
+        if(read_block(files[i].first, (uint8_t*)blk) != 0)
+            return FS_EIO;
+        for(int b = blk[files[i].second].first_blk; b >= 0 && !dedup_indexed[b]; b = fat[b]){
+            if(read_block(b, buf) != 0)
+                return FS_EIO;
+            dedup_insert(b, buf);
+        }
+    }
+    return FS_OK;
+}
+
+// dedup_scan shares the blocks files have in common, see the comment in
+// fs.h. The blocks are read once, hashed by no_threads threads, and then
+// every file's chain is matched against those of the files before it,
+// from its end. Files are relinked like defrag moves blocks: the FAT with
+// the new links first, then the directories, then the FAT with the
+// duplicates freed.
+int
+FS::dedup_scan(unsigned no_threads, dedup_result *result)
+{
+    LatencyTimer timer(latency[LAT_DEDUP]);
+    TraceSpan span("FS::dedup_scan");
+
+    if(in_batch)
+        return FS_EINVAL;
+    memset(result, 0, sizeof(dedup_result));
+    disk_stats before = disk.get_stats();
+    // the FAT is written in the middle of it, see defrag
+    reap_all();
+    if(!reaped.empty() && write_fat() != FS_OK)
+        return FS_EIO;
+    unsigned no_blocks = disk.get_no_blocks();
+    std::vector<std::pair<int, int> > files;
+    std::vector<bool> seen(no_blocks, false);
+    int ret_val = dedup_collect(ROOT_BLOCK, &files, &seen);
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    // Every file's chain, and the content of all their blocks
+    std::vector<std::vector<int> > chains(files.size());
+    std::vector<uint8_t> content((size_t)no_blocks * BLOCK_SIZE);
+    std::vector<bool> loaded(no_blocks, false);
+    std::vector<int> to_hash;
+    std::map<int, std::vector<dir_entry> > dirs;
+    for(size_t i = 0; i < files.size(); i++){
+        std::vector<dir_entry>& dir = dirs[files[i].first];
+        if(dir.empty()){
+            dir.resize(DIR_ENTRIES);
+            if(read_block(files[i].first, (uint8_t*)&dir[0]) != 0)
+                return FS_EIO;
+        }
+        for(int b = dir[files[i].second].first_blk; b >= 0 && chains[i].size() < no_blocks; b = fat[b]){
+            chains[i].push_back(b);
+            if(loaded[b])
+                continue;
+            if(read_block(b, &content[(size_t)b * BLOCK_SIZE]) != 0)
+                return FS_EIO;
+            loaded[b] = true;
+            to_hash.push_back(b);
+        }
+        result->blocks += chains[i].size();
+    }
+    result->files = files.size();
+
+    std::vector<uint64_t> hashes(no_blocks, 0);
+    if(no_threads < 1)
+        no_threads = 1;
+    std::vector<std::thread> threads;
+    for(unsigned t = 0; t < no_threads; t++){
+        threads.push_back(std::thread([&, t]{
+            for(size_t i = t; i < to_hash.size(); i += no_threads)
+                hashes[to_hash[i]] = block_hash(&content[(size_t)to_hash[i] * BLOCK_SIZE]);
+        }));
+    }
+    for(unsigned t = 0; t < no_threads; t++)
+        threads[t].join();
+
+    // Match every chain from its end against the blocks kept so far, a
+    // block matches one with the same content leading to the same block.
+    // canon is what a block is replaced by, or the block itself if it is
+    // kept, and kept_next what a kept block will lead to.
+    std::unordered_multimap<uint64_t, int> kept;
+    std::vector<int> canon(no_blocks, -1);
+    std::vector<int> kept_next(no_blocks, FAT_EOF);
+    std::vector<std::pair<size_t, size_t> > relinks;    // file, first block replaced
+    std::set<int> relinked;
+    for(size_t i = 0; i < files.size(); i++){
+        const std::vector<int>& chain = chains[i];
+        // a preallocated file does not end with its content, see dedup_tail
+        const dir_entry& file = dirs[files[i].first][files[i].second];
+        if(!(file.access_rights & COMPRESSED) && chain.size() > (file.size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+            continue;
+        size_t j = chain.size();
+        int next = FAT_EOF;
+        for(; j > 0; j--){
+            int b = chain[j - 1];
+            if(canon[b] == -1){
+                std::pair<std::unordered_multimap<uint64_t, int>::iterator,
+                          std::unordered_multimap<uint64_t, int>::iterator> range;
+                range = kept.equal_range(dedup_key(hashes[b], next));
+                for(; range.first != range.second; range.first++){
+                    int c = range.first->second;
+                    if(kept_next[c] == next && memcmp(&content[(size_t)c * BLOCK_SIZE],
+                                                      &content[(size_t)b * BLOCK_SIZE], BLOCK_SIZE) == 0){
+                        canon[b] = c;
+                        break;
+                    }
+                }
+                if(canon[b] == -1)
+                    break;
+            }
+            if(canon[b] == b)
+                break;
+            next = canon[b];
+        }
+        // files sharing the block before the run share the run too, and
+        // that block's link is only changed once
+        if(j < chain.size() && (j == 0 || relinked.insert(chain[j - 1]).second))
+            relinks.push_back(std::make_pair(i, j));
+
+        // what is left of the chain is kept for the files after this one
+        int after = j < chain.size() ? canon[chain[j]] : FAT_EOF;
+        for(; j > 0; j--){
+            int b = chain[j - 1];
+            if(canon[b] == -1){
+                canon[b] = b;
+                kept_next[b] = after;
+                kept.insert(std::make_pair(dedup_key(hashes[b], after), b));
+            }
+            after = canon[b];
+        }
+    }
+
+    // The FAT with the new links, the old blocks still look used
+    std::set<int> dirty_dirs;
+    for(size_t r = 0; r < relinks.size(); r++){
+        const std::vector<int>& chain = chains[relinks[r].first];
+        size_t first = relinks[r].second;
+        int target = canon[chain[first]];
+        extra_refs[target]++;
+        if(first > 0)
+            fat[chain[first - 1]] = target;
+        else {
+            std::pair<int, int> file = files[relinks[r].first];
+            dirs[file.first][file.second].first_blk = target;
+            dirty_dirs.insert(file.first);
+        }
+    }
+    if(!relinks.empty() && write_fat() != FS_OK)
+        return FS_EIO;
+    for(std::set<int>::iterator d = dirty_dirs.begin(); d != dirty_dirs.end(); d++){
+        if(write_block(*d, (uint8_t*)&dirs[*d][0]) != 0)
+            return FS_EIO;
+    }
+    if(!dirty_dirs.empty()){
+        LatencyTimer flush_timer(latency[LAT_FLUSH]);
+        disk.flush();
+    }
+
+    // and then the duplicates dropped
+    int free_before = count_free_blocks();
+    for(size_t r = 0; r < relinks.size(); r++)
+        free_chain(chains[relinks[r].first][relinks[r].second]);
+    result->freed = count_free_blocks() - free_before;
+    if(!relinks.empty() && write_fat() != FS_OK)
+        return FS_EIO;
+
+    disk_stats after = disk.get_stats();
+    result->io = after.reads + after.writes - before.reads - before.writes;
+    if(dedup)
+        return set_dedup(true);
+    return FS_OK;
+}
+
+// disk I/O and logical bytes since the FS was mounted or last reset
+void
+FS::get_io_stats(io_stats *stats)
+{
+    stats->disk = disk.get_stats();
+    stats->logical_read = logical_read;
+    stats->logical_written = logical_written;
+}
+
+void
+FS::reset_latency()
+{
+    for(int op = 0; op < LAT_COUNT; op++)
+        latency[op].reset();
+}
+
+void
+FS::reset_io_stats()
+{
+    disk.reset_stats();
+    logical_read = 0;
+    logical_written = 0;
+}
+
+// walk calls visit for every file and directory on the disk, depth first
+// from the root, with its full path. ".." entries are skipped.
+int
+FS::walk(std::function<void(const std::string& path, const dir_entry& entry)> visit)
+{
+    return walk_dir(ROOT_BLOCK, "", visit);
+}
+
+int
+FS::walk_dir(int dir_blk, const std::string& path,
+             std::function<void(const std::string& path, const dir_entry& entry)>& visit)
+{
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(!file_is_visible(blk + i) || strcmp(blk[i].file_name, "..") == 0)
+            continue;
+        std::string entry_path = path + "/" + blk[i].file_name;
+        visit(entry_path, blk[i]);
+        if(blk[i].type == TYPE_DIR){
+            int ret_val = walk_dir(blk[i].first_blk, entry_path, visit);
+            if(ret_val != FS_OK)
+                return ret_val;
+        }
+    }
+    return FS_OK;
+}
+
+// Reads one block, through the staged blocks if a batch is running
+int
+FS::read_block(unsigned block_no, uint8_t *blk)
+{
+    if(in_batch){
+        std::map<unsigned, std::vector<uint8_t> >::iterator it = staged_blocks.find(block_no);
+        if(it != staged_blocks.end()){
+            memcpy(blk, &it->second[0], BLOCK_SIZE);
+            return 0;
+        }
+    }
+    LatencyTimer timer(latency[LAT_DISK_READ]);
+
+    return disk.read(block_no, blk);
+}
+
+// Reads a block of a file's chain. A block that follows the one read
+// before it in its chain confirms a sequential read and doubles the
+// readahead window, any other block is a jump and halves it, so random
+// reads soon stop reading ahead. Once fewer than half a window of the
+// blocks read ahead are left, the window's worth of blocks after this one
+// in the chain is handed to the disk to read in the background.
+int
+FS::read_chain_block(int block, uint8_t *blk)
+{
+    unsigned most = disk.get_readahead_max();
+    if(ra_last >= 0 && fat[ra_last] == block){
+        ra_window = ra_window < READAHEAD_MIN ? READAHEAD_MIN : std::min(2 * ra_window, most);
+        if(ra_left > 0)
+            ra_left--;
+    } else {
+        ra_window /= 2;
+        ra_left = 0;
+    }
+    ra_window = std::min(ra_window, most);
+    ra_last = block;
+
+    // the block itself first, a prefetch drops what it does not ask for
+    if(read_block(block, blk) != 0)
+        return -1;
+    if(ra_window > 0 && ra_left <= ra_window / 2 && !in_batch){
+        std::vector<unsigned> ahead;
+        for(int b = fat[block]; b > FAT_BLOCK && ahead.size() < ra_window; b = fat[b])
+            ahead.push_back(b);
+        if(!ahead.empty())
+            disk.prefetch(ahead);
+        ra_left = ahead.size();
+    }
+    return 0;
+}
+
+// Writes one block, or stages it if a batch is running
+int
+FS::write_block(unsigned block_no, uint8_t *blk)
+{
+    if(in_batch){
+        if(block_no >= disk.get_no_blocks())
+            return -1;
+        staged_blocks[block_no].assign(blk, blk + BLOCK_SIZE);
+        return 0;
+    }
+    LatencyTimer timer(latency[LAT_DISK_WRITE]);
+
+    return disk.write(block_no, blk);
+}
+
+// Copies blocks, each from first to second, without flushing. Where both
+// sides run on to the next block the run goes to the disk as one copy so
+// the host can move it without passing it through us.
+int
+FS::copy_blocks(const std::vector<std::pair<int, int> >& copies)
+{
+    TraceSpan span("FS::copy_blocks");
+
+    uint8_t buf[BLOCK_SIZE];
+    for(size_t i = 0; i < copies.size(); ){
+        int from = copies[i].first, to = copies[i].second;
+        if(in_batch){
+            if(read_block(from, buf) != 0 || write_block(to, buf) != 0)
+                return FS_EIO;
+            i++;
+            continue;
+        }
+        unsigned run = 1;
+        while(i + run < copies.size() && copies[i + run].first == from + (int)run &&
+              copies[i + run].second == to + (int)run)
+            run++;
+        LatencyTimer timer(latency[LAT_DISK_WRITE]);
+        if(disk.copy(from, to, run, false) != 0)
+            return FS_EIO;
+        i += run;
+    }
+    return FS_OK;
+}
+
+// Writes the in-memory FAT to its block
+int
+FS::write_fat()
+{
+    // the entries of reaped orphans go first, see reaped
+    std::set<std::pair<int, int> >::iterator it = reaped.begin();
+    while(it != reaped.end()){
+        int dir_blk = it->first;
+        dir_entry blk[DIR_ENTRIES];
+        if(read_block(dir_blk, (uint8_t*)blk) != 0)
+            return FS_EIO;
+        for(; it != reaped.end() && it->first == dir_blk; it++){
+            if(blk[it->second].type == TYPE_ORPHAN)
+                memset(blk + it->second, 0, sizeof(dir_entry));
+        }
+        if(write_block(dir_blk, (uint8_t*)blk) != 0)
+            return FS_EIO;
+    }
+    reaped.clear();
+
+    if(write_block(FAT_BLOCK, (uint8_t*)fat) != 0)
+        return FS_EIO;
+    return FS_OK;
+}
+
+// Resolves filepath into the directory block it lives in and its index in
+// that block. The directory is left loaded in entries (DIR_ENTRIES long).
+int
+FS::find_entry(std::string filepath, int *dir_blk, int *index, dir_entry *entries)
+{
+    TraceSpan span("FS::find_entry");
+
+    std::string filename;
+    get_file_name_from_path(filepath, &filename);   // The file name
+    chop_file_name(&filepath);                      // The path to the file excluding the file's name
+
+    // Find the directory block id where the file resides
+    *dir_blk = find_final_block(current_directory_block(), filepath);
+    if(*dir_blk == -1)
+        return FS_ENOENT;
+
+    if(read_block(*dir_blk, (uint8_t*)entries) != 0)
+        return FS_EIO;
+
+    *index = find_in_dir(entries, filename);
+    if(*index == -1)
+        return FS_ENOENT;
+    return FS_OK;
+}
+
+// Reads the whole content of a file, all entry->size bytes of it
+int
+FS::read_file(const dir_entry *entry, std::string *data)
+{
+    TraceSpan span("FS::read_file");
+
+    if(entry->access_rights & COMPRESSED)
+        return read_compressed(entry, 0, entry->size, data);
+
+    data->clear();
+    data->reserve(entry->size);
+    if(entry->access_rights & INLINE){
+        for(uint32_t pos = 0; pos < entry->size; pos += EXT_BYTES){
+            const dir_entry *ext = entry + 1 + pos / EXT_BYTES;
+            data->append(ext->file_name, entry->size - pos < EXT_BYTES ? entry->size - pos : EXT_BYTES);
+        }
+        return FS_OK;
+    }
+
+    uint8_t buf[BLOCK_SIZE];
+    uint32_t tail = entry->access_rights & TAIL ? entry->size % BLOCK_SIZE : 0;
+    uint32_t left = entry->size - tail;
+    int block = entry->first_blk;
+    while(left > 0 && block != FAT_EOF){
+        if(read_chain_block(block, buf) != 0)
+            return FS_EIO;
+        uint32_t n = left < BLOCK_SIZE ? left : BLOCK_SIZE;
+        data->append((char*)buf, n);
+        left -= n;
+        block = fat[block];
+    }
+    if(tail > 0){
+        tail_ref ref;
+        memcpy(&ref, entry[1].file_name, sizeof(ref));
+        if(ref.offset + tail > BLOCK_SIZE || read_block(ref.blk, buf) != 0)
+            return FS_EIO;
+        data->append((char*)buf + ref.offset, tail);
+    }
+    return FS_OK;
+}
+
+// Writes len bytes of data to a new chain of blocks, in one run if there is
+// one, *first_blk is set to the first block of the chain. Nothing is
+// allocated if the disk is too full.
+// With dedup on, the blocks at the end of the data that some file already
+// has, followed by the same blocks, are shared instead of written.
+int
+FS::write_chain(const char *data, uint32_t len, int *first_blk)
+{
+    TraceSpan span("FS::write_chain");
+
+    int no_blocks = len == 0 ? 1 : (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint8_t data_blk[BLOCK_SIZE];   // The last block is only partly filled by data
+    int shared = FAT_EOF;           // What the last new block leads to
+    int no_new = no_blocks;
+    while(dedup && no_new > 0){
+        fill_block(data, len, no_new - 1, data_blk);
+        int block = dedup_find(data_blk, shared, -1);
+        if(block == -1)
+            break;
+        shared = block;
+        no_new--;
+    }
+    if(!ensure_free(no_new))
+        return FS_ENOSPC;
+
+    int previous_block = -1;        // Which block we wrote to last iteration
+    *first_blk = shared;
+    std::vector<int> new_blocks;
+    int ret_val = alloc_blocks(no_new, -1, &new_blocks);
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    for(int i = 0; i < no_new; i++){
+        int block = new_blocks[i];
+        fill_block(data, len, i, data_blk);
+        if(write_block(block, data_blk) != 0)
+            return FS_EIO;
+
+        // Mark the fat table, the last new block leads to the shared part
+        fat[block] = i == no_new - 1 ? shared : FAT_EOF;
+        if(previous_block != -1)
+            fat[previous_block] = block;
+        else
+            *first_blk = block;
+        previous_block = block;
+    }
+    // the shared part gains a reference from the last new block or the entry
+    if(shared != FAT_EOF)
+        extra_refs[shared]++;
+    for(size_t i = 0; dedup && i < new_blocks.size(); i++){
+        fill_block(data, len, i, data_blk);
+        dedup_insert(new_blocks[i], data_blk);
+    }
+    return FS_OK;
+}
+
+// Stores len bytes of data as the content of the file in entries[index],
+// which has no content yet, and sets its size, first_blk and storage flags.
+// Small files go inline if the entries after it are free, files with
+// COMPRESS are compressed if that saves blocks, and the tails of the others
+// are packed if the entry after it is free.
+int
+FS::store_file(dir_entry *entries, int index, const char *data, uint32_t len)
+{
+    TraceSpan span("FS::store_file");
+
+    dir_entry *entry = entries + index;
+    entry->access_rights &= ~(COMPRESSED | INLINE | TAIL);
+    entry->size = len;
+    entry->first_blk = ROOT_BLOCK;
+    unsigned free_after = 0;
+    while(index + 1 + free_after < DIR_ENTRIES && free_after < INLINE_MAX_EXT &&
+          !file_is_visible(entry + 1 + free_after) && entry[1 + free_after].type != TYPE_EXT &&
+          entry[1 + free_after].type != TYPE_ORPHAN)
+        free_after++;
+
+    if(len <= INLINE_MAX && free_after >= (len + EXT_BYTES - 1) / EXT_BYTES){
+        for(uint32_t pos = 0; pos < len; pos += EXT_BYTES){
+            dir_entry *ext = entry + 1 + pos / EXT_BYTES;
+            memset(ext, 0, sizeof(dir_entry));
+            ext->type = TYPE_EXT;
+            memcpy(ext->file_name, data + pos, len - pos < EXT_BYTES ? len - pos : EXT_BYTES);
+        }
+        entry->access_rights |= INLINE;
+        return FS_OK;
+    }
+
+    int first_block;
+    if(entry->access_rights & COMPRESS){
+        std::vector<uint32_t> ends;
+        std::string stream;
+        if(compress_tail(&ends, 0, data, len, &stream) == FS_OK &&
+           stream.length() / BLOCK_SIZE < (len + BLOCK_SIZE - 1) / BLOCK_SIZE){
+            int ret_val = write_chain(stream.data(), stream.length(), &first_block);
+            if(ret_val != FS_OK)
+                return ret_val;
+            entry->first_blk = first_block;
+            entry->access_rights |= COMPRESSED;
+            return FS_OK;
+        }
+    }
+
+    uint32_t tail = len % BLOCK_SIZE;
+    if(tail > TAIL_MAX || free_after == 0)
+        tail = 0;
+    if(len > tail){
+        int ret_val = write_chain(data, len - tail, &first_block);
+        if(ret_val != FS_OK)
+            return ret_val;
+        entry->first_blk = first_block;
+    }
+    if(tail > 0){
+        tail_ref ref;
+        int ret_val = pack_tail(data + len - tail, tail, &ref);
+        if(ret_val != FS_OK){
+            if(entry->first_blk != ROOT_BLOCK)
+                free_chain(entry->first_blk);
+            entry->first_blk = ROOT_BLOCK;
+            return ret_val;
+        }
+        memset(entry + 1, 0, sizeof(dir_entry));
+        entry[1].type = TYPE_EXT;
+        memcpy(entry[1].file_name, &ref, sizeof(ref));
+        entry->access_rights |= TAIL;
+    }
+    return FS_OK;
+}
+
+// Drops the content of the file whose entry is pointed at, which is in its
+// directory block: its chain, its tail and its TYPE_EXT entries
+void
+FS::release_file(dir_entry *entry)
+{
+    if(entry->access_rights & TAIL){
+        tail_ref ref;
+        memcpy(&ref, entry[1].file_name, sizeof(ref));
+        free_chain(ref.blk);
+        if(ref.blk == tail_blk && fat[ref.blk] == FAT_FREE)
+            tail_blk = -1;
+    }
+    if(entry->first_blk != ROOT_BLOCK)
+        free_chain(entry->first_blk);
+    memset(entry + 1, 0, ext_entries(entry) * sizeof(dir_entry));
+    entry->first_blk = ROOT_BLOCK;
+    entry->access_rights &= ~(COMPRESSED | INLINE | TAIL);
+}
+
+// Replaces the content of the file in entries[index] with data. The new
+// content is stored before the old is dropped, so until the directory is
+// written the old one is still whole on disk.
+int
+FS::rewrite_file(dir_entry *entries, int index, const char *data, uint32_t len)
+{
+    dir_entry old[1 + INLINE_MAX_EXT];
+    unsigned no_ext = ext_entries(entries + index);
+    memcpy(old, entries + index, (1 + no_ext) * sizeof(dir_entry));
+    memset(entries + index + 1, 0, no_ext * sizeof(dir_entry));
+    int ret_val = store_file(entries, index, data, len);
+    if(ret_val != FS_OK){
+        memcpy(entries + index, old, (1 + no_ext) * sizeof(dir_entry));
+        return ret_val;
+    }
+    // the old content's entries are in old, release_file only clears those
+    release_file(old);
+    return FS_OK;
+}
+
+// Adds len bytes to the tail block, starting a new one if they do not fit
+int
+FS::pack_tail(const char *data, uint32_t len, tail_ref *ref)
+{
+    TraceSpan span("FS::pack_tail");
+
+    uint8_t buf[BLOCK_SIZE];
+    if(tail_blk == -1 || tail_fill + len > BLOCK_SIZE){
+        int block = find_empty_block_id();
+        if(block == -1)
+            return FS_ENOSPC;
+        fat[block] = FAT_EOF;
+        extra_refs[block] = 0;
+        tail_blk = block;
+        tail_fill = 0;
+        memset(buf, 0, BLOCK_SIZE);
+    } else {
+        if(read_block(tail_blk, buf) != 0)
+            return FS_EIO;
+        extra_refs[tail_blk]++;
+    }
+    memcpy(buf + tail_fill, data, len);
+    if(write_block(tail_blk, buf) != 0)
+        return FS_EIO;
+    ref->blk = tail_blk;
+    ref->offset = tail_fill;
+    tail_fill += len;
+    return FS_OK;
+}
+
+// Moves the tail of a file into a block of its own at the end of its
+// chain, so it can be written to like any other
+int
+FS::unpack_tail(dir_entry *entry)
+{
+    TraceSpan span("FS::unpack_tail");
+
+    if(!(entry->access_rights & TAIL))
+        return FS_OK;
+    if(entry->first_blk != ROOT_BLOCK){
+        if(!ensure_free(1 + shared_blocks(entry->first_blk)))
+            return FS_ENOSPC;
+        int ret_val = unshare(entry);
+        if(ret_val != FS_OK)
+            return ret_val;
+    } else if(!ensure_free(1))
+        return FS_ENOSPC;
+
+    tail_ref ref;
+    memcpy(&ref, entry[1].file_name, sizeof(ref));
+    uint32_t tail = entry->size % BLOCK_SIZE;
+    uint8_t buf[BLOCK_SIZE], blk[BLOCK_SIZE];
+    if(read_block(ref.blk, buf) != 0)
+        return FS_EIO;
+    memset(blk, 0, BLOCK_SIZE);
+    memcpy(blk, buf + ref.offset, tail);
+    int block = find_empty_block_id();
+    if(write_block(block, blk) != 0)
+        return FS_EIO;
+    fat[block] = FAT_EOF;
+    if(entry->first_blk == ROOT_BLOCK){
+        entry->first_blk = block;
+    } else {
+        int last = entry->first_blk;
+        while(fat[last] != FAT_EOF)
+            last = fat[last];
+        fat[last] = block;
+    }
+
+    free_chain(ref.blk);
+    if(ref.blk == tail_blk && fat[ref.blk] == FAT_FREE)
+        tail_blk = -1;
+    memset(entry + 1, 0, sizeof(dir_entry));
+    entry->access_rights &= ~TAIL;
+    return FS_OK;
+}
+
+// The number of TYPE_EXT entries after a file's own
+unsigned
+FS::ext_entries(const dir_entry *entry)
+{
+    if(entry->type != TYPE_FILE)
+        return 0;
+    if(entry->access_rights & INLINE)
+        return (entry->size + EXT_BYTES - 1) / EXT_BYTES;
+    return entry->access_rights & TAIL ? 1 : 0;
+}
+
+// The number of TYPE_EXT entries a file of len bytes would like to have
+unsigned
+FS::ext_wanted(uint32_t len)
+{
+    if(len <= INLINE_MAX)
+        return (len + EXT_BYTES - 1) / EXT_BYTES;
+    return len % BLOCK_SIZE != 0 && len % BLOCK_SIZE <= TAIL_MAX ? 1 : 0;
+}
+
+// Finds a free entry like find_empty_dir_entry_id in the directory in
+// dir_blk. If there is none, the orphans in it are reaped and their
+// entries cleared, and if that does not free one either, the file with
+// the most TYPE_EXT entries gives them up, its inline content or tail
+// moves to blocks. *fat_changed is set if either happened.
+int
+FS::claim_dir_entry(int dir_blk, dir_entry *entries, bool *fat_changed)
+{
+    *fat_changed = false;
+    int index = find_empty_dir_entry_id(entries);
+    if(index != -1)
+        return index;
+
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(entries[i].type != TYPE_ORPHAN)
+            continue;
+        std::pair<int, int> key(dir_blk, i);
+        std::map<std::pair<int, int>, int>::iterator it = orphans.find(key);
+        if(it != orphans.end())
+            reap(it);
+        reaped.erase(key);
+        memset(entries + i, 0, sizeof(dir_entry));
+        *fat_changed = true;
+    }
+    if(*fat_changed)
+        return find_empty_dir_entry_id(entries);
+
+    int victim = -1;
+    unsigned most = 0;
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(file_is_visible(entries + i) && ext_entries(entries + i) > most){
+            victim = i;
+            most = ext_entries(entries + i);
+        }
+    }
+    if(victim == -1)
+        return -1;
+    dir_entry *entry = entries + victim;
+    if(entry->access_rights & TAIL){
+        if(unpack_tail(entry) != FS_OK)
+            return -1;
+    } else {
+        std::string data;
+        int first_block;
+        if(read_file(entry, &data) != FS_OK || write_chain(data.data(), data.length(), &first_block) != FS_OK)
+            return -1;
+        memset(entry + 1, 0, most * sizeof(dir_entry));
+        entry->first_blk = first_block;
+        entry->access_rights &= ~INLINE;
+    }
+    *fat_changed = true;
+    return find_empty_dir_entry_id(entries);
+}
+
+// Index of the first of count free entries in a row, or -1
+int
+FS::find_free_run(dir_entry *entries, unsigned count)
+{
+    unsigned run = 0;
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(file_is_visible(entries + i) || entries[i].type == TYPE_EXT || entries[i].type == TYPE_ORPHAN)
+            run = 0;
+        else if(++run == count)
+            return i + 1 - count;
+    }
+    return -1;
+}
+
+// A compressed file is a stream of chunks, each the lz_compress of
+// COMPRESS_CHUNK bytes of content (less for the last one) or the bytes
+// themselves if they do not compress. It ends with an index in the last
+// bytes of the last block: the end of every chunk in the stream, then the
+// number of chunks, all uint32_t. compress_tail compresses len bytes of data
+// into chunks that start at byte base of the stream, after the chunks whose
+// ends are already in ends. *tail is the stream from base on, index included.
+int
+FS::compress_tail(std::vector<uint32_t> *ends, uint32_t base, const char *data, uint32_t len,
+                  std::string *tail)
+{
+    std::vector<uint8_t> buf(COMPRESS_CHUNK);
+    tail->clear();
+    for(uint32_t pos = 0; pos < len; pos += COMPRESS_CHUNK){
+        uint32_t n = len - pos < COMPRESS_CHUNK ? len - pos : COMPRESS_CHUNK;
+        size_t packed = lz_compress((const uint8_t*)data + pos, n, &buf[0], n - 1);
+        if(packed == 0)
+            tail->append(data + pos, n);
+        else
+            tail->append((char*)&buf[0], packed);
+        ends->push_back(base + tail->length());
+    }
+    uint32_t no_chunks = ends->size();
+    uint32_t index = 4 * no_chunks + 4;
+    if(index > BLOCK_SIZE)
+        return FS_ENOSPC;
+
+    // pad so the index ends with the block
+    uint32_t end = base + tail->length() + index;
+    tail->append((BLOCK_SIZE - end % BLOCK_SIZE) % BLOCK_SIZE, '\0');
+    if(no_chunks > 0)
+        tail->append((char*)&(*ends)[0], 4 * no_chunks);
+    tail->append((char*)&no_chunks, 4);
+    return FS_OK;
+}
+
+// Reads the chain and the chunk index of a compressed file. The last
+// block, which holds the index, is left in buf.
+int
+FS::read_index(const dir_entry *entry, std::vector<int> *chain, std::vector<uint32_t> *ends, uint8_t *buf)
+{
+    chain->clear();
+    for(int b = entry->first_blk; b >= 0 && chain->size() < disk.get_no_blocks(); b = fat[b])
+        chain->push_back(b);
+    if(chain->empty() || read_block(chain->back(), buf) != 0)
+        return FS_EIO;
+
+    uint32_t no_chunks;
+    memcpy(&no_chunks, buf + BLOCK_SIZE - 4, 4);
+    if(no_chunks != (entry->size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK || 4 * no_chunks + 4 > BLOCK_SIZE)
+        return FS_EIO;
+    ends->resize(no_chunks);
+    if(no_chunks > 0)
+        memcpy(&(*ends)[0], buf + BLOCK_SIZE - 4 - 4 * no_chunks, 4 * no_chunks);
+    uint32_t stream_end = chain->size() * BLOCK_SIZE - 4 * no_chunks - 4, start = 0;
+    for(uint32_t k = 0; k < no_chunks; k++){
+        if((*ends)[k] <= start || (*ends)[k] > stream_end)
+            return FS_EIO;
+        start = (*ends)[k];
+    }
+    return FS_OK;
+}
+
+// Reads len bytes of the content of a compressed file from byte pos on.
+// Only the blocks holding the chunks of that range are read.
+int
+FS::read_compressed(const dir_entry *entry, uint32_t pos, uint32_t len, std::string *data)
+{
+    TraceSpan span("FS::read_compressed");
+
+    std::vector<int> chain;
+    std::vector<uint32_t> ends;
+    uint8_t last_blk[BLOCK_SIZE];
+    int ret_val = read_index(entry, &chain, &ends, last_blk);
+    if(ret_val != FS_OK)
+        return ret_val;
+    data->clear();
+    if(len == 0 || pos >= entry->size)
+        return FS_OK;
+    if(len > entry->size - pos)
+        len = entry->size - pos;
+    data->reserve(len);
+
+    uint32_t first = pos / COMPRESS_CHUNK, last = (pos + len - 1) / COMPRESS_CHUNK;
+    uint32_t from = first > 0 ? ends[first - 1] : 0, to = ends[last];
+    uint32_t first_blk = from / BLOCK_SIZE;
+    std::vector<uint8_t> stream(((to + BLOCK_SIZE - 1) / BLOCK_SIZE - first_blk) * BLOCK_SIZE);
+    for(uint32_t b = first_blk; b * BLOCK_SIZE < to; b++){
+        if(b == chain.size() - 1)
+            memcpy(&stream[(b - first_blk) * BLOCK_SIZE], last_blk, BLOCK_SIZE);
+        else if(read_chain_block(chain[b], &stream[(b - first_blk) * BLOCK_SIZE]) != 0)
+            return FS_EIO;
+    }
+
+    std::vector<uint8_t> chunk(COMPRESS_CHUNK);
+    for(uint32_t k = first; k <= last; k++){
+        uint32_t start = k > 0 ? ends[k - 1] : 0, packed = ends[k] - start;
+        uint32_t chunk_pos = k * COMPRESS_CHUNK;
+        uint32_t n = entry->size - chunk_pos < COMPRESS_CHUNK ? entry->size - chunk_pos : COMPRESS_CHUNK;
+        const uint8_t *src = &stream[start - first_blk * BLOCK_SIZE];
+        if(packed == n)
+            memcpy(&chunk[0], src, n);
+        else if(lz_decompress(src, packed, &chunk[0], n) != 0)
+            return FS_EIO;
+        uint32_t lo = pos > chunk_pos ? pos - chunk_pos : 0;
+        uint32_t hi = pos + len < chunk_pos + n ? pos + len - chunk_pos : n;
+        data->append((char*)&chunk[lo], hi - lo);
+    }
+    return FS_OK;
+}
+
+// Appends data to the content of a compressed file in place of its '\0'.
+// Only the last chunk is compressed again, together with data, and only
+// the blocks from the one that chunk starts in on are replaced.
+int
+FS::append_compressed(dir_entry *entry, const std::string& data)
+{
+    TraceSpan span("FS::append_compressed");
+
+    std::vector<int> chain;
+    std::vector<uint32_t> ends;
+    uint8_t buf[BLOCK_SIZE];
+    int ret_val = read_index(entry, &chain, &ends, buf);
+    if(ret_val != FS_OK)
+        return ret_val;
+    uint32_t last = ends.size() - 1;
+    std::string content;
+    ret_val = read_compressed(entry, last * COMPRESS_CHUNK, entry->size - last * COMPRESS_CHUNK, &content);
+    if(ret_val != FS_OK)
+        return ret_val;
+    content.erase(content.length() - 1);
+    content.append(data);
+
+    // The kept blocks must be ours, a shared one would change for the other file too
+    uint32_t base = last > 0 ? ends[last - 1] : 0;
+    unsigned keep = base / BLOCK_SIZE;
+    for(unsigned i = 0; i < keep; i++){
+        if(extra_refs[chain[i]] > 0){
+            ret_val = unshare(entry);
+            if(ret_val != FS_OK)
+                return ret_val;
+            ret_val = read_index(entry, &chain, &ends, buf);
+            if(ret_val != FS_OK)
+                return ret_val;
+            break;
+        }
+    }
+
+    // The first new block starts with the end of the chunk before
+    std::string stream;
+    if(base % BLOCK_SIZE != 0){
+        if(read_block(chain[keep], buf) != 0)
+            return FS_EIO;
+        stream.assign((char*)buf, base % BLOCK_SIZE);
+    }
+    std::string tail;
+    ends.resize(last);
+    ret_val = compress_tail(&ends, base, content.data(), content.length(), &tail);
+    if(ret_val != FS_OK)
+        return ret_val;
+    stream.append(tail);
+
+    int first_block;
+    ret_val = write_chain(stream.data(), stream.length(), &first_block);
+    if(ret_val != FS_OK)
+        return ret_val;
+    if(keep == 0)
+        entry->first_blk = first_block;
+    else
+        fat[chain[keep - 1]] = first_block;
+    free_chain(chain[keep]);
+    return FS_OK;
+}
+
+// Writes len bytes of data at byte position pos of the chain starting at
+// first_blk, growing the chain with new blocks if it is too short, see
+// grow_chain. pos may be at most the number of bytes the chain can hold.
+// What the chain holds after the block with pos is taken to be past the
+// end of the file, like preallocated blocks, and is not read. The caller
+// makes sure there are enough free blocks, and that the chain is not
+// shared with another file, see unshare.
+int
+FS::write_at(int first_blk, uint32_t pos, const char *data, uint32_t len)
+{
+    TraceSpan span("FS::write_at");
+
+    // Walk to the block holding pos
+    int block = first_blk;
+    while(pos >= BLOCK_SIZE && fat[block] != FAT_EOF){
+        block = fat[block];
+        pos -= BLOCK_SIZE;
+    }
+
+    // The blocks after it the data goes on to, those the chain has first
+    uint32_t over = len > BLOCK_SIZE - pos ? len - (BLOCK_SIZE - pos) : 0;
+    int more = (over + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<int> next_blocks;
+    int last = block;
+    while((int)next_blocks.size() < more && fat[last] != FAT_EOF){
+        last = fat[last];
+        next_blocks.push_back(last);
+    }
+    if((int)next_blocks.size() < more){
+        std::vector<int> grown;
+        int ret_val = grow_chain(last, more - next_blocks.size(), &grown);
+        if(ret_val != FS_OK)
+            return ret_val;
+        for(size_t i = 0; i < grown.size(); i++){
+            fat[last] = grown[i];
+            last = grown[i];
+        }
+        fat[last] = FAT_EOF;
+        next_blocks.insert(next_blocks.end(), grown.begin(), grown.end());
+    }
+
+    uint8_t buf[BLOCK_SIZE];
+    bool fresh = false;     // a block past the end of the file has nothing worth reading
+    size_t next = 0;
+    while(len > 0){
+        if(pos == BLOCK_SIZE){
+            block = next_blocks[next++];
+            fresh = true;
+            pos = 0;
+        }
+
+        uint32_t n = BLOCK_SIZE - pos;
+        if(n > len)
+            n = len;
+        if(fresh)
+            memset(buf, 0, BLOCK_SIZE);
+        else if(n < BLOCK_SIZE && read_block(block, buf) != 0)
+            return FS_EIO;
+        memcpy(buf + pos, data, n);
+        if(write_block(block, buf) != 0)
+            return FS_EIO;
+
+        data += n;
+        len -= n;
+        pos += n;
+    }
+    return FS_OK;
+}
+
+// Finds count free blocks for a chain and sets *blocks to them, in order.
+// They are the run starting at hint if it is free, else the first free run
+// that is long enough starting in goal_group or a group after it (going
+// round), else the first free blocks in that order. Reserved blocks are
+// only taken when there are no others. Nothing is marked in fat, that is
+// up to the caller.
+int
+FS::alloc_blocks(int count, int hint, std::vector<int> *blocks)
+{
+    LatencyTimer timer(latency[LAT_ALLOC]);
+    TraceSpan span("FS::alloc_blocks");
+
+    blocks->clear();
+    if(count <= 0)
+        return FS_OK;
+    int no_blocks = disk.get_no_blocks();
+    int start = -1;
+    if(hint > FAT_BLOCK && hint + count <= no_blocks){
+        int run = 0;
+        while(run < count && fat[hint + run] == FAT_FREE && !reserved[hint + run])
+            run++;
+        if(run == count)
+            start = hint;
+    }
+    int no_groups = group_free.size();
+    for(int n = 0; start == -1 && n < no_groups; n++){
+        int g = (goal_group + n) % no_groups;
+        if(group_free[g] <= 0)
+            continue;
+        // a run starts in the group, and may go on into the next
+        int run = 0;
+        for(int b = std::max(2, g * ALLOC_GROUP_BLOCKS); b < no_blocks && (b < (g + 1) * ALLOC_GROUP_BLOCKS || run > 0); b++){
+            run = fat[b] == FAT_FREE && !reserved[b] ? run + 1 : 0;
+            if(run == count){
+                start = b + 1 - count;
+                break;
+            }
+        }
+    }
+    if(start != -1){
+        for(int i = 0; i < count; i++)
+            blocks->push_back(start + i);
+    } else {
+        // whole groups in the same order, group_free is not asked
+        int first = std::max(2, goal_group * ALLOC_GROUP_BLOCKS);
+        for(int i = 0; i < no_blocks - 2 && (int)blocks->size() < count; i++){
+            int b = 2 + (first - 2 + i) % (no_blocks - 2);
+            if(fat[b] == FAT_FREE && !reserved[b])
+                blocks->push_back(b);
+        }
+    }
+    if((int)blocks->size() == count){
+        for(int i = 0; i < count; i++)
+            group_free[group_of((*blocks)[i])]--;
+        return FS_OK;
+    }
+    // reserved blocks, and then the blocks of removed files, are there to be had
+    if(!reservations.empty()){
+        drop_reservations();
+        return alloc_blocks(count, hint, blocks);
+    }
+    if(!orphans.empty()){
+        reap_all();
+        return alloc_blocks(count, hint, blocks);
+    }
+    blocks->clear();
+    return FS_ENOSPC;
+}
+
+// Finds count free blocks to follow last at the end of a chain, right
+// after it if they are free, see alloc_blocks. With delayed allocation they
+// come out of the reservation the chain has, and the free blocks after the
+// new end are reserved for it, twice as many as last time.
+int
+FS::grow_chain(int last, int count, std::vector<int> *blocks)
+{
+    int hint = last + 1, window = 0;
+    std::map<int, std::pair<int, int> >::iterator res = reservations.find(last);
+    if(res != reservations.end()){
+        hint = res->second.first;
+        window = res->second.second;
+        drop_reservation(res);
+    }
+    int ret_val = alloc_blocks(count, hint, blocks);
+    if(ret_val != FS_OK || !delalloc)
+        return ret_val;
+
+    window = std::min(RESERVE_MAX, std::max(RESERVE_MIN, std::max(2 * window, count)));
+    if(reservations.size() >= RESERVE_FILES)
+        drop_reservation(reservations.begin());
+    int end = blocks->back(), no_blocks = disk.get_no_blocks(), n = 0;
+    while(n < window && end + 1 + n < no_blocks && fat[end + 1 + n] == FAT_FREE && !reserved[end + 1 + n]){
+        reserved[end + 1 + n] = true;
+        n++;
+    }
+    if(n > 0)
+        reservations[end] = std::make_pair(end + 1, n);
+    return FS_OK;
+}
+
+// Gives the blocks of a reservation back
+void
+FS::drop_reservation(std::map<int, std::pair<int, int> >::iterator res)
+{
+    for(int i = 0; i < res->second.second; i++)
+        reserved[res->second.first + i] = false;
+    reservations.erase(res);
+}
+
+void
+FS::drop_reservations()
+{
+    while(!reservations.empty())
+        drop_reservation(reservations.begin());
+}
+
+// Returns the number of blocks in the chain starting at first_blk
+int
+FS::chain_length(int first_blk)
+{
+    int no_blocks = 0;
+    for(int b = first_blk; b > FAT_BLOCK && no_blocks < (int)disk.get_no_blocks(); b = fat[b])
+        no_blocks++;
+    return no_blocks;
+}
+
+// Drops a reference to the chain starting at first_blk. Its blocks are
+// marked as free up to the first one some other file still refers to, and
+// added to freed if given.
+void
+FS::free_chain(int first_blk, std::vector<int> *freed)
+{
+    TraceSpan span("FS::free_chain");
+
+    int blk_rm = first_blk, tmp = 0;
+    while(blk_rm != FAT_EOF && blk_rm != FAT_FREE){
+        if(extra_refs[blk_rm] > 0){
+            extra_refs[blk_rm]--;
+            break;
+        }
+        tmp = blk_rm;
+        blk_rm = fat[blk_rm];       // Next block
+        fat[tmp] = FAT_FREE;
+        group_free[group_of(tmp)]++;
+        dedup_remove(tmp);
+        if(freed)
+            freed->push_back(tmp);
+    }
+}
+
+// Copies block i of the len bytes in data into blk, zero filled after the end
+void
+FS::fill_block(const char *data, uint32_t len, int i, uint8_t *blk)
+{
+    uint32_t pos = (uint32_t)i * BLOCK_SIZE;
+    uint32_t n = pos >= len ? 0 : len - pos < BLOCK_SIZE ? len - pos : BLOCK_SIZE;
+    memset(blk, 0, BLOCK_SIZE);
+    memcpy(blk, data + pos, n);
+}
+
+// Returns how many blocks unshare would have to copy for the chain
+// starting at first_blk: all of them from the first shared one on
+int
+FS::shared_blocks(int first_blk)
+{
+    int b = first_blk;
+    while(b >= 0 && extra_refs[b] == 0)
+        b = fat[b];
+    int no_blocks = 0;
+    for(; b >= 0; b = fat[b])
+        no_blocks++;
+    return no_blocks;
+}
+
+// Makes the chain of entry its own before it is written to. A chain is
+// shared from some block to its end, since the FAT entry of a block is the
+// same whichever file reaches it. That part is copied to new blocks and
+// loses the reference entry had to it.
+int
+FS::unshare(dir_entry *entry)
+{
+    TraceSpan span("FS::unshare");
+
+    int prev = -1, b = entry->first_blk;
+    while(b >= 0 && extra_refs[b] == 0){
+        prev = b;
+        b = fat[b];
+    }
+    if(b < 0)
+        return FS_OK;
+    if(!ensure_free(shared_blocks(b)))
+        return FS_ENOSPC;
+
+    std::vector<int> run;
+    int ret_val = alloc_blocks(shared_blocks(b), -1, &run);
+    if(ret_val != FS_OK)
+        return ret_val;
+    extra_refs[b]--;
+    std::vector<std::pair<int, int> > copies;
+    for(size_t i = 0; b >= 0; b = fat[b], i++){
+        int copy = run[i];
+        fat[copy] = FAT_EOF;
+        if(prev == -1)
+            entry->first_blk = copy;
+        else
+            fat[prev] = copy;
+        prev = copy;
+        copies.push_back(std::make_pair(b, copy));
+    }
+    if(copy_blocks(copies) != FS_OK)
+        return FS_EIO;
+    {
+        LatencyTimer flush_timer(latency[LAT_FLUSH]);
+        disk.flush();
+    }
+    return FS_OK;
+}
+
+// Counts the references the entries of the directory in dir_blk and its
+// sub-directories make to blocks, tail blocks included, and collects the
+// orphans. seen keeps a damaged tree from looping.
+int
+FS::count_refs(int dir_blk, std::vector<int> *refs, std::vector<bool> *seen)
+{
+    if((*seen)[dir_blk])
+        return FS_OK;
+    (*seen)[dir_blk] = true;
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        // an orphan's chain is still its own until it is reaped
+        if(blk[i].type == TYPE_ORPHAN){
+            std::pair<int, int> key(dir_blk, i);
+            if(blk[i].first_blk >= 2 && blk[i].first_blk < refs->size()){
+                (*refs)[blk[i].first_blk]++;
+                orphans[key] = blk[i].first_blk;
+            } else
+                reaped.insert(key);
+            continue;
+        }
+        if(!file_is_visible(blk + i) || strcmp(blk[i].file_name, "..") == 0)
+            continue;
+        if((blk[i].access_rights & TAIL) && blk[i].type == TYPE_FILE && i + 1 < DIR_ENTRIES){
+            tail_ref ref;
+            memcpy(&ref, blk[i + 1].file_name, sizeof(ref));
+            if(ref.blk >= 2 && ref.blk < refs->size())
+                (*refs)[ref.blk]++;
+        }
+        if(blk[i].first_blk < 2 || blk[i].first_blk >= refs->size())
+            continue;
+        (*refs)[blk[i].first_blk]++;
+        if(blk[i].type == TYPE_DIR)
+            count_refs(blk[i].first_blk, refs, seen);
+    }
+    return FS_OK;
+}
+
+// Hash of the content of a block for the dedup index, a multiply and
+// xorshift over its 64 bit words. Matches are always compared in full.
+uint64_t
+FS::block_hash(const uint8_t *blk)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for(unsigned i = 0; i < BLOCK_SIZE; i += 8){
+        uint64_t w;
+        memcpy(&w, blk + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// Two blocks can only be shared if they lead to the same block too
+uint64_t
+FS::dedup_key(uint64_t hash, int next)
+{
+    return hash ^ ((uint64_t)(next + 2) * 0xc4ceb9fe1a85ec53ull);
+}
+
+void
+FS::dedup_clear()
+{
+    dedup_index.clear();
+    dedup_keys.assign(disk.get_no_blocks(), 0);
+    dedup_indexed.assign(disk.get_no_blocks(), false);
+}
+
+// Indexes a file block with data as its content, leading to fat[blk]
+void
+FS::dedup_insert(int blk, const uint8_t *data)
+{
+    dedup_remove(blk);
+    uint64_t key = dedup_key(block_hash(data), fat[blk]);
+    dedup_index.insert(std::make_pair(key, blk));
+    dedup_keys[blk] = key;
+    dedup_indexed[blk] = true;
+}
+
+// Drops a block from the index, before it is freed
+void
+FS::dedup_remove(int blk)
+{
+    if(!dedup || !dedup_indexed[blk])
+        return;
+    std::pair<std::unordered_multimap<uint64_t, int>::iterator,
+              std::unordered_multimap<uint64_t, int>::iterator> range = dedup_index.equal_range(dedup_keys[blk]);
+    for(; range.first != range.second; range.first++){
+        if(range.first->second == blk){
+            dedup_index.erase(range.first);
+            break;
+        }
+    }
+    dedup_indexed[blk] = false;
+}
+
+// Returns an indexed block other than not_blk with the content in data
+// that leads to next, or -1. Index entries can be out of date after a block
+// was written to, so every candidate is read and compared.
+int
+FS::dedup_find(const uint8_t *data, int next, int not_blk)
+{
+    TraceSpan span("FS::dedup_find");
+
+    uint8_t buf[BLOCK_SIZE];
+    std::pair<std::unordered_multimap<uint64_t, int>::iterator,
+              std::unordered_multimap<uint64_t, int>::iterator> range;
+    range = dedup_index.equal_range(dedup_key(block_hash(data), next));
+    for(; range.first != range.second; range.first++){
+        int c = range.first->second;
+        if(c == not_blk || fat[c] != next || read_block(c, buf) != 0)
+            continue;
+        if(memcmp(buf, data, BLOCK_SIZE) == 0)
+            return c;
+    }
+    return -1;
+}
+
+// With dedup on, replaces the blocks at the end of entry's chain, which is
+// its own, with the same blocks of another file if there are any. Used
+// after append, whose new blocks are only known once they are written.
+int
+FS::dedup_tail(dir_entry *entry)
+{
+    TraceSpan span("FS::dedup_tail");
+
+    std::vector<int> chain;
+    for(int b = entry->first_blk; b >= 0; b = fat[b])
+        chain.push_back(b);
+    // a chain that goes on past the content ends in blocks kept for it
+    if(chain.size() > (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+        return FS_OK;
+    uint8_t buf[BLOCK_SIZE];
+    int next = FAT_EOF;
+    size_t j = chain.size();
+    for(; j > 0; j--){
+        if(read_block(chain[j - 1], buf) != 0)
+            return FS_EIO;
+        int match = dedup_find(buf, next, chain[j - 1]);
+        if(match == -1)
+            break;
+        next = match;
+    }
+    if(j < chain.size()){
+        if(j == 0)
+            entry->first_blk = next;
+        else
+            fat[chain[j - 1]] = next;
+        extra_refs[next]++;
+        free_chain(chain[j]);
+    }
+    // buf still holds the last block that stays
+    if(j > 0)
+        dedup_insert(chain[j - 1], buf);
+    return FS_OK;
+}
+
+// Lists the directory block and index of every file in the directory in
+// dir_blk and its sub-directories
+int
+FS::dedup_collect(int dir_blk, std::vector<std::pair<int, int> > *files, std::vector<bool> *seen)
+{
+    if((*seen)[dir_blk])
+        return FS_OK;
+    (*seen)[dir_blk] = true;
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(!file_is_visible(blk + i) || strcmp(blk[i].file_name, "..") == 0)
+            continue;
+        if(blk[i].first_blk < 2 || blk[i].first_blk >= seen->size())
+            continue;
+        if(blk[i].type == TYPE_DIR){
+            int ret_val = dedup_collect(blk[i].first_blk, files, seen);
+            if(ret_val != FS_OK)
+                return ret_val;
+        } else
+            files->push_back(std::make_pair(dir_blk, (int)i));
+    }
+    return FS_OK;
+}
+
+// Returns the number of free blocks on the disk, and counts those of every
+// group again on the way
+int
+FS::count_free_blocks()
+{
+    TraceSpan span("FS::count_free_blocks");
+
+    int no_free = 0;
+    std::fill(group_free.begin(), group_free.end(), 0);
+    for(unsigned i = 2; i < disk.get_no_blocks(); i++){
+        if(fat[i] == FAT_FREE){
+            no_free++;
+            group_free[group_of(i)]++;
+        }
+    }
+    return no_free;
+}
+
+// A small number for the calling thread, given out in the order threads
+// first ask for one
+static unsigned
+thread_slot()
+{
+    static std::atomic<unsigned> next_slot(0);
+    thread_local unsigned slot = next_slot++;
+    return slot;
+}
+
+// The group for a new directory: the first with at least the average
+// number of free blocks, going round from the one after the group the last
+// directory went to. Each thread starts as many groups further on as its
+// thread_slot, so the directories of different server sessions spread out.
+int
+FS::pick_dir_group()
+{
+    int no_free = count_free_blocks(), no_groups = group_free.size();
+    int first = dir_group + 1 + thread_slot();
+    for(int n = 0; n < no_groups; n++){
+        int g = (first + n) % no_groups;
+        if(group_free[g] > 0 && group_free[g] * no_groups >= no_free){
+            dir_group = g;
+            return g;
+        }
+    }
+    return goal_group;
+}
+
+// Whether needed blocks are free, reaping every orphan if that is what it takes
+bool
+FS::ensure_free(int needed)
+{
+    if(count_free_blocks() >= needed)
+        return true;
+    if(orphans.empty())
+        return false;
+    reap_all();
+    return count_free_blocks() >= needed;
+}
+
+// Frees the chain of an orphan in fat and gives its blocks back to the
+// disk. Its entry is cleared by the next write_fat.
+void
+FS::reap(std::map<std::pair<int, int>, int>::iterator orphan)
+{
+    TraceSpan span("FS::reap");
+
+    std::vector<int> freed;
+    free_chain(orphan->second, &freed);
+    reaped.insert(orphan->first);
+    orphans.erase(orphan);
+    discard_blocks(&freed);
+}
+
+void
+FS::reap_all()
+{
+    while(!orphans.empty())
+        reap(orphans.begin());
+}
+
+// Reaps the orphans of the directory in dir_blk before the block is freed,
+// their entries go with it
+void
+FS::reap_dir(int dir_blk)
+{
+    std::pair<int, int> first(dir_blk, 0), last(dir_blk + 1, 0);
+    while(orphans.lower_bound(first) != orphans.lower_bound(last))
+        reap(orphans.lower_bound(first));
+    reaped.erase(reaped.lower_bound(first), reaped.lower_bound(last));
+}
+
+// Discards blocks, a run of them in a row at a time. They are free, so
+// the data in them does not matter if it fails.
+void
+FS::discard_blocks(std::vector<int> *blocks)
+{
+    if(in_batch){
+        staged_discards.insert(staged_discards.end(), blocks->begin(), blocks->end());
+        return;
+    }
+    std::sort(blocks->begin(), blocks->end());
+    for(size_t i = 0; i < blocks->size(); ){
+        size_t n = 1;
+        while(i + n < blocks->size() && (*blocks)[i + n] == (*blocks)[i] + (int)n)
+            n++;
+        disk.discard((*blocks)[i], n);
+        i += n;
+    }
+}
+
+// Adds the files of the directory in dir_blk and its sub-directories to map
+int
+FS::defrag_scan(int dir_blk, defrag_map *map)
+{
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(dir_blk, (uint8_t*)blk) != 0)
+        return FS_EIO;
+    unsigned no_blocks = disk.get_no_blocks();
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(!file_is_visible(blk + i) || strcmp(blk[i].file_name, "..") == 0)
+            continue;
+        int first = blk[i].first_blk;
+        if((unsigned)first >= no_blocks || first == ROOT_BLOCK)
+            continue;
+        if(blk[i].type == TYPE_DIR){
+            map->fixed[first] = true;
+            int ret_val = defrag_scan(first, map);
+            if(ret_val != FS_OK)
+                return ret_val;
+            continue;
+        }
+        // blocks shared with another file have more than one block or entry
+        // pointing at them, such files stay where they are
+        if(shared_blocks(first) > 0){
+            for(int b = first; b >= 0; b = fat[b])
+                map->fixed[b] = true;
+            continue;
+        }
+        map->head_dir[first] = dir_blk;
+        map->head_index[first] = i;
+        // bounded in case the chain is damaged
+        unsigned steps = 0;
+        for(int b = first; fat[b] >= 0 && (unsigned)fat[b] < no_blocks && steps < no_blocks; b = fat[b], steps++)
+            map->prev[fat[b]] = b;
+    }
+    return FS_OK;
+}
+
+int
+FS::build_defrag_map(defrag_map *map)
+{
+    unsigned no_blocks = disk.get_no_blocks();
+    map->prev.assign(no_blocks, -1);
+    map->head_dir.assign(no_blocks, -1);
+    map->head_index.assign(no_blocks, -1);
+    map->fixed.assign(no_blocks, false);
+    map->fixed[ROOT_BLOCK] = true;
+    map->fixed[FAT_BLOCK] = true;
+    int ret_val = defrag_scan(ROOT_BLOCK, map);
+    if(ret_val != FS_OK)
+        return ret_val;
+    // blocks in use that no file reaches are left alone
+    for(unsigned b = 2; b < no_blocks; b++){
+        if(fat[b] != FAT_FREE && map->prev[b] == -1 && map->head_dir[b] == -1)
+            map->fixed[b] = true;
+    }
+    return FS_OK;
+}
+
+// Lays out the next file at progress->cursor. Files that already start
+// there and are contiguous are skipped, otherwise the file owning the lowest
+// block at or after the cursor is moved there, evicting whatever is in the
+// way to the free blocks at the end of the disk. A file that does not fit
+// before the next directory block makes room for the first one further on
+// that does, or the blocks before the directory are cleared.
+int
+FS::defrag_next(defrag_map *map, defrag_progress *progress)
+{
+    unsigned no_blocks = disk.get_no_blocks();
+    unsigned t = progress->cursor < 2 ? 2 : progress->cursor;
+    for(;;){
+        while(t < no_blocks && map->fixed[t])
+            t++;
+        if(t >= no_blocks || map->head_dir[t] == -1)
+            break;
+        unsigned b = t;
+        while(fat[b] == (int)b + 1)
+            b++;
+        if(fat[b] != FAT_EOF)
+            break;
+        t = b + 1;
+    }
+    progress->cursor = t;
+
+    unsigned used = t;
+    while(used < no_blocks && (fat[used] == FAT_FREE || map->fixed[used]))
+        used++;
+    if(used >= no_blocks){
+        progress->done = true;
+        return FS_OK;
+    }
+    int head = used;
+    for(unsigned steps = 0; map->prev[head] != -1 && steps < no_blocks; steps++)
+        head = map->prev[head];
+
+    unsigned n = 1;
+    for(int b = head; fat[b] >= 0 && n <= no_blocks; b = fat[b])
+        n++;
+    unsigned room = 0;
+    while(t + room < no_blocks && room < n && !map->fixed[t + room])
+        room++;
+    if(room < n && t + room < no_blocks){
+        // a directory is in the way, look for a file that fits before it
+        head = -1;
+        for(unsigned h = t; h < no_blocks && head == -1; h++){
+            if(map->head_dir[h] == -1)
+                continue;
+            n = 1;
+            for(int b = h; fat[b] >= 0 && n <= room; b = fat[b])
+                n++;
+            if(n <= room)
+                head = h;
+        }
+        if(head == -1){
+            int ret_val = defrag_evict(map, t, t + room, NULL);
+            if(ret_val == FS_OK)
+                progress->cursor = t + room + 1;
+            return ret_val;
+        }
+    } else if(room < n){
+        progress->done = true;
+        return FS_OK;
+    }
+
+    int ret_val = defrag_place(map, head, t);
+    if(ret_val != FS_OK)
+        return ret_val;
+    progress->cursor = t + n;
+    progress->files_moved++;
+    progress->blocks_moved += n;
+    return FS_OK;
+}
+
+// Moves the file starting at head to the blocks from start on, which hold
+// no directories
+int
+FS::defrag_place(defrag_map *map, int head, unsigned start)
+{
+    unsigned n = 1;
+    for(int b = head; fat[b] >= 0; b = fat[b])
+        n++;
+
+    // first everything in the way, including blocks of this file that are
+    // in the wrong place in the run
+    std::vector<std::pair<int, int> > moves;
+    unsigned k = 0;
+    bool in_place = true;
+    for(int b = head; b >= 0; b = fat[b], k++){
+        if((unsigned)b != start + k)
+            in_place = false;
+    }
+    if(in_place)
+        return FS_OK;
+    int ret_val = defrag_evict(map, start, start + n, &head);
+    if(ret_val != FS_OK)
+        return ret_val;
+
+    k = 0;
+    for(int b = head; b >= 0; b = fat[b], k++){
+        if((unsigned)b != start + k)
+            moves.push_back(std::make_pair(b, (int)(start + k)));
+    }
+    return move_blocks(moves, map);
+}
+
+// Moves the blocks in lo up to hi to the highest free blocks outside it,
+// except those of the file at *head that are already where defrag_place
+// wants them. *head follows its first block if that moves.
+int
+FS::defrag_evict(defrag_map *map, unsigned lo, unsigned hi, int *head)
+{
+    std::vector<bool> keep(hi - lo, false);
+    if(head){
+        unsigned k = 0;
+        for(int b = *head; b >= 0; b = fat[b], k++){
+            if((unsigned)b == lo + k)
+                keep[k] = true;
+        }
+    }
+
+    std::vector<std::pair<int, int> > moves;
+    int free_blk = disk.get_no_blocks();
+    for(unsigned b = lo; b < hi; b++){
+        if(fat[b] == FAT_FREE || keep[b - lo])
+            continue;
+        do
+            free_blk--;
+        while(free_blk >= 2 && (fat[free_blk] != FAT_FREE || ((unsigned)free_blk >= lo && (unsigned)free_blk < hi)));
+        if(free_blk < 2)
+            return FS_ENOSPC;
+        moves.push_back(std::make_pair((int)b, free_blk));
+        if(head && (int)b == *head)
+            *head = free_blk;
+    }
+    return move_blocks(moves, map);
+}
+
+// Moves the blocks in moves, each from first to second, which is free.
+// The data goes first, then the FAT with the new blocks chained in while
+// the old ones still look used, then the directory entries of files whose
+// first block moved, and last the FAT with the old blocks freed. A crash
+// anywhere in between leaves every file readable.
+int
+FS::move_blocks(const std::vector<std::pair<int, int> >& moves, defrag_map *map)
+{
+    TraceSpan span("FS::move_blocks");
+
+    if(moves.empty())
+        return FS_OK;
+    if(copy_blocks(moves) != FS_OK)
+        return FS_EIO;
+    std::map<int, int> moved_to;
+    for(size_t i = 0; i < moves.size(); i++)
+        moved_to[moves[i].first] = moves[i].second;
+    {
+        LatencyTimer flush_timer(latency[LAT_FLUSH]);
+        disk.flush();
+    }
+
+    std::map<int, int>::iterator it;
+    std::map<int, std::vector<int> > heads;     // directory block -> moved first blocks
+    for(size_t i = 0; i < moves.size(); i++){
+        int from = moves[i].first, to = moves[i].second;
+        int next = fat[from];
+        if(next >= 0 && (it = moved_to.find(next)) != moved_to.end())
+            next = it->second;
+        fat[to] = next;
+        int prev = map->prev[from];
+        if(prev == -1)
+            heads[map->head_dir[from]].push_back(from);
+        else if(moved_to.find(prev) == moved_to.end())
+            fat[prev] = to;
+    }
+    if(write_fat() != FS_OK)
+        return FS_EIO;
+
+    dir_entry blk[DIR_ENTRIES];
+    std::map<int, std::vector<int> >::iterator dir;
+    for(dir = heads.begin(); dir != heads.end(); dir++){
+        if(read_block(dir->first, (uint8_t*)blk) != 0)
+            return FS_EIO;
+        for(size_t i = 0; i < dir->second.size(); i++){
+            int from = dir->second[i];
+            blk[map->head_index[from]].first_blk = moved_to[from];
+        }
+        if(write_block(dir->first, (uint8_t*)blk) != 0)
+            return FS_EIO;
+    }
+    if(!heads.empty()){
+        LatencyTimer flush_timer(latency[LAT_FLUSH]);
+        disk.flush();
+    }
+
+    // the old blocks are free now, and the map follows the moves
+    for(size_t i = 0; i < moves.size(); i++){
+        int from = moves[i].first, to = moves[i].second;
+        fat[from] = FAT_FREE;
+        dedup_remove(from);
+        int prev = map->prev[from];
+        if(prev != -1 && (it = moved_to.find(prev)) != moved_to.end())
+            prev = it->second;
+        map->prev[to] = prev;
+        map->head_dir[to] = map->head_dir[from];
+        map->head_index[to] = map->head_index[from];
+        if(fat[to] >= 0)
+            map->prev[fat[to]] = to;
+        map->prev[from] = -1;
+        map->head_dir[from] = -1;
+        map->head_index[from] = -1;
+    }
+    count_free_blocks();
+    return write_fat();
+}
+
+// Returns the index of a file in a directory block
+// if the file does not exist then it returns -1
+int
+FS::file_exists(uint16_t directory_block, std::string filename)
+{
+    TraceSpan span("FS::file_exists");
+
+    if(filename.empty())
+        return -1;
+
+    // If it is an absolute path
+    if(filename.at(0) == '/'){
+        filename = filename.erase(0, 1);
+        return file_exists(ROOT_BLOCK, filename);
+    }
+
+    dir_entry blk[DIR_ENTRIES];
+    if(read_block(directory_block, (uint8_t*)blk) != 0)
+        return -1;
+    return find_in_dir(blk, filename);
+}
+
+// Returns the index of a file in an already loaded directory block
+// if the file does not exist then it returns -1
+int
+FS::find_in_dir(dir_entry *entries, std::string filename)
+{
+    TraceSpan span("FS::find_in_dir");
+
+    if(filename.empty())
+        return -1;
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(file_is_visible(entries + i) && filename == entries[i].file_name)
+            return i;
+    }
+    return -1;
+}
+
+// Returns an empty ID for a directory entry in a list of directory entries
+int
+FS::find_empty_dir_entry_id(dir_entry* entries)
+{
+    TraceSpan span("FS::find_empty_dir_entry_id");
+
+    for(unsigned i = 0; i < DIR_ENTRIES; i++){
+        if(!file_is_visible(entries + i) && entries[i].type != TYPE_EXT && entries[i].type != TYPE_ORPHAN)
+            return i;
+    }
+    return -1;
+}
+
+// Returns the block number of the first free block on the disk
+int
+FS::find_empty_block_id()
+{
+    LatencyTimer timer(latency[LAT_ALLOC]);
+    TraceSpan span("FS::find_empty_block_id");
+
+    // goal_group and the groups after it first, then the whole disk in
+    // case group_free is behind
+    int no_blocks = disk.get_no_blocks(), no_groups = group_free.size();
+    for(int n = 0; n < no_groups; n++){
+        int g = (goal_group + n) % no_groups;
+        for(int b = std::max(2, g * ALLOC_GROUP_BLOCKS); group_free[g] > 0 && b < std::min(no_blocks, (g + 1) * ALLOC_GROUP_BLOCKS); b++){
+            if(fat[b] == FAT_FREE && !reserved[b]){
+                group_free[g]--;
+                return b;
+            }
+        }
+    }
+    for(int b = 2; b < no_blocks; b++){
+        if(fat[b] == FAT_FREE && !reserved[b]){
+            group_free[group_of(b)]--;
+            return b;
+        }
+    }
+    // reserved blocks, and then the blocks of removed files, are there to be had
+    if(!reservations.empty()){
+        drop_reservations();
+        return find_empty_block_id();
+    }
+    if(!orphans.empty()){
+        reap_all();
+        return find_empty_block_id();
+    }
+    return -1;
+}
+
+// Returns the current directory block
+int
+FS::current_directory_block()
+{
+    return blk_curr_dir;
+}
+
+// Sets the current directory block, used to restore a saved working directory
+void
+FS::set_current_directory_block(int blk)
+{
+    blk_curr_dir = blk;
+}
+
+// Returns whether or not a file or directory is visible
 // A file is considered visible if its size is greater than 0,
 // and a directory is considered visible if its size is not 0
 bool
@@ -941,13 +3059,17 @@ FS::file_is_visible(dir_entry* file)
 }
 
 // Returns the final block in a path that only contains directories
+// or -1 if some part of the path does not exist or is not a directory
 int
 FS::find_final_block(int c_blk, std::string path)
 {
+    LatencyTimer timer(latency[LAT_FIND_FINAL_BLOCK]);
+    TraceSpan span("FS::find_final_block");
+
     // If the path is empty, just return the current block
     if(path.empty())
         return c_blk;
-    
+
     // If path is just root, return root, easy.
     if(path == "/"){
         return ROOT_BLOCK;
@@ -961,40 +3083,33 @@ FS::find_final_block(int c_blk, std::string path)
 
     std::string buf;        // Buffer for the current directory name to look for
                             // e.g given a path "abc/dir/123", this would first have value abc, then dir, then 123
+    dir_entry curr_dir_entries[DIR_ENTRIES];
     while(!path.empty()){
 
-        int slash_id = path.find("/");
+        size_t slash_id = path.find("/");
 
         // If there's a slash, buf will be everything up until slash, excluding the slash
-        if(slash_id != -1){
+        if(slash_id != std::string::npos){
             buf = path.substr(0, slash_id);
             path.erase(0, slash_id + 1);
-        } 
+        }
         // Else buf is just what's left
         else {
             buf = path;
             path.erase(0, path.length());
         }
+        if(buf.empty())
+            continue; // "a//b" and a trailing "/" mean the same as "a/b"
 
         // Read the current block to look at
-        dir_entry curr_dir_entries[BLOCK_SIZE];
-        disk.read(c_blk, (uint8_t*)curr_dir_entries);
+        if(read_block(c_blk, (uint8_t*)curr_dir_entries) != 0)
+            return -1;
 
-        // Look at each entry and find the directory with the same name as in buf and update current block
-        bool found_next_file = false;
-        for(int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++){
-            if(!file_is_visible(curr_dir_entries + i))
-                continue;
-            if(buf == curr_dir_entries[i].file_name){
-                if(curr_dir_entries[i].type == TYPE_DIR)
-                    c_blk = curr_dir_entries[i].first_blk;
-                found_next_file = true;
-                break;
-            }
-        }
-        if(!found_next_file){
+        // Find the directory with the same name as in buf and update current block
+        int i = find_in_dir(curr_dir_entries, buf);
+        if(i == -1 || curr_dir_entries[i].type != TYPE_DIR)
             return -1;
-        }
+        c_blk = curr_dir_entries[i].first_blk;
     }
     return c_blk;
 }
@@ -1004,11 +3119,11 @@ FS::find_final_block(int c_blk, std::string path)
 int
 FS::chop_file_name(std::string* filepath)
 {
-    int last_slash_id = filepath->rfind('/');
+    size_t last_slash_id = filepath->rfind('/');
 
-    if(last_slash_id != -1) {
+    if(last_slash_id != std::string::npos) {
         filepath->erase(last_slash_id, filepath->length()); // Remove everything from slash and onwards
-        
+
         // If the filepath is empty after chop, it means our path was an absolute path to root, e.g /dir, /file, etc
         if(filepath->empty())
             filepath->insert(0, "/");
@@ -1024,11 +3139,11 @@ FS::chop_file_name(std::string* filepath)
 int
 FS::get_file_name_from_path(std::string filepath, std::string *filename)
 {
-    int last_slash_id = filepath.rfind('/');
+    size_t last_slash_id = filepath.rfind('/');
 
-    if(last_slash_id != -1)
+    if(last_slash_id != std::string::npos)
         filepath.erase(0, last_slash_id+1);
-    
+
     filename->append(filepath);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,14 @@
 #include <iostream>
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "disk.h"
+#include "fatfs.h"
+#include "latency.h"
 
 #ifndef __FS_H__
 #define __FS_H__
@@ -10,41 +18,259 @@
 #define FAT_FREE 0
 #define FAT_EOF -1
 
-#define TYPE_FILE 0
-#define TYPE_DIR 1
-#define READ 0x04
-#define WRITE 0x02
-#define EXECUTE 0x01
-
-struct dir_entry {
-    char file_name[56]; // name of the file / sub-directory
-    uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
-    uint8_t type; // directory (1) or file (0)
-    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+// number of dir_entries in one directory block
+#define DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry))
+
+// Compressed files are cut into chunks of this many bytes that are
+// compressed on their own, so a part of the file can be read without
+// decompressing what comes before it
+#define COMPRESS_CHUNK (4 * BLOCK_SIZE)
+
+// Small files are stored in their directory: the content fills the
+// file_names of the TYPE_EXT entries that follow the file's own entry.
+// Other files keep the end of their content that does not fill a block,
+// if it is at most TAIL_MAX bytes, in a tail block packed with the ends of
+// other files. The TYPE_EXT entry after the file's own then holds a
+// tail_ref. A file whose content is only a tail has no chain, and like an
+// inline file has ROOT_BLOCK as its first_blk.
+#define EXT_BYTES 56
+#define INLINE_MAX_EXT 3
+#define INLINE_MAX (INLINE_MAX_EXT * EXT_BYTES)
+#define TAIL_MAX (BLOCK_SIZE / 2)
+
+// The readahead window a sequential file read starts with, in blocks. It
+// doubles on every block read in order, up to the disk's readahead_blocks.
+#define READAHEAD_MIN 4
+
+// With write back, a file that grows by append keeps the blocks after its
+// end reserved for its next append, RESERVE_MIN of them at first and twice
+// as many each time it uses them, up to RESERVE_MAX. At most RESERVE_FILES
+// files have a reservation at a time.
+#define RESERVE_MIN 4
+#define RESERVE_MAX 64
+#define RESERVE_FILES 16
+
+// The block space is cut into allocation groups of ALLOC_GROUP_BLOCKS
+// blocks. A new directory goes to a group with more free blocks than most,
+// and the files in it get their blocks from the same group while it has
+// room, see alloc_blocks.
+#define ALLOC_GROUP_BLOCKS 256
+
+struct tail_ref {
+    uint16_t blk;
+    uint16_t offset;    // the tail is the last size % BLOCK_SIZE bytes of the file
 };
 
+#define BATCH_CREATE 0
+#define BATCH_RM 1
+#define BATCH_MV 2
+#define BATCH_CHMOD 3
+#define BATCH_MKDIR 4
+
+// One operation in a batch, see FS::batch
+struct batch_op {
+    int type;           // BATCH_CREATE, BATCH_RM, ...
+    std::string arg1;   // filepath, or sourcepath for mv, or accessrights for chmod
+    std::string arg2;   // data for create, destpath for mv, filepath for chmod
+};
+
+// Disk I/O next to the file data the user asked for, the ratio of the two
+// is the I/O amplification
+struct io_stats {
+    disk_stats disk;
+    uint64_t logical_read;      // bytes of file content handed to the user (cat, cp, append)
+    uint64_t logical_written;   // bytes of file content the user stored (create, cp, append)
+};
+
+// How far defragmentation has got, see FS::defrag_step. Zero it to start
+// at the beginning of the disk.
+struct defrag_progress {
+    unsigned cursor;            // the blocks below it are laid out
+    uint64_t files_moved;
+    uint64_t blocks_moved;
+    uint64_t io;                // disk reads and writes spent on it
+    bool done;
+};
+
+// Every block as the defragmenter sees it, rebuilt from the directories
+struct defrag_map {
+    std::vector<int> prev;          // block before this one in its chain, or -1
+    std::vector<int> head_dir;      // directory block of the entry starting here, or -1
+    std::vector<int> head_index;    // index of that entry in its directory
+    std::vector<bool> fixed;        // root, FAT, directories and blocks no file reaches
+};
+
+// What FS::dedup_scan did
+struct dedup_result {
+    uint64_t files;
+    uint64_t blocks;            // in the chains of all files
+    uint64_t freed;             // blocks freed by sharing them
+    uint64_t io;                // disk reads and writes spent on it
+};
+
+// The file system. Every operation returns FS_OK or one of the FS_E* codes
+// from fatfs.h and never prints anything, data comes back through pointers.
 class FS {
 private:
     Disk disk;
     // size of a FAT entry is 2 bytes
     int16_t fat[BLOCK_SIZE/2];
+    // block of the current (working) directory
+    int blk_curr_dir;
+    // References to every block beyond the first. cp shares the source's
+    // chain with the copy, so a block is pointed at by the FAT entries and
+    // first_blks of more than one file until one of them is written to.
+    // Derived from the directories at mount, it is not stored on disk.
+    std::vector<uint32_t> extra_refs;
+
+    // Deduplication, see set_dedup. The index finds file blocks by the
+    // dedup_key of their content and the block they lead to. dedup_keys
+    // keeps the key of every indexed block so it can be dropped when the
+    // block is freed.
+    bool dedup;
+    std::unordered_multimap<uint64_t, int> dedup_index;
+    std::vector<uint64_t> dedup_keys;
+    std::vector<bool> dedup_indexed;
+
+    // new files get the COMPRESS attribute, see set_compression
+    bool compress_new;
+
+    // Tails are added to tail_blk from tail_fill on until it is full. A tail
+    // block holds a reference for every tail in it in extra_refs, and is
+    // freed with the last of them. Where the tail block was filled up to is
+    // not kept on disk, a new one is started after a mount.
+    int tail_blk;
+    uint32_t tail_fill;
+
+    // rm leaves a file with a chain behind as a TYPE_ORPHAN entry that
+    // still has its first_blk, and its blocks are freed later by
+    // reclaim_step, or at once when they are needed. orphans maps the
+    // directory block and index of each such entry to its chain. Once
+    // reaped, the chain is free in fat but the entry is still on disk, and
+    // is in reaped until write_fat clears it, before the FAT goes out so
+    // the disk never has an entry holding blocks its FAT says are free.
+    std::map<std::pair<int, int>, int> orphans;
+    std::set<std::pair<int, int> > reaped;
+
+    // Delayed allocation, on with write back. The blocks a file will append
+    // next are set aside in memory as it grows, so it stays in one run
+    // while other files are written in between, see grow_chain. A
+    // reservation is keyed by the last block of the chain it follows and
+    // holds the first block and the number of blocks set aside. Other
+    // allocations go around reserved blocks for as long as there are
+    // others, sync drops them all. Nothing of it is on disk.
+    bool delalloc;
+    std::map<int, std::pair<int, int> > reservations;
+    std::vector<bool> reserved;
+
+    // Allocation groups. group_free is the number of free blocks in each,
+    // counted again by count_free_blocks, which whatever allocates much
+    // calls first, and kept up to date by the allocators and free_chain in
+    // between. It only steers the search, a group it has wrong is found in
+    // the pass over the whole disk after it. goal_group is the group of the
+    // directory the running operation stores into, dir_group the group the
+    // last new directory went to.
+    std::vector<int> group_free;
+    int goal_group;
+    int dir_group;
+
+    // While a batch is running every block write is staged here instead of
+    // going to the disk, and reads see the staged version first
+    bool in_batch;
+    std::map<unsigned, std::vector<uint8_t> > staged_blocks;
+    // blocks the batch freed, discarded only once it is on disk since a
+    // rollback hands them back to their files
+    std::vector<int> staged_discards;
+
+    // Readahead on file reads, see read_chain_block
+    int ra_last;                // the file block read last, -1 if none
+    unsigned ra_window;         // blocks to read ahead of it
+    unsigned ra_left;           // blocks read ahead of it that it has not reached
+
+    uint64_t logical_read;
+    uint64_t logical_written;
+
+    // time spent in every entry point and internal phase, see latency.h
+    LatencyHistogram latency[LAT_COUNT];
+
+    int read_block(unsigned block_no, uint8_t *blk);
+    int read_chain_block(int block, uint8_t *blk);
+    int write_block(unsigned block_no, uint8_t *blk);
+    int write_fat();
+    int copy_blocks(const std::vector<std::pair<int, int> >& copies);
+
+    int find_entry(std::string filepath, int *dir_blk, int *index, dir_entry *entries);
+    int read_file(const dir_entry *entry, std::string *data);
+    int write_chain(const char *data, uint32_t len, int *first_blk);
+    int store_file(dir_entry *entries, int index, const char *data, uint32_t len);
+    void release_file(dir_entry *entry);
+    int rewrite_file(dir_entry *entries, int index, const char *data, uint32_t len);
+    int pack_tail(const char *data, uint32_t len, tail_ref *ref);
+    int unpack_tail(dir_entry *entry);
+    static unsigned ext_entries(const dir_entry *entry);
+    static unsigned ext_wanted(uint32_t len);
+    int find_free_run(dir_entry *entries, unsigned count);
+    int claim_dir_entry(int dir_blk, dir_entry *entries, bool *fat_changed);
+    int compress_tail(std::vector<uint32_t> *ends, uint32_t base, const char *data, uint32_t len,
+                      std::string *tail);
+    int read_index(const dir_entry *entry, std::vector<int> *chain, std::vector<uint32_t> *ends, uint8_t *buf);
+    int read_compressed(const dir_entry *entry, uint32_t pos, uint32_t len, std::string *data);
+    int append_compressed(dir_entry *entry, const std::string& data);
+    int write_at(int first_blk, uint32_t pos, const char *data, uint32_t len);
+    int alloc_blocks(int count, int hint, std::vector<int> *blocks);
+    int grow_chain(int last, int count, std::vector<int> *blocks);
+    void drop_reservation(std::map<int, std::pair<int, int> >::iterator res);
+    void drop_reservations();
+    int chain_length(int first_blk);
+    int group_of(int blk) { return blk / ALLOC_GROUP_BLOCKS; }
+    int pick_dir_group();
+    void free_chain(int first_blk, std::vector<int> *freed = NULL);
+    int shared_blocks(int first_blk);
+    int unshare(dir_entry *entry);
+    int count_refs(int dir_blk, std::vector<int> *refs, std::vector<bool> *seen);
+    void fill_block(const char *data, uint32_t len, int i, uint8_t *blk);
+    static uint64_t block_hash(const uint8_t *blk);
+    static uint64_t dedup_key(uint64_t hash, int next);
+    void dedup_clear();
+    void dedup_insert(int blk, const uint8_t *data);
+    void dedup_remove(int blk);
+    int dedup_find(const uint8_t *data, int next, int not_blk);
+    int dedup_tail(dir_entry *entry);
+    int dedup_collect(int dir_blk, std::vector<std::pair<int, int> > *files, std::vector<bool> *seen);
+    int walk_dir(int dir_blk, const std::string& path,
+                 std::function<void(const std::string& path, const dir_entry& entry)>& visit);
+    int count_free_blocks();
+    bool ensure_free(int needed);
+    void reap(std::map<std::pair<int, int>, int>::iterator orphan);
+    void reap_all();
+    void reap_dir(int dir_blk);
+    void discard_blocks(std::vector<int> *blocks);
+    int defrag_scan(int dir_blk, defrag_map *map);
+    int build_defrag_map(defrag_map *map);
+    int defrag_next(defrag_map *map, defrag_progress *progress);
+    int defrag_place(defrag_map *map, int head, unsigned start);
+    int defrag_evict(defrag_map *map, unsigned lo, unsigned hi, int *head);
+    int move_blocks(const std::vector<std::pair<int, int> >& moves, defrag_map *map);
 
 public:
-    FS();
+    FS(const std::string& diskname = DISKNAME, const disk_config& config = disk_config());
     ~FS();
+    // whether the disk could be opened, nothing else works if it is not
+    bool mounted() { return disk.is_open(); }
     // formats the disk, i.e., creates an empty file system
     int format();
-    // create <filepath> creates a new file on the disk, the data content is
-    // written on the following rows (ended with an empty row)
-    int create(std::string filepath);
-    // cat <filepath> reads the content of a file and prints it on the screen
-    int cat(std::string filepath);
+    // create <filepath> creates a new file on the disk with the data content
+    int create(std::string filepath, std::string data);
+    // cat <filepath> reads the content of a file into data
+    int cat(std::string filepath, std::string *data);
     // ls lists the content in the currect directory (files and sub-directories)
-    int ls();
+    int ls(std::vector<dir_entry> *entries);
+    // stat <path> fetches the dir_entry of a file or directory
+    int stat(std::string path, dir_entry *entry);
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
-    // <sourcepath> to a new file <destpath>
+    // <sourcepath> to a new file <destpath>. The copy shares the blocks of
+    // the source until either of them is written to.
     int cp(std::string sourcepath, std::string destpath);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
@@ -60,21 +286,97 @@ public:
     int mkdir(std::string dirpath);
     // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
     int cd(std::string dirpath);
-    // pwd prints the full path, i.e., from the root directory, to the current
+    // pwd gets the full path, i.e., from the root directory, to the current
     // directory, including the currect directory name
-    int pwd();
+    int pwd(std::string *path);
 
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+    int chmod(int accessrights, std::string filepath);
+
+    // fallocate <filepath> <size> preallocates blocks for the file to grow
+    // to size bytes, in one run after its last block if there is room. The
+    // blocks are part of its chain past the end of its content until
+    // append fills them. A size below what the file has preallocated gives
+    // back the blocks it does not need, never any of its content.
+    int fallocate(std::string filepath, uint32_t size);
+
+    // compress <filepath> sets (on) or clears the COMPRESS attribute of a
+    // file and rewrites it to match. A file with COMPRESS is stored
+    // compressed if that takes fewer blocks, which sets COMPRESSED, and
+    // stays compressed when appended to. Its size is the size of the content.
+    int compress(std::string filepath, bool on);
+    // with compression on, files are created with the COMPRESS attribute
+    void set_compression(bool on) { compress_new = on; }
+    bool get_compression() { return compress_new; }
+
+    // batch runs a list of create/rm/mv/chmod/mkdir operations as one unit.
+    // All operations are validated and applied in memory first, then every
+    // touched block (directories, data and the FAT) is written once. If any
+    // operation fails nothing is written and the FS is left as it was, and
+    // failed_op (if given) is set to the index of the failing operation.
+    int batch(const std::vector<batch_op>& ops, unsigned *failed_op = NULL);
+
+    // defrag moves the blocks of every file into one contiguous run, in the
+    // order the files lie on the disk, which leaves the free space in one
+    // run at the end. Directory blocks stay where they are. The disk is
+    // consistent after every block write, a crash at worst leaks the blocks
+    // being moved.
+    int defrag(defrag_progress *progress);
+    // one step of defrag that lays out the next file, with a fresh look at
+    // the directories so any other operation may run between two steps.
+    // progress->done is set once there is nothing left to do.
+    int defrag_step(defrag_progress *progress);
+
+    // reclaim_step frees the blocks of one file rm left to be freed later,
+    // see orphans. *done is set once there are none left. They are freed
+    // at mount too, and whenever an operation runs out of blocks.
+    int reclaim_step(bool *done);
+    unsigned pending_orphans() { return orphans.size(); }
+    // the blocks of those files, still taken in the FAT until they are freed
+    unsigned orphan_blocks();
+
+    // With dedup on, create and append share blocks that some file already
+    // has instead of writing them again, as cp always does. A block leads
+    // to the same next block for every file sharing it, so what is shared
+    // is a run of blocks at the end of a file that ends the same way in
+    // another: whole copies, and files with a common tail.
+    int set_dedup(bool on);
+    bool get_dedup() { return dedup; }
+    // dedup_scan shares what the files on the disk already have in common,
+    // hashing their blocks with no_threads threads
+    int dedup_scan(unsigned no_threads, dedup_result *result);
+
+    // sync writes out everything the disk holds back with write back, see
+    // disk_config. fsync <filepath> writes out the file's blocks, its
+    // directory block and the FAT, so the file as it is now is on the disk.
+    int sync();
+    int fsync(std::string filepath);
+
+    // disk I/O and logical bytes since the FS was mounted or last reset
+    void get_io_stats(io_stats *stats);
+    void reset_io_stats();
+    // walk calls visit for every file and directory on the disk, depth first
+    // from the root, with its full path. ".." entries are skipped.
+    int walk(std::function<void(const std::string& path, const dir_entry& entry)> visit);
+    // the FAT as it is in memory, get_no_blocks() entries
+    const int16_t *get_fat() { return fat; }
+    unsigned get_no_blocks() { return disk.get_no_blocks(); }
+
+    // the LAT_COUNT latency histograms, indexed by latency_op
+    const LatencyHistogram *get_latencies() { return latency; }
+    void reset_latency();
 
 
 
     // Our own functions
     int file_exists(uint16_t directory_block, std::string filename);
+    int find_in_dir(dir_entry *entries, std::string filename);
     int find_empty_dir_entry_id(dir_entry* entries);
     int find_empty_block_id();
     int current_directory_block();
+    void set_current_directory_block(int blk);
 
     bool file_is_visible(dir_entry *file);
     int find_final_block(int c_blk, std::string path);
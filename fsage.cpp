@@ -0,0 +1,253 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "fs.h"
+#include "frag.h"
+
+// Filesystem aging. A freshly formatted disk gives every file contiguous
+// blocks until the first rm, which makes benchmarks look better than a disk
+// that has been in use for months. fsage runs create/append/rm/cp churn on
+// an image, with many files growing a block at a time in turn, until it is
+// as full and as fragmented as asked, and leaves the image behind as a
+// fixture for later runs (filesystem -i, bench, fsgen).
+//
+// fsage [-i image] [-u utilization] [-F score] [-S seed] [-n max_ops]
+//       [-s mean_size] [-f fanout] [-c blocks]
+//   -i  image to age, it is formatted first (default aged.bin)
+//   -u  target share of data blocks in use, 0 to 1 (default 0.7)
+//   -F  target fragmentation score, 0 to 1, see frag.h (default 0.3)
+//   -S  seed, the same seed and targets give the same image (default 1)
+//   -n  give up after this many operations (default 1000000)
+//   -s  mean file size in bytes, sizes are exponential (default 8192)
+//   -f  number of directories the files are spread over (default 16)
+
+// what grow appends, a block of data
+#define PIECE "/piece"
+
+struct aged_file {
+    std::string path;
+    unsigned dir;
+    uint64_t size;
+};
+
+struct ager {
+    FS& fs;
+    std::mt19937_64 rng;
+    double mean_size;
+    std::vector<aged_file> files;
+    std::vector<std::string> dirs;
+    std::vector<unsigned> dir_entries;
+    unsigned long counter;
+
+    ager(FS& fs, uint64_t seed, double mean_size)
+        : fs(fs), rng(seed), mean_size(mean_size), counter(0) {}
+
+    double uniform() { return std::uniform_real_distribution<double>(0, 1)(rng); }
+    size_t pick(size_t n) { return std::uniform_int_distribution<size_t>(0, n - 1)(rng); }
+
+    uint64_t sample_size() {
+        double size = std::exponential_distribution<double>(1.0 / mean_size)(rng);
+        return size > 32 * mean_size ? (uint64_t)(32 * mean_size) : (uint64_t)size;
+    }
+
+    // Index of a directory with room for one more file, or -1
+    int roomy_dir() {
+        size_t start = pick(dirs.size());
+        for(size_t i = 0; i < dirs.size(); i++){
+            size_t d = (start + i) % dirs.size();
+            if(dir_entries[d] < DIR_ENTRIES - 2)
+                return d;
+        }
+        return -1;
+    }
+
+    int create() {
+        int dir = roomy_dir();
+        if(dir == -1)
+            return FS_EDIRFULL;
+        aged_file f = { dirs[dir] + "/f" + std::to_string(counter++), (unsigned)dir, sample_size() };
+        int ret_val = fs.create(f.path, std::string(f.size, 'a' + f.size % 26));
+        if(ret_val == FS_OK){
+            files.push_back(f);
+            dir_entries[dir]++;
+        }
+        return ret_val;
+    }
+
+    // appends a small file to another one, the growth lands wherever the
+    // allocator finds room by now
+    int append() {
+        if(files.size() < 2)
+            return create();
+        const aged_file& from = files[pick(files.size())];
+        aged_file& to = files[pick(files.size())];
+        if(&from == &to || from.size > 4 * mean_size || to.size > 64 * mean_size)
+            return FS_OK;
+        int ret_val = fs.append(from.path, to.path);
+        if(ret_val == FS_OK)
+            to.size += from.size + 1;
+        return ret_val;
+    }
+
+    // appends a block or so to a file. Many files growing in turn, as
+    // logs do, get their blocks interleaved with each other's since the
+    // block after each one's end is soon taken by another.
+    int grow() {
+        if(files.empty())
+            return create();
+        aged_file& to = files[pick(files.size())];
+        if(to.size > 64 * mean_size)
+            return FS_OK;
+        int ret_val = fs.append(PIECE, to.path);
+        if(ret_val == FS_OK)
+            to.size += BLOCK_SIZE + 1;
+        return ret_val;
+    }
+
+    int cp() {
+        if(files.empty())
+            return create();
+        const aged_file& from = files[pick(files.size())];
+        if(dir_entries[from.dir] >= DIR_ENTRIES - 2)
+            return FS_EDIRFULL;
+        // a plain name puts the copy next to the source
+        std::string name = "c" + std::to_string(counter++);
+        int ret_val = fs.cp(from.path, name);
+        if(ret_val == FS_OK){
+            aged_file f = { dirs[from.dir] + "/" + name, from.dir, from.size };
+            files.push_back(f);
+            dir_entries[from.dir]++;
+        }
+        return ret_val;
+    }
+
+    int rm() {
+        if(files.empty())
+            return FS_OK;
+        size_t i = pick(files.size());
+        int ret_val = fs.rm(files[i].path);
+        if(ret_val == FS_OK){
+            dir_entries[files[i].dir]--;
+            files[i] = files.back();
+            files.pop_back();
+            // nothing reclaims in the background here, without it the
+            // blocks would look used until the disk runs out
+            bool done = false;
+            while(!done && fs.reclaim_step(&done) == FS_OK)
+                ;
+        }
+        return ret_val;
+    }
+};
+
+static double
+utilization(FS& fs)
+{
+    const int16_t *fat = fs.get_fat();
+    unsigned used = 0;
+    for(unsigned b = 2; b < fs.get_no_blocks(); b++){
+        if(fat[b] != FAT_FREE)
+            used++;
+    }
+    return (double)used / (fs.get_no_blocks() - 2);
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string image = "aged.bin";
+    double target_util = 0.7, target_score = 0.3, mean_size = 8192;
+    uint64_t seed = 1;
+    unsigned long max_ops = 1000000;
+    unsigned fanout = 16;
+    disk_config config;
+    for(int i = 1; i < argc; i++){
+        bool has_arg = i + 1 < argc;
+        if(strcmp(argv[i], "-i") == 0 && has_arg)
+            image = argv[++i];
+        else if(strcmp(argv[i], "-u") == 0 && has_arg)
+            target_util = atof(argv[++i]);
+        else if(strcmp(argv[i], "-F") == 0 && has_arg)
+            target_score = atof(argv[++i]);
+        else if(strcmp(argv[i], "-S") == 0 && has_arg)
+            seed = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "-n") == 0 && has_arg)
+            max_ops = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "-s") == 0 && has_arg)
+            mean_size = atof(argv[++i]);
+        else if(strcmp(argv[i], "-f") == 0 && has_arg)
+            fanout = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-c") == 0 && has_arg)
+            config.cache_blocks = atoi(argv[++i]);
+        else {
+            std::cerr << "Usage: " << argv[0] << " [-i image] [-u utilization] [-F score] [-S seed]\n"
+                         "       [-n max_ops] [-s mean_size] [-f fanout] [-c blocks]\n";
+            return 2;
+        }
+    }
+    if(target_util <= 0 || target_util >= 1 || target_score < 0 || target_score > 1 ||
+       mean_size < 1 || fanout < 1 || fanout > DIR_ENTRIES - 1){
+        std::cerr << "Targets must be between 0 and 1, fanout between 1 and " << DIR_ENTRIES - 1 << "\n";
+        return 2;
+    }
+
+    FS fs(image, config);
+    if(!fs.mounted() || fs.format() != FS_OK){
+        std::cerr << "Could not open " << image << "\n";
+        return 1;
+    }
+
+    ager a(fs, seed, mean_size);
+    for(unsigned i = 0; i < fanout; i++){
+        a.dirs.push_back("/a" + std::to_string(i));
+        a.dir_entries.push_back(0);
+        fs.mkdir(a.dirs.back());
+    }
+    fs.create(PIECE, std::string(BLOCK_SIZE, 'p'));
+
+    // Grow towards the target with mostly creates and appends, then churn
+    // around it with as many removes as additions until the disk is
+    // fragmented enough
+    frag_summary frag;
+    unsigned long ops;
+    bool reached = false;
+    for(ops = 1; ops <= max_ops; ops++){
+        double util = utilization(fs);
+        double r = a.uniform();
+        int ret_val;
+        if(util < target_util)
+            ret_val = r < 0.4 ? a.create() : r < 0.6 ? a.append() : r < 0.8 ? a.grow() : a.cp();
+        else
+            ret_val = r < 0.5 ? a.rm() : r < 0.65 ? a.create() : r < 0.75 ? a.append() : a.grow();
+        if(ret_val == FS_ENOSPC || ret_val == FS_EDIRFULL)
+            a.rm();
+
+        if(ops % 200 == 0){
+            frag_summarize(fs, &frag);
+            if(ops % 20000 == 0)
+                printf("%lu ops: %u files, utilization %.3f, fragmentation %.3f\n",
+                       ops, frag.no_files, frag.utilization, frag.score);
+            if(frag.score >= target_score && frag.utilization >= target_util - 0.02 &&
+               frag.utilization <= target_util + 0.02){
+                reached = true;
+                break;
+            }
+        }
+    }
+
+    frag_summarize(fs, &frag);
+    printf("%s after %lu ops: %u files in %u directories, utilization %.3f, "
+           "fragmentation %.3f (%llu extents over %llu blocks)\n",
+           image.c_str(), ops > max_ops ? max_ops : ops, frag.no_files, frag.no_dirs,
+           frag.utilization, frag.score, (unsigned long long)frag.extents,
+           (unsigned long long)frag.file_blocks);
+    if(!reached){
+        std::cerr << "Targets not reached within " << max_ops << " operations\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <iterator>
+#include <cstring>
+#include "client.h"
+
+// fsclient [-s socket] <command> [args]
+// Runs one command against the filesystem daemon, the data for create is
+// read from stdin. Exits with 0 on success, 1 if the command failed and 2 if
+// the daemon could not be reached.
+int
+main(int argc, char **argv)
+{
+    std::string socket_path = FSD_DEFAULT_SOCKET;
+    int argi = 1;
+    if(argc > 2 && strcmp(argv[1], "-s") == 0){
+        socket_path = argv[2];
+        argi = 3;
+    }
+    if(argi >= argc){
+        std::cerr << "Usage: fsclient [-s socket] <command> [args]\n";
+        return 2;
+    }
+
+    std::string cmd = argv[argi];
+    std::vector<std::string> args(argv + argi + 1, argv + argc);
+
+    FSClient client;
+    if(client.connect(socket_path) == -1){
+        std::cerr << "Could not connect to " << socket_path << "\n";
+        return 2;
+    }
+
+    std::string out;
+    std::vector<dir_entry> entries;
+    dir_entry entry;
+    int ret_val;
+    if(cmd == "format" && args.size() == 0)
+        ret_val = client.format();
+    else if(cmd == "create" && args.size() == 1){
+        std::string data((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+        if(!data.empty() && data[data.length() - 1] == '\n')
+            data.erase(data.length() - 1);
+        ret_val = client.create(args[0], data);
+    }
+    else if(cmd == "cat" && args.size() == 1){
+        ret_val = client.cat(args[0], &out);
+        if(ret_val == FS_OK)
+            out += "\n";
+    }
+    else if(cmd == "ls" && args.size() == 0){
+        // one tab separated line per entry: type size accessrights name
+        ret_val = client.ls(&entries);
+        for(unsigned i = 0; i < entries.size(); i++){
+            out += entries[i].type == TYPE_DIR ? "d\t" : "f\t";
+            out += std::to_string(entries[i].size) + "\t" + std::to_string(entries[i].access_rights) + "\t";
+            out += std::string(entries[i].file_name) + "\n";
+        }
+    }
+    else if(cmd == "stat" && args.size() == 1){
+        ret_val = client.stat(args[0], &entry);
+        if(ret_val == FS_OK){
+            out += entry.type == TYPE_DIR ? "d\t" : "f\t";
+            out += std::to_string(entry.size) + "\t" + std::to_string(entry.access_rights) + "\t";
+            out += std::string(entry.file_name) + "\n";
+        }
+    }
+    else if(cmd == "cp" && args.size() == 2)
+        ret_val = client.cp(args[0], args[1]);
+    else if(cmd == "mv" && args.size() == 2)
+        ret_val = client.mv(args[0], args[1]);
+    else if(cmd == "rm" && args.size() == 1)
+        ret_val = client.rm(args[0]);
+    else if(cmd == "append" && args.size() == 2)
+        ret_val = client.append(args[0], args[1]);
+    else if(cmd == "mkdir" && args.size() == 1)
+        ret_val = client.mkdir(args[0]);
+    else if(cmd == "pwd" && args.size() == 0){
+        ret_val = client.pwd(&out);
+        out += "\n";
+    }
+    else if(cmd == "chmod" && args.size() == 2)
+        ret_val = client.chmod(args[0], args[1]);
+    else {
+        std::cerr << "Unknown command or wrong number of arguments: " << cmd << "\n";
+        return 2;
+    }
+
+    if(ret_val == -1 && !client.connected()){
+        std::cerr << "Lost connection to " << socket_path << "\n";
+        return 2;
+    }
+    if(ret_val != FS_OK){
+        std::cerr << "Error: " << cmd << " failed, error code " << ret_val << "\n";
+        return 1;
+    }
+    std::cout << out;
+    return 0;
+}
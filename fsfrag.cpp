@@ -0,0 +1,88 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "fs.h"
+#include "frag.h"
+
+// Offline fragmentation analyzer, the frag shell command for an image that
+// is not mounted anywhere. The image is loaded with the memory backend so
+// it is never written to, unless it is to be defragmented.
+//
+// fsfrag [-f] [-m [width]] [-j] [-d] [image]
+//   -f  a row per file with its extents, run length and seek distance
+//   -m  the block heatmap, width blocks per row (default 64)
+//   -j  the report as JSON instead of text
+//   -d  defragment the image in place first, see FS::defrag
+//   image defaults to diskfile.bin
+
+int
+main(int argc, char **argv)
+{
+    std::string image = DISKNAME;
+    bool per_file = false, heatmap = false, json = false, defrag = false;
+    unsigned width = 64;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-f") == 0)
+            per_file = true;
+        else if(strcmp(argv[i], "-m") == 0){
+            heatmap = true;
+            if(i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9')
+                width = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "-j") == 0)
+            json = true;
+        else if(strcmp(argv[i], "-d") == 0)
+            defrag = true;
+        else if(argv[i][0] != '-' && i == argc - 1)
+            image = argv[i];
+        else {
+            std::cerr << "Usage: " << argv[0] << " [-f] [-m [width]] [-j] [-d] [image]\n";
+            return 2;
+        }
+    }
+
+    // the memory backend starts out empty for an image that is not there
+    if(access(image.c_str(), R_OK) != 0){
+        std::cerr << "Could not open " << image << "\n";
+        return 1;
+    }
+    disk_config config;
+    if(!defrag)
+        config.backend = DISK_BACKEND_MEMORY;
+    FS fs(image, config);
+    if(!fs.mounted()){
+        std::cerr << "Could not open " << image << "\n";
+        return 1;
+    }
+    frag_report report;
+    int ret_val = FS_OK;
+    if(defrag){
+        frag_summary before;
+        defrag_progress progress;
+        memset(&progress, 0, sizeof(progress));
+        ret_val = frag_summarize(fs, &before);
+        if(ret_val == FS_OK)
+            ret_val = fs.defrag(&progress);
+        if(ret_val != FS_OK){
+            std::cerr << "Could not defragment " << image << ": " << fatfs_strerror(ret_val) << "\n";
+            return 1;
+        }
+        std::cerr << "Defragmented " << image << ": moved " << progress.files_moved << " files, "
+                  << progress.blocks_moved << " blocks with " << progress.io << " disk I/Os, "
+                  << before.extents << " extents before\n";
+    }
+    ret_val = frag_analyze(fs, &report);
+    if(ret_val == FS_OK && heatmap)
+        ret_val = frag_write_heatmap(std::cout, fs, width);
+    if(ret_val != FS_OK){
+        std::cerr << "Could not analyze " << image << ": " << fatfs_strerror(ret_val) << "\n";
+        return 1;
+    }
+    if(json)
+        frag_write_json(std::cout, report);
+    else
+        frag_write_report(std::cout, report, per_file);
+    return 0;
+}
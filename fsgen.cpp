@@ -0,0 +1,546 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fs.h"
+
+// Synthetic workload generator, filebench style. It drives the FS API with
+// one of a few personalities:
+//   mailspool   small files created and removed in a spool, some read
+//   fileserver  a tree of files that is read, copied and appended to
+//   logwriter   log files that grow by append and get rotated
+//   deeptree    mkdir and cd heavy growth of a deep directory tree
+//
+// fsgen -p personality [-t threads] [-n ops | -d seconds] [-S seed]
+//       [-z sizes] [-f fanout] [-i image] [-m] [-c blocks] [-E device] [-o results.json]
+//   -t  threads, each works in its own directory /t<n> (default 1)
+//   -n  operations per thread (default 10000), -d runs for a time instead
+//   -S  seed, the same seed gives the same operations (default 1)
+//   -z  file sizes: fixed:N, uniform:MIN:MAX or exp:MEAN in bytes
+//   -f  directory fan-out, sub-directories per directory (default 8)
+//   -i, -m, -c, -E  image, memory backend, block cache and device as for filesystem
+//
+// The FS is not thread safe, so like the daemon all calls go through one
+// lock and every thread keeps its own working directory. Latencies include
+// the wait for the lock, as a client would see it. With one thread a seed
+// always gives the same run. With more threads the interleaving varies,
+// and so does which operations run out of space.
+
+// Operations that get their own latency histogram
+enum gen_op {
+    GEN_CREATE, GEN_CAT, GEN_CP, GEN_APPEND, GEN_MV, GEN_RM,
+    GEN_MKDIR, GEN_CD, GEN_PWD, GEN_OPS
+};
+
+static const char *gen_op_names[GEN_OPS] = {
+    "create", "cat", "cp", "append", "mv", "rm", "mkdir", "cd", "pwd"
+};
+
+// File size distribution
+struct size_dist {
+    int kind;           // 0 fixed, 1 uniform, 2 exponential
+    uint64_t a, b;      // fixed size, or min and max
+    double mean;
+};
+
+// Parses fixed:N, uniform:MIN:MAX or exp:MEAN, false if it is neither
+static bool
+parse_sizes(const std::string& spec, size_dist *dist)
+{
+    unsigned long long a = 0, b = 0;
+    double mean = 0;
+    if(sscanf(spec.c_str(), "fixed:%llu", &a) == 1){
+        dist->kind = 0;
+        dist->a = a;
+    } else if(sscanf(spec.c_str(), "uniform:%llu:%llu", &a, &b) == 2 && a <= b){
+        dist->kind = 1;
+        dist->a = a;
+        dist->b = b;
+    } else if(sscanf(spec.c_str(), "exp:%lf", &mean) == 1 && mean > 0){
+        dist->kind = 2;
+        dist->mean = mean;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static uint64_t
+sample_size(const size_dist& dist, std::mt19937_64& rng)
+{
+    switch(dist.kind){
+    case 0:
+        return dist.a;
+    case 1:
+        return std::uniform_int_distribution<uint64_t>(dist.a, dist.b)(rng);
+    default: {
+        // capped so a single file can never take a large part of the disk
+        double size = std::exponential_distribution<double>(1.0 / dist.mean)(rng);
+        return size > 16 * dist.mean ? (uint64_t)(16 * dist.mean) : (uint64_t)size;
+    }
+    }
+}
+
+struct gen_file {
+    std::string path;
+    uint64_t size;
+    int dir;            // index in Worker::dirs, -1 if not in one of them
+};
+
+struct gen_dir {
+    std::string path;
+    unsigned depth;
+    unsigned no_entries;
+};
+
+struct gen_config {
+    std::string personality;
+    unsigned threads;
+    unsigned long ops;
+    double seconds;
+    uint64_t seed;
+    size_dist sizes;
+    unsigned fanout;
+};
+
+// One generator thread and what it knows about its own part of the tree
+class Worker {
+public:
+    FS& fs;
+    std::mutex& fs_lock;
+    const gen_config& config;
+    unsigned id;
+    std::mt19937_64 rng;
+    int cwd;                        // working directory block of this thread
+    std::string root;               // /t<id>
+    std::vector<gen_file> files;
+    std::vector<gen_dir> dirs;
+    unsigned long counter;          // for unique names
+    unsigned depth;                 // deeptree: depth of cwd below root
+    std::string cwd_path;           // deeptree: path of cwd
+    std::vector<char> has_old;      // logwriter: whether log i has a rotated copy
+    LatencyHistogram lat[GEN_OPS];
+    uint64_t failures[GEN_OPS];
+    uint64_t ops_done;
+    uint64_t run_ns;                // time spent running, setup excluded
+
+    Worker(FS& fs, std::mutex& lock, const gen_config& config, unsigned id)
+        : fs(fs), fs_lock(lock), config(config), id(id), rng(config.seed * 1000003 + id),
+          cwd(ROOT_BLOCK), root("/t" + std::to_string(id)), counter(0), depth(0), ops_done(0), run_ns(0) {
+        memset(failures, 0, sizeof(failures));
+    }
+
+    // Runs fn as this thread: under the FS lock and in our working directory
+    template<typename F>
+    int call(gen_op op, F fn) {
+        uint64_t start = latency_now();
+        int ret_val;
+        {
+            std::lock_guard<std::mutex> guard(fs_lock);
+            fs.set_current_directory_block(cwd);
+            ret_val = fn();
+            cwd = fs.current_directory_block();
+        }
+        lat[op].record(latency_now() - start);
+        if(ret_val != FS_OK)
+            failures[op]++;
+        ops_done++;
+        return ret_val;
+    }
+
+    double uniform() { return std::uniform_real_distribution<double>(0, 1)(rng); }
+    size_t pick(size_t n) { return std::uniform_int_distribution<size_t>(0, n - 1)(rng); }
+    std::string name(const char *prefix) { return prefix + std::to_string(counter++); }
+
+    int create(const std::string& path, uint64_t size, int dir = -1) {
+        std::string data(size, 'a' + id % 26);
+        int ret_val = call(GEN_CREATE, [&]{ return fs.create(path, data); });
+        if(ret_val == FS_OK){
+            gen_file f = { path, size, dir };
+            files.push_back(f);
+            if(dir != -1)
+                dirs[dir].no_entries++;
+        }
+        return ret_val;
+    }
+
+    // Creates a file with a new name in a random directory with room for it
+    int create_somewhere(const char *prefix) {
+        int dir = roomy_dir();
+        if(dir == -1)
+            return FS_EDIRFULL;
+        return create(dirs[dir].path + "/" + name(prefix), sample_size(config.sizes, rng), dir);
+    }
+
+    // Removes a random file of ours, to make room
+    void rm_random() {
+        if(files.empty())
+            return;
+        size_t i = pick(files.size());
+        std::string path = files[i].path;
+        if(call(GEN_RM, [&]{ return fs.rm(path); }) == FS_OK){
+            if(files[i].dir != -1)
+                dirs[files[i].dir].no_entries--;
+            files[i] = files.back();
+            files.pop_back();
+        }
+    }
+
+    // Index of a directory of ours with room for one more entry, or -1
+    int roomy_dir() {
+        if(dirs.empty())
+            return -1;
+        size_t start = pick(dirs.size());
+        for(size_t i = 0; i < dirs.size(); i++){
+            size_t d = (start + i) % dirs.size();
+            if(dirs[d].no_entries < DIR_ENTRIES - 2)
+                return d;
+        }
+        return -1;
+    }
+
+    void setup();
+    void step();
+    void run();
+};
+
+// Every thread gets /t<id> with `fanout` sub-directories
+void
+Worker::setup()
+{
+    call(GEN_MKDIR, [&]{ return fs.mkdir(root); });
+    for(unsigned i = 0; i < config.fanout; i++){
+        gen_dir d = { root + "/d" + std::to_string(i), 1, 0 };
+        if(call(GEN_MKDIR, [&]{ return fs.mkdir(d.path); }) == FS_OK)
+            dirs.push_back(d);
+    }
+
+    if(config.personality == "fileserver"){
+        // a tree worth serving, 8 files per directory
+        for(unsigned i = 0; i < dirs.size() * 8; i++){
+            if(create_somewhere("f") != FS_OK)
+                break;
+        }
+    } else if(config.personality == "logwriter"){
+        // one log per directory and the record that gets appended
+        for(unsigned i = 0; i < dirs.size(); i++)
+            create(dirs[i].path + "/log", 1, i);
+        has_old.assign(files.size(), 0);
+        create(root + "/rec", sample_size(config.sizes, rng));
+    } else if(config.personality == "deeptree"){
+        call(GEN_CD, [&]{ return fs.cd(root); });
+        cwd_path = root;
+    }
+}
+
+void
+Worker::step()
+{
+    double r = uniform();
+    const std::string& p = config.personality;
+
+    if(p == "mailspool"){
+        // deliver, read and expunge mail, about as many creates as removes
+        if(r < 0.10 && !files.empty()){
+            std::string data;
+            std::string path = files[pick(files.size())].path;
+            call(GEN_CAT, [&]{ return fs.cat(path, &data); });
+        } else if(r < 0.55 || files.empty()){
+            int ret_val = create_somewhere("m");
+            if(ret_val == FS_ENOSPC || ret_val == FS_EDIRFULL)
+                rm_random();
+        } else {
+            rm_random();
+        }
+
+    } else if(p == "fileserver"){
+        // mostly reads, some copies and appends, the odd replaced file
+        if(files.empty()){
+            create_somewhere("f");
+            return;
+        }
+        const gen_file& f = files[pick(files.size())];
+        std::string src = f.path;
+        if(r < 0.50){
+            std::string data;
+            call(GEN_CAT, [&]{ return fs.cat(src, &data); });
+        } else if(r < 0.70){
+            // copies until the tree is twice its first size, then removals
+            if(files.size() >= 16 * dirs.size()){
+                rm_random();
+                return;
+            }
+            // a plain destination name puts the copy next to the source
+            int dir = f.dir;
+            std::string dst_name = name("c");
+            uint64_t size = f.size;
+            bool room = dir != -1 && dirs[dir].no_entries < DIR_ENTRIES - 2;
+            int ret_val = !room ? FS_EDIRFULL : call(GEN_CP, [&]{ return fs.cp(src, dst_name); });
+            if(ret_val == FS_OK){
+                gen_file copy = { dirs[dir].path + "/" + dst_name, size, dir };
+                files.push_back(copy);
+                dirs[dir].no_entries++;
+            } else if(ret_val == FS_ENOSPC || ret_val == FS_EDIRFULL){
+                rm_random();
+            }
+        } else if(r < 0.90){
+            // files stop growing at 4 times the largest new file
+            gen_file& dst = files[pick(files.size())];
+            if(dst.size > 4 * (config.sizes.kind == 1 ? config.sizes.b : 65536)){
+                rm_random();
+                return;
+            }
+            std::string dst_path = dst.path;
+            uint64_t src_size = f.size;
+            int ret_val = call(GEN_APPEND, [&]{ return fs.append(src, dst_path); });
+            if(ret_val == FS_OK)
+                dst.size += src_size + 1;
+            else if(ret_val == FS_ENOSPC)
+                rm_random();
+        } else {
+            rm_random();
+            create_somewhere("f");
+        }
+
+    } else if(p == "logwriter"){
+        // append the record to a log, rotating logs that grew too big
+        if(files.size() < 2)
+            return;
+        gen_file& rec = files.back();
+        if(r < 0.05){
+            // a new record size now and then
+            std::string rec_path = rec.path;
+            call(GEN_RM, [&]{ return fs.rm(rec_path); });
+            files.pop_back();
+            create(rec_path, sample_size(config.sizes, rng));
+            return;
+        }
+        size_t i = pick(files.size() - 1);
+        std::string log = files[i].path;
+        std::string rec_path = rec.path;
+        uint64_t rec_size = rec.size;
+        int ret_val = call(GEN_APPEND, [&]{ return fs.append(rec_path, log); });
+        if(ret_val == FS_OK)
+            files[i].size += rec_size + 1;
+        if(ret_val == FS_ENOSPC || files[i].size > 256 * 1024){
+            std::string old = log + ".old";
+            if(has_old[i])
+                call(GEN_RM, [&]{ return fs.rm(old); });
+            if(call(GEN_MV, [&]{ return fs.mv(log, "log.old"); }) == FS_OK)
+                has_old[i] = 1;
+            std::string data(1, 'l');
+            if(call(GEN_CREATE, [&]{ return fs.create(log, data); }) == FS_OK)
+                files[i].size = 1;
+        }
+
+    } else if(p == "deeptree"){
+        // grow the tree downwards, wander around in it
+        if(r < 0.35 && depth < 32){
+            std::string dir = name("n");
+            if(call(GEN_MKDIR, [&]{ return fs.mkdir(dir); }) == FS_OK &&
+               call(GEN_CD, [&]{ return fs.cd(dir); }) == FS_OK){
+                cwd_path += "/" + dir;
+                depth++;
+                gen_dir d = { cwd_path, depth, 0 };
+                dirs.push_back(d);
+            }
+        } else if(r < 0.60 && depth > 0){
+            if(call(GEN_CD, [&]{ return fs.cd(".."); }) == FS_OK){
+                cwd_path.erase(cwd_path.rfind('/'));
+                depth--;
+            }
+        } else if(r < 0.80 && !dirs.empty()){
+            const gen_dir& d = dirs[pick(dirs.size())];
+            std::string path = d.path;
+            if(call(GEN_CD, [&]{ return fs.cd(path); }) == FS_OK){
+                cwd_path = d.path;
+                depth = d.depth;
+            }
+        } else if(r < 0.90){
+            std::string data(sample_size(config.sizes, rng), 'd');
+            std::string file = name("f");
+            call(GEN_CREATE, [&]{ return fs.create(file, data); });
+        } else {
+            std::string path;
+            call(GEN_PWD, [&]{ return fs.pwd(&path); });
+        }
+    }
+}
+
+void
+Worker::run()
+{
+    setup();
+    for(unsigned op = 0; op < GEN_OPS; op++)
+        lat[op].reset();
+    memset(failures, 0, sizeof(failures));
+    ops_done = 0;
+
+    uint64_t start = latency_now();
+    uint64_t end = start + (uint64_t)(config.seconds * 1e9);
+    for(unsigned long i = 0; config.seconds > 0 ? latency_now() < end : i < config.ops; i++)
+        step();
+    run_ns = latency_now() - start;
+}
+
+// Prints the merged results of all workers, and writes them as JSON if asked
+static void
+report(const gen_config& config, std::vector<Worker*>& workers, double secs, const char *json_path)
+{
+    LatencyHistogram total[GEN_OPS];
+    uint64_t failures[GEN_OPS];
+    uint64_t ops = 0;
+    memset(failures, 0, sizeof(failures));
+    for(unsigned w = 0; w < workers.size(); w++){
+        ops += workers[w]->ops_done;
+        for(unsigned op = 0; op < GEN_OPS; op++){
+            failures[op] += workers[w]->failures[op];
+            total[op].merge(workers[w]->lat[op]);
+        }
+    }
+
+    printf("%s: %u threads, seed %llu, %llu ops in %.3f s, %.0f ops/s\n",
+           config.personality.c_str(), config.threads, (unsigned long long)config.seed,
+           (unsigned long long)ops, secs, secs > 0 ? ops / secs : 0);
+    printf("  %-8s %10s %9s %10s %10s %10s %10s %10s\n",
+           "op", "count", "failed", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+    for(unsigned op = 0; op < GEN_OPS; op++){
+        const LatencyHistogram& h = total[op];
+        if(h.count() == 0)
+            continue;
+        printf("  %-8s %10llu %9llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               gen_op_names[op], (unsigned long long)h.count(), (unsigned long long)failures[op],
+               h.mean() / 1e3, h.percentile(0.50) / 1e3, h.percentile(0.99) / 1e3,
+               h.percentile(0.999) / 1e3, h.max() / 1e3);
+    }
+
+    if(json_path == NULL)
+        return;
+    std::ofstream out(json_path);
+    out << "{\"personality\": \"" << config.personality << "\", \"threads\": " << config.threads
+        << ", \"seed\": " << config.seed << ", \"ops\": " << ops << ", \"seconds\": " << secs
+        << ", \"ops_per_sec\": " << (secs > 0 ? ops / secs : 0) << ", \"latency_ns\": {";
+    bool first = true;
+    for(unsigned op = 0; op < GEN_OPS; op++){
+        const LatencyHistogram& h = total[op];
+        if(h.count() == 0)
+            continue;
+        out << (first ? "\n  " : ",\n  ") << "\"" << gen_op_names[op] << "\": {\"count\": " << h.count()
+            << ", \"failed\": " << failures[op] << ", \"mean\": " << (uint64_t)h.mean()
+            << ", \"p50\": " << h.percentile(0.50) << ", \"p99\": " << h.percentile(0.99)
+            << ", \"p999\": " << h.percentile(0.999) << ", \"max\": " << h.max() << "}";
+        first = false;
+    }
+    out << "\n}}\n";
+    if(!out.good())
+        std::cerr << "Could not write " << json_path << "\n";
+}
+
+static int
+usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " -p mailspool|fileserver|logwriter|deeptree [-t threads]\n"
+                 "       [-n ops | -d seconds] [-S seed] [-z fixed:N|uniform:MIN:MAX|exp:MEAN]\n"
+                 "       [-f fanout] [-i image] [-m] [-c blocks] [-E device] [-o results.json]\n";
+    return 2;
+}
+
+int
+main(int argc, char **argv)
+{
+    gen_config config;
+    config.threads = 1;
+    config.ops = 10000;
+    config.seconds = 0;
+    config.seed = 1;
+    config.fanout = 8;
+    std::string sizes;
+    std::string image = "fsgen.bin";
+    disk_config disk;
+    const char *json_path = NULL;
+
+    for(int i = 1; i < argc; i++){
+        bool has_arg = i + 1 < argc;
+        if(strcmp(argv[i], "-p") == 0 && has_arg)
+            config.personality = argv[++i];
+        else if(strcmp(argv[i], "-t") == 0 && has_arg)
+            config.threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-n") == 0 && has_arg)
+            config.ops = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "-d") == 0 && has_arg)
+            config.seconds = atof(argv[++i]);
+        else if(strcmp(argv[i], "-S") == 0 && has_arg)
+            config.seed = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "-z") == 0 && has_arg)
+            sizes = argv[++i];
+        else if(strcmp(argv[i], "-f") == 0 && has_arg)
+            config.fanout = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-i") == 0 && has_arg)
+            image = argv[++i];
+        else if(strcmp(argv[i], "-m") == 0)
+            disk.backend = DISK_BACKEND_MEMORY;
+        else if(strcmp(argv[i], "-c") == 0 && has_arg)
+            disk.cache_blocks = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-E") == 0 && has_arg && parse_device_model(argv[i + 1], &disk.model)){
+            disk.emulate = true;
+            i++;
+        }
+        else if(strcmp(argv[i], "-o") == 0 && has_arg)
+            json_path = argv[++i];
+        else
+            return usage(argv[0]);
+    }
+
+    // sizes that suit each personality unless told otherwise
+    const char *default_sizes;
+    if(config.personality == "mailspool")
+        default_sizes = "exp:4096";
+    else if(config.personality == "fileserver")
+        default_sizes = "uniform:1024:16384";
+    else if(config.personality == "logwriter")
+        default_sizes = "uniform:64:512";
+    else if(config.personality == "deeptree")
+        default_sizes = "fixed:16";
+    else
+        return usage(argv[0]);
+    if(!parse_sizes(sizes.empty() ? default_sizes : sizes, &config.sizes))
+        return usage(argv[0]);
+    if(config.threads < 1 || config.threads > DIR_ENTRIES - 1 ||
+       config.fanout < 1 || config.fanout > DIR_ENTRIES - 2)
+        return usage(argv[0]);
+
+    FS fs(image, disk);
+    if(!fs.mounted()){
+        std::cerr << "Could not open " << image << "\n";
+        return 1;
+    }
+    fs.format();
+
+    std::mutex fs_lock;
+    std::vector<Worker*> workers;
+    std::vector<std::thread> threads;
+    for(unsigned i = 0; i < config.threads; i++)
+        workers.push_back(new Worker(fs, fs_lock, config, i));
+
+    for(unsigned i = 0; i < config.threads; i++)
+        threads.push_back(std::thread(&Worker::run, workers[i]));
+    uint64_t run_ns = 0;
+    for(unsigned i = 0; i < config.threads; i++){
+        threads[i].join();
+        if(workers[i]->run_ns > run_ns)
+            run_ns = workers[i]->run_ns;
+    }
+    double secs = run_ns / 1e9;
+
+    report(config, workers, secs, json_path);
+    for(unsigned i = 0; i < workers.size(); i++)
+        delete workers[i];
+    return 0;
+}
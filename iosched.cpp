@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cstring>
+#include "iosched.h"
+#include "disk.h"
+#include "trace.h"
+
+IoScheduler::IoScheduler(DiskBackend *backend) : backend(backend)
+{
+    in_flight = 0;
+    depth = 1;
+    queued = 0;
+    waiting = 0;
+    head = 0;
+    for (int c = 0; c < IO_CLASSES; c++) {
+        budget[c] = 0;
+        tokens[c] = 0;
+    }
+    refilled = std::chrono::steady_clock::now();
+    reset_stats();
+}
+
+void
+IoScheduler::set_depth(unsigned depth)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    this->depth = depth < 1 ? 1 : depth;
+}
+
+void
+IoScheduler::set_budget(int io_class, unsigned blocks_per_sec)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    budget[io_class] = blocks_per_sec;
+    tokens[io_class] = blocks_per_sec;
+}
+
+int
+IoScheduler::read(unsigned first, unsigned count, uint8_t *buf, int io_class)
+{
+    request r;
+    r.op = IO_READ;
+    r.io_class = io_class;
+    r.first = first;
+    r.count = count;
+    r.buf = buf;
+    return submit(&r);
+}
+
+int
+IoScheduler::write(unsigned first, unsigned count, const uint8_t *buf, int io_class)
+{
+    request r;
+    r.op = IO_WRITE;
+    r.io_class = io_class;
+    r.first = first;
+    r.count = count;
+    r.buf = const_cast<uint8_t*>(buf);
+    return submit(&r);
+}
+
+int
+IoScheduler::copy(unsigned from, unsigned to, unsigned count, bool *offloaded, int io_class)
+{
+    request r;
+    r.op = IO_COPY;
+    r.io_class = io_class;
+    r.first = from;
+    r.to = to;
+    r.count = count;
+    r.offloaded = offloaded;
+    return submit(&r);
+}
+
+int
+IoScheduler::discard(unsigned first, unsigned count, int io_class)
+{
+    request r;
+    r.op = IO_DISCARD;
+    r.io_class = io_class;
+    r.first = first;
+    r.count = count;
+    return submit(&r);
+}
+
+void
+IoScheduler::get_stats(iosched_stats *stats)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    *stats = this->stats;
+}
+
+void
+IoScheduler::reset_stats()
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+// Queues r and dispatches requests while the backend is free, until r is
+// done by this thread or another one
+int
+IoScheduler::submit(request *r)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (r->io_class < 0 || r->io_class >= IO_CLASSES)
+        r->io_class = IO_FOREGROUND;
+    stats.requests[r->io_class]++;
+    stats.blocks[r->io_class] += r->count;
+
+    // alone and without a budget, there is nothing to put in order
+    if (in_flight < depth && queued == 0 && budget[r->io_class] == 0) {
+        in_flight++;
+        stats.dispatches++;
+        head = r->op == IO_COPY ? r->to + r->count : r->first + r->count;
+        guard.unlock();
+        r->result = dispatch_one(r);
+        guard.lock();
+        in_flight--;
+        if (waiting > 0)
+            idle.notify_all();
+        return r->result;
+    }
+
+    r->submitted = std::chrono::steady_clock::now();
+    r->done = false;
+    queue[r->io_class].push_back(r);
+    queued++;
+    std::vector<request*> batch;
+    while (!r->done) {
+        std::chrono::steady_clock::time_point retry;
+        // the backend is full, or r is in a batch another thread sent
+        if (in_flight >= depth || queued == 0) {
+            waiting++;
+            idle.wait(guard);
+            waiting--;
+            continue;
+        }
+        batch.clear();
+        if (!pick(&batch, &retry)) {
+            stats.throttled++;
+            waiting++;
+            idle.wait_until(guard, retry);
+            waiting--;
+            continue;
+        }
+        queued -= batch.size();
+        in_flight++;
+        guard.unlock();
+        int result = dispatch(batch);
+        guard.lock();
+        in_flight--;
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i]->result = result;
+            batch[i]->done = true;
+        }
+        if (waiting > 0)
+            idle.notify_all();
+    }
+    return r->result;
+}
+
+// Takes the next request and those that go along with it off the queues.
+// False if every class with requests is out of budget, *retry is when one
+// will have some again.
+bool
+IoScheduler::pick(std::vector<request*> *batch, std::chrono::steady_clock::time_point *retry)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(now - refilled).count();
+    refilled = now;
+    bool eligible[IO_CLASSES];
+    bool in_debt = false;
+    for (int c = 0; c < IO_CLASSES; c++) {
+        eligible[c] = !queue[c].empty();
+        if (budget[c] == 0 || queue[c].empty())
+            continue;
+        tokens[c] = std::min(tokens[c] + budget[c] * secs, (double)budget[c]);
+        if (tokens[c] > 0)
+            continue;
+        // in debt until the tokens are back above 0
+        eligible[c] = false;
+        std::chrono::steady_clock::time_point back = now +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>((0.001 - tokens[c]) / budget[c]));
+        if (!in_debt || back < *retry)
+            *retry = back;
+        in_debt = true;
+    }
+
+    // the oldest request that has waited too long goes first, else the
+    // first class with a request
+    int c = -1;
+    std::chrono::steady_clock::time_point oldest = now - std::chrono::milliseconds(IOSCHED_MAX_WAIT_MS);
+    for (int k = 0; k < IO_CLASSES; k++) {
+        if (eligible[k] && queue[k].front()->submitted < oldest) {
+            oldest = queue[k].front()->submitted;
+            c = k;
+        }
+    }
+    std::list<request*>::iterator it, next = queue[0].end();
+    if (c != -1) {
+        next = queue[c].begin();
+    } else {
+        for (c = 0; c < IO_CLASSES && !eligible[c]; c++)
+            ;
+        if (c == IO_CLASSES)
+            return false;
+        // the lowest block at or after head, or else the lowest block
+        std::list<request*>::iterator lowest = queue[c].end();
+        next = queue[c].end();
+        for (it = queue[c].begin(); it != queue[c].end(); ++it) {
+            if (lowest == queue[c].end() || (*it)->first < (*lowest)->first)
+                lowest = it;
+            if ((*it)->first >= head && (next == queue[c].end() || (*it)->first < (*next)->first))
+                next = it;
+        }
+        if (next == queue[c].end())
+            next = lowest;
+    }
+
+    request *r = *next;
+    queue[c].erase(next);
+    batch->push_back(r);
+    unsigned end = r->first + r->count, total = r->count;
+    bool found = r->op == IO_READ || r->op == IO_WRITE;
+    while (found && total < IOSCHED_MAX_MERGE) {
+        found = false;
+        for (it = queue[c].begin(); it != queue[c].end(); ++it) {
+            request *o = *it;
+            if (o->op == r->op && o->first == end && total + o->count <= IOSCHED_MAX_MERGE) {
+                batch->push_back(o);
+                queue[c].erase(it);
+                end += o->count;
+                total += o->count;
+                stats.merged++;
+                found = true;
+                break;
+            }
+        }
+    }
+    if (budget[c] > 0)
+        tokens[c] -= total;
+    head = r->op == IO_COPY ? r->to + r->count : end;
+    stats.dispatches++;
+    return true;
+}
+
+// Hands one request to the backend
+int
+IoScheduler::dispatch_one(request *r)
+{
+    if (r->op == IO_COPY)
+        return backend->copy(r->first, r->to, r->count, r->offloaded);
+    if (r->op == IO_DISCARD)
+        return backend->discard(r->first, r->count);
+    if (r->op == IO_READ)
+        return backend->read_run(r->first, r->count, r->buf);
+    return backend->write_run(r->first, r->count, r->buf);
+}
+
+// Hands a batch to the backend as one request, through the bounce buffer
+// if it is more than one
+int
+IoScheduler::dispatch(const std::vector<request*>& batch)
+{
+    request *r = batch[0];
+    if (batch.size() == 1)
+        return dispatch_one(r);
+
+    TraceSpan span("IoScheduler::merged", "disk", batch.size());
+    unsigned total = 0;
+    for (size_t i = 0; i < batch.size(); i++)
+        total += batch[i]->count;
+    std::vector<uint8_t> bounce((size_t)total * BLOCK_SIZE);
+    size_t pos = 0;
+    if (r->op == IO_WRITE) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            memcpy(&bounce[pos], batch[i]->buf, (size_t)batch[i]->count * BLOCK_SIZE);
+            pos += (size_t)batch[i]->count * BLOCK_SIZE;
+        }
+        return backend->write_run(r->first, total, &bounce[0]);
+    }
+    if (backend->read_run(r->first, total, &bounce[0]) != 0)
+        return -1;
+    for (size_t i = 0; i < batch.size(); i++) {
+        memcpy(batch[i]->buf, &bounce[pos], (size_t)batch[i]->count * BLOCK_SIZE);
+        pos += (size_t)batch[i]->count * BLOCK_SIZE;
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#ifndef __IOSCHED_H__
+#define __IOSCHED_H__
+
+// Classes of I/O, in the order they are served. A thread's requests are of
+// its class, see Disk::set_io_class.
+#define IO_FOREGROUND 0         // the shell and the API, someone waits for it
+#define IO_READAHEAD 1          // blocks read before they are asked for
+#define IO_BACKGROUND 2         // write back and defrag
+#define IO_CLASSES 3
+
+#define IOSCHED_MAX_MERGE 64    // most blocks one backend request carries
+#define IOSCHED_MAX_WAIT_MS 200 // a request waiting this long goes first, whatever its class
+
+class DiskBackend;
+
+// What the scheduler has done since it was created or last reset
+struct iosched_stats {
+    uint64_t requests[IO_CLASSES];
+    uint64_t blocks[IO_CLASSES];
+    uint64_t dispatches;        // backend requests, after merging
+    uint64_t merged;            // requests that went along with another one
+    uint64_t throttled;         // times nothing could go for lack of budget
+};
+
+// Puts the block requests of every thread using a Disk in order before they
+// reach its backend. There is no thread of its own: whoever finds the
+// backend with room for another request (see set_depth) dispatches the
+// next request, their own or not, while the rest wait. The next request is the one of the first class that has one
+// and budget left, and within the class the one at or after where the last
+// request ended (an elevator sweeping up, then starting over). Reads or
+// writes of that class that continue it go along as one request, up to
+// IOSCHED_MAX_MERGE blocks. A class with a budget spends a token per block,
+// refilled at blocks_per_sec, and waits once it is in debt.
+class IoScheduler {
+private:
+    enum io_op { IO_READ, IO_WRITE, IO_COPY, IO_DISCARD };
+    struct request {
+        io_op op;
+        int io_class;
+        unsigned first;
+        unsigned count;
+        unsigned to;                // IO_COPY only
+        uint8_t *buf;
+        bool *offloaded;            // IO_COPY only
+        std::chrono::steady_clock::time_point submitted;
+        bool done;
+        int result;
+    };
+
+    DiskBackend *backend;
+    std::mutex lock;                // everything below
+    std::condition_variable idle;   // the backend is free, or a request is done
+    std::list<request*> queue[IO_CLASSES];
+    unsigned queued;                // requests in all the queues
+    unsigned waiting;               // threads waiting on idle
+    unsigned in_flight;             // requests the backend is serving
+    unsigned depth;                 // how many it can serve at once
+    unsigned head;                  // block after the last request
+    unsigned budget[IO_CLASSES];    // blocks a second, 0 for no limit
+    double tokens[IO_CLASSES];
+    std::chrono::steady_clock::time_point refilled;
+    iosched_stats stats;
+
+    int submit(request *r);
+    bool pick(std::vector<request*> *batch, std::chrono::steady_clock::time_point *retry);
+    int dispatch_one(request *r);
+    int dispatch(const std::vector<request*>& batch);
+public:
+    IoScheduler(DiskBackend *backend);
+    // lets up to depth requests reach the backend at once, 1 until set
+    void set_depth(unsigned depth);
+    // limits io_class to blocks_per_sec, 0 for no limit
+    void set_budget(int io_class, unsigned blocks_per_sec);
+    // the requests, each waits until it is done
+    int read(unsigned first, unsigned count, uint8_t *buf, int io_class);
+    int write(unsigned first, unsigned count, const uint8_t *buf, int io_class);
+    int copy(unsigned from, unsigned to, unsigned count, bool *offloaded, int io_class);
+    int discard(unsigned first, unsigned count, int io_class);
+    void get_stats(iosched_stats *stats);
+    void reset_stats();
+};
+
+#endif // __IOSCHED_H__
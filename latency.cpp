@@ -0,0 +1,134 @@
+#include <cmath>
+#include <cstring>
+#include "latency.h"
+
+static const char *latency_op_names[LAT_COUNT] = {
+    "format", "create", "cat", "ls", "stat",
+    "cp", "mv", "rm", "append",
+    "mkdir", "cd", "pwd", "chmod", "batch", "defrag", "dedup", "sync", "reclaim",
+    "fallocate",
+    "find_final_block", "alloc", "disk_read", "disk_write", "flush"
+};
+
+const char *
+latency_op_name(int op)
+{
+    if(op < 0 || op >= LAT_COUNT)
+        return "unknown";
+    return latency_op_names[op];
+}
+
+void
+LatencyHistogram::reset()
+{
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    sum = 0;
+    min_ns = UINT64_MAX;
+    max_ns = 0;
+}
+
+// Bucket 0 up to 2^LAT_SUB_BITS - 1 hold one value each. After that each
+// group of 2^LAT_SUB_BITS buckets covers one power of two.
+unsigned
+LatencyHistogram::bucket_of(uint64_t ns)
+{
+    if(ns < (1u << LAT_SUB_BITS))
+        return ns;
+    if(ns >= (1ull << LAT_MAX_EXP))
+        ns = (1ull << LAT_MAX_EXP) - 1;
+    unsigned exp = 63 - __builtin_clzll(ns);
+    unsigned shift = exp - LAT_SUB_BITS;
+    unsigned sub = (ns >> shift) - (1u << LAT_SUB_BITS);
+    return ((shift + 1) << LAT_SUB_BITS) | sub;
+}
+
+uint64_t
+LatencyHistogram::bucket_value(unsigned bucket)
+{
+    if(bucket < (1u << LAT_SUB_BITS))
+        return bucket;
+    unsigned shift = (bucket >> LAT_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1u << LAT_SUB_BITS) - 1);
+    return ((1ull << LAT_SUB_BITS) + sub) << shift;
+}
+
+void
+LatencyHistogram::record(uint64_t ns)
+{
+    counts[bucket_of(ns)]++;
+    total++;
+    sum += ns;
+    if(ns < min_ns)
+        min_ns = ns;
+    if(ns > max_ns)
+        max_ns = ns;
+}
+
+void
+LatencyHistogram::merge(const LatencyHistogram& other)
+{
+    for(unsigned i = 0; i < LAT_BUCKETS; i++)
+        counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    if(other.min_ns < min_ns)
+        min_ns = other.min_ns;
+    if(other.max_ns > max_ns)
+        max_ns = other.max_ns;
+}
+
+uint64_t
+LatencyHistogram::percentile(double p) const
+{
+    if(total == 0)
+        return 0;
+    uint64_t target = (uint64_t)std::ceil(p * total);
+    if(target == 0)
+        target = 1;
+    uint64_t seen = 0;
+    for(unsigned i = 0; i < LAT_BUCKETS; i++){
+        seen += counts[i];
+        if(seen >= target){
+            // report the middle of the bucket, within what was really seen
+            uint64_t value = bucket_value(i);
+            if(i + 1 < LAT_BUCKETS)
+                value += (bucket_value(i + 1) - value) / 2;
+            if(value < min_ns)
+                value = min_ns;
+            if(value > max_ns)
+                value = max_ns;
+            return value;
+        }
+    }
+    return max_ns;
+}
+
+void
+latency_write_json(std::ostream& out, const LatencyHistogram *hists)
+{
+    out << "{\"unit\": \"ns\", \"ops\": {";
+    for(int op = 0; op < LAT_COUNT; op++){
+        const LatencyHistogram& h = hists[op];
+        out << (op ? ",\n  " : "\n  ") << "\"" << latency_op_name(op) << "\": {"
+            << "\"count\": " << h.count()
+            << ", \"min\": " << h.min()
+            << ", \"mean\": " << (uint64_t)h.mean()
+            << ", \"p50\": " << h.percentile(0.50)
+            << ", \"p90\": " << h.percentile(0.90)
+            << ", \"p99\": " << h.percentile(0.99)
+            << ", \"p999\": " << h.percentile(0.999)
+            << ", \"max\": " << h.max()
+            << ", \"buckets\": [";
+        bool first = true;
+        for(unsigned i = 0; i < LAT_BUCKETS; i++){
+            if(h.bucket_count(i) == 0)
+                continue;
+            out << (first ? "" : ", ") << "[" << LatencyHistogram::bucket_value(i)
+                << ", " << h.bucket_count(i) << "]";
+            first = false;
+        }
+        out << "]}";
+    }
+    out << "\n}}\n";
+}
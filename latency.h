@@ -0,0 +1,86 @@
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+// FS entry points and internal phases that get their own latency histogram
+enum latency_op {
+    LAT_FORMAT, LAT_CREATE, LAT_CAT, LAT_LS, LAT_STAT,
+    LAT_CP, LAT_MV, LAT_RM, LAT_APPEND,
+    LAT_MKDIR, LAT_CD, LAT_PWD, LAT_CHMOD, LAT_BATCH, LAT_DEFRAG, LAT_DEDUP, LAT_SYNC, LAT_RECLAIM,
+    LAT_FALLOCATE,
+    // phases inside the entry points
+    LAT_FIND_FINAL_BLOCK,   // path resolution
+    LAT_ALLOC,              // finding a free block
+    LAT_DISK_READ,          // one block read
+    LAT_DISK_WRITE,         // one block write, including its flush
+    LAT_FLUSH,              // a flush on its own, after a batch
+    LAT_COUNT
+};
+
+// name of a latency_op as shown by the stats command
+const char *latency_op_name(int op);
+
+// Values below 2^LAT_SUB_BITS ns are counted exactly, above that every power
+// of two is split in 2^LAT_SUB_BITS linear buckets, so a recorded value is
+// off by at most 1/32 (about 3%). Values are capped at 2^LAT_MAX_EXP ns.
+#define LAT_SUB_BITS 5
+#define LAT_MAX_EXP 40
+#define LAT_BUCKETS ((LAT_MAX_EXP - LAT_SUB_BITS + 2) << LAT_SUB_BITS)
+
+// HDR style latency histogram in nanoseconds. Recording is a few shifts and
+// an increment, so it can stay on for every call. Not thread safe, the FS
+// calls it is used from are never run concurrently.
+class LatencyHistogram {
+private:
+    uint64_t counts[LAT_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    static unsigned bucket_of(uint64_t ns);
+public:
+    LatencyHistogram() { reset(); }
+    void reset();
+    void record(uint64_t ns);
+    // adds everything recorded in other to this histogram
+    void merge(const LatencyHistogram& other);
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? min_ns : 0; }
+    uint64_t max() const { return max_ns; }
+    double mean() const { return total ? (double)sum / total : 0; }
+    // the value at or below which a fraction p (0 to 1) of all values are
+    uint64_t percentile(double p) const;
+
+    // smallest value counted in a bucket and the count of that bucket
+    static uint64_t bucket_value(unsigned bucket);
+    uint64_t bucket_count(unsigned bucket) const { return counts[bucket]; }
+};
+
+// monotonic clock in nanoseconds
+static inline uint64_t
+latency_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Records the time from its construction to the end of its scope
+class LatencyTimer {
+private:
+    LatencyHistogram& hist;
+    uint64_t start;
+public:
+    LatencyTimer(LatencyHistogram& h) : hist(h), start(latency_now()) {}
+    ~LatencyTimer() { hist.record(latency_now() - start); }
+};
+
+// Writes LAT_COUNT histograms as JSON: summary numbers and the non-empty
+// buckets, so dumps from several runs can be merged exactly
+void latency_write_json(std::ostream& out, const LatencyHistogram *hists);
+
+#endif // __LATENCY_H__
@@ -0,0 +1,140 @@
+#include <cstring>
+#include "lz.h"
+
+// positions are found by a hash of the 4 bytes starting there
+#define LZ_HASH_BITS 13
+
+static uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t
+lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes what is left of a length after the 15 in its nibble
+static bool
+put_length(uint8_t **out, uint8_t *end, size_t n)
+{
+    for(; n >= 255; n -= 255){
+        if(*out == end)
+            return false;
+        *(*out)++ = 255;
+    }
+    if(*out == end)
+        return false;
+    *(*out)++ = (uint8_t)n;
+    return true;
+}
+
+// Reads the rest of a length whose nibble was 15 into *n
+static bool
+get_length(const uint8_t **in, const uint8_t *end, size_t *n)
+{
+    uint8_t b;
+    do {
+        if(*in == end)
+            return false;
+        b = *(*in)++;
+        *n += b;
+    } while(b == 255);
+    return true;
+}
+
+// Writes one sequence, with no match if match_len is 0
+static bool
+put_sequence(uint8_t **out, uint8_t *end, const uint8_t *literals, size_t no_literals,
+             size_t distance, size_t match_len)
+{
+    size_t match_code = match_len == 0 ? 0 : match_len - LZ_MIN_MATCH;
+    if(*out == end)
+        return false;
+    *(*out)++ = (uint8_t)((no_literals < 15 ? no_literals : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if(no_literals >= 15 && !put_length(out, end, no_literals - 15))
+        return false;
+    if((size_t)(end - *out) < no_literals)
+        return false;
+    memcpy(*out, literals, no_literals);
+    *out += no_literals;
+    if(match_len == 0)
+        return true;
+    if(end - *out < 2)
+        return false;
+    *(*out)++ = (uint8_t)distance;
+    *(*out)++ = (uint8_t)(distance >> 8);
+    return match_code < 15 || put_length(out, end, match_code - 15);
+}
+
+// Greedy: every position is looked up in the hash table, and the match
+// found there is taken as long as it goes
+size_t
+lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    int32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    uint8_t *out = dst, *end = dst + cap;
+    size_t anchor = 0, i = 0;
+    while(i + LZ_MIN_MATCH <= len){
+        uint32_t h = lz_hash(read32(src + i));
+        int32_t candidate = table[h];
+        table[h] = (int32_t)i;
+        if(candidate < 0 || i - candidate > LZ_MAX_DISTANCE || read32(src + candidate) != read32(src + i)){
+            i++;
+            continue;
+        }
+        size_t match_len = LZ_MIN_MATCH;
+        while(i + match_len < len && src[candidate + match_len] == src[i + match_len])
+            match_len++;
+        if(!put_sequence(&out, end, src + anchor, i - anchor, i - candidate, match_len))
+            return 0;
+        // the positions inside the match are remembered too, text repeats
+        // itself at every offset
+        for(size_t j = i + 1; j < i + match_len && j + LZ_MIN_MATCH <= len; j++)
+            table[lz_hash(read32(src + j))] = (int32_t)j;
+        i += match_len;
+        anchor = i;
+    }
+    if(!put_sequence(&out, end, src + anchor, len - anchor, 0, 0))
+        return 0;
+    return out - dst;
+}
+
+int
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len)
+{
+    const uint8_t *in = src, *end = src + len;
+    size_t o = 0;
+    while(in < end){
+        uint8_t token = *in++;
+        size_t n = token >> 4;
+        if(n == 15 && !get_length(&in, end, &n))
+            return -1;
+        if((size_t)(end - in) < n || out_len - o < n)
+            return -1;
+        memcpy(dst + o, in, n);
+        in += n;
+        o += n;
+        if(in == end)
+            break;
+
+        if(end - in < 2)
+            return -1;
+        size_t distance = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        n = (token & 15) + LZ_MIN_MATCH;
+        if((token & 15) == 15 && !get_length(&in, end, &n))
+            return -1;
+        if(distance == 0 || distance > o || out_len - o < n)
+            return -1;
+        // byte by byte, the match may overlap what it produces
+        for(; n > 0; n--, o++)
+            dst[o] = dst[o - distance];
+    }
+    return o == out_len ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#include <cstddef>
+#include <cstdint>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// A small LZ77 codec in the spirit of LZ4, for compressed files. The
+// compressed form is a list of sequences: a token byte with the number of
+// literals in its high nibble and the match length minus LZ_MIN_MATCH in
+// its low nibble, a nibble of 15 being continued in bytes after the token
+// (255 meaning more follows). Then the literals, then the match as a 2 byte
+// little endian distance back into the output. The last sequence has
+// literals only.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+
+// compresses len bytes of src into dst and returns the compressed size, or
+// 0 if it does not fit in cap bytes
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+// decompresses the len bytes in src into exactly out_len bytes of dst.
+// Returns 0, or -1 if src is not what lz_compress makes of out_len bytes.
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len);
+
+#endif // __LZ_H__
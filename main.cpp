@@ -1,11 +1,199 @@
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
+#include "server.h"
+#include "trace.h"
 
+static Server *daemon_server = NULL;
+
+static void
+handle_stop_signal(int sig)
+{
+    if(daemon_server)
+        daemon_server->stop();
+}
+
+// Takes argv[*i] if it is one of the options for the disk, -i, -m, -c, -a,
+// -w, -W, -b, -B or -E, and moves *i past its argument. The shell and the
+// daemon both take them.
+static bool
+parse_disk_option(int argc, char **argv, int *i, std::string *image, disk_config *config)
+{
+    bool has_arg = *i + 1 < argc;
+    const char *opt = argv[*i];
+    if(strcmp(opt, "-i") == 0 && has_arg)
+        *image = argv[++*i];
+    else if(strcmp(opt, "-m") == 0)
+        config->backend = DISK_BACKEND_MEMORY;
+    else if(strcmp(opt, "-c") == 0 && has_arg)
+        config->cache_blocks = atoi(argv[++*i]);
+    else if(strcmp(opt, "-a") == 0 && has_arg)
+        config->readahead_blocks = atoi(argv[++*i]);
+    else if(strcmp(opt, "-w") == 0 && has_arg){
+        config->write_back = true;
+        config->dirty_age_ms = atoi(argv[++*i]);
+    } else if(strcmp(opt, "-W") == 0 && has_arg)
+        config->dirty_ratio = atoi(argv[++*i]);
+    else if(strcmp(opt, "-b") == 0 && has_arg)
+        config->readahead_budget = atoi(argv[++*i]);
+    else if(strcmp(opt, "-B") == 0 && has_arg)
+        config->background_budget = atoi(argv[++*i]);
+    else if(strcmp(opt, "-E") == 0 && has_arg && parse_device_model(argv[*i + 1], &config->model)){
+        config->emulate = true;
+        ++*i;
+    }
+    else
+        return false;
+    return true;
+}
+
+// filesystem -d [socket] [-j workers] [-t trace.json] [-D io_per_sec]
+//               [-i image] [-m] [-c blocks] ...
+// mounts the disk once and serves it to local clients instead of running
+// the interactive shell. With -t everything is traced and written to
+// trace.json on shutdown. With -D the disk is defragmented in the
+// background, spending at most io_per_sec disk reads and writes a second on
+// it. The disk is opened with the same options as for the shell.
+static int
+run_daemon(int argc, char **argv)
+{
+    std::string socket_path = FSD_DEFAULT_SOCKET;
+    unsigned no_workers = FSD_DEFAULT_WORKERS;
+    const char *trace_file = NULL;
+    int defrag_rate = -1;
+    std::string image = DISKNAME;
+    disk_config config;
+    for(int i = 2; i < argc; i++){
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            no_workers = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            trace_file = argv[++i];
+        else if(strcmp(argv[i], "-D") == 0 && i + 1 < argc)
+            defrag_rate = atoi(argv[++i]);
+        else if(!parse_disk_option(argc, argv, &i, &image, &config))
+            socket_path = argv[i];
+    }
+
+    FS filesystem(image, config);
+    if(!filesystem.mounted()){
+        std::cerr << "ERROR: Can't open diskfile: " << image << ", exiting..." << std::endl;
+        return 1;
+    }
+    Server server(filesystem, socket_path, no_workers);
+    daemon_server = &server;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal; // no SA_RESTART, accept() must see EINTR
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);           // clients hanging up must not kill us
+
+    if(trace_file)
+        trace_start();
+    if(defrag_rate >= 0)
+        server.start_defrag(defrag_rate);
+    int ret_val = server.run();
+    daemon_server = NULL;
+    if(trace_file){
+        trace_stop();
+        if(trace_write_json(trace_file) < 0)
+            std::cerr << "Could not write trace to " << trace_file << "\n";
+    }
+    return ret_val;
+}
+
+// filesystem [-f script] [-e] [-s] [-r workload] [-R workload [-F]]
+//            [-i image] [-m] [-c blocks] [-a blocks] [-w ms [-W percent]]
+//            [-b blocks_per_sec] [-B blocks_per_sec] [-E device]
+// Without a script and with a terminal on stdin this is the interactive
+// shell, otherwise the commands are run as a script without prompts.
+//   -e  stop at the first failing command
+//   -s  print the status of every command
+//   -r  record the session into a workload file
+//   -R  replay a workload file instead of reading commands, at the pace it
+//       was recorded, or as fast as possible with -F
+//   -i  disk image to use instead of diskfile.bin
+//   -m  keep the disk in memory, starting from the image, never written back
+//   -c  cache this many blocks
+//   -a  read at most this many blocks ahead of file reads, 0 for none
+//   -w  write back, writing blocks out once they have been dirty for ms
+//   -W  and all of them once this percentage of the disk is dirty
+//   -b  budget of readahead I/O, blocks a second
+//   -B  budget of background I/O (write back), blocks a second
+//   -E  make the disk as slow as a device, see parse_device_model
 int
 main(int argc, char **argv)
 {
-    Shell shell;
-    shell.run();
-    return 0;
+    if(argc > 1 && strcmp(argv[1], "-d") == 0)
+        return run_daemon(argc, argv);
+
+    const char *script = NULL, *record = NULL, *replay = NULL;
+    std::string image = DISKNAME;
+    disk_config config;
+    bool stop_on_error = false, print_status = false, paced = true;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            script = argv[++i];
+        else if(strcmp(argv[i], "-e") == 0)
+            stop_on_error = true;
+        else if(strcmp(argv[i], "-s") == 0)
+            print_status = true;
+        else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            record = argv[++i];
+        else if(strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+            replay = argv[++i];
+        else if(strcmp(argv[i], "-F") == 0)
+            paced = false;
+        else if(!parse_disk_option(argc, argv, &i, &image, &config)){
+            std::cerr << "Usage: filesystem [-f script] [-e] [-s] [-r workload] [-R workload [-F]]\n"
+                         "                  [-i image] [-m] [-c blocks] [-a blocks] [-w ms [-W percent]]\n"
+                         "                  [-b blocks_per_sec] [-B blocks_per_sec]\n"
+                         "                  [-E hdd|ssd|nvme|latency_us[,seek_us[,mb_per_sec[,queue_depth]]]]\n"
+                         "       filesystem -d [socket] [-j workers] [-t trace.json] [-D io_per_sec]\n"
+                         "                     [-i image] [-m] [-c blocks] ... as above\n";
+            return 2;
+        }
+    }
+
+    if(script == NULL && replay == NULL && isatty(STDIN_FILENO)){
+        Shell shell(image, config);
+        if(record && !shell.record(record)){
+            std::cerr << "Can't write workload: " << record << "\n";
+            return 2;
+        }
+        shell.run();
+        return 0;
+    }
+
+    // Nobody is watching, let iostreams buffer the output
+    std::ios::sync_with_stdio(false);
+    std::ifstream script_file;
+    if(script != NULL){
+        script_file.open(script);
+        if(!script_file.is_open()){
+            std::cerr << "Can't open script: " << script << "\n";
+            return 2;
+        }
+    }
+    Shell shell(image, config);
+    if(record && !shell.record(record)){
+        std::cerr << "Can't write workload: " << record << "\n";
+        return 2;
+    }
+    if(replay){
+        long mismatches = shell.replay(replay, paced);
+        if(mismatches < 0){
+            std::cerr << "Can't read workload: " << replay << "\n";
+            return 2;
+        }
+        return mismatches == 0 ? 0 : 1;
+    }
+    int ret_val = shell.run_script(script ? (std::istream&)script_file : std::cin, stop_on_error, print_status);
+    return ret_val == 0 ? 0 : 1;
 }
@@ -0,0 +1,85 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include "protocol.h"
+
+// reads exactly len bytes from fd
+int
+fsd_read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t*)buf;
+    while(len > 0){
+        ssize_t n = ::read(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// writes exactly len bytes to fd
+int
+fsd_write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    while(len > 0){
+        ssize_t n = ::write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Each argument is stored as a uint32_t length followed by its bytes
+void
+fsd_pack_args(const std::vector<std::string>& args, std::string *payload)
+{
+    payload->clear();
+    for(unsigned i = 0; i < args.size(); i++){
+        uint32_t len = args[i].length();
+        payload->append((const char*)&len, sizeof(len));
+        payload->append(args[i]);
+    }
+}
+
+// Returns 0 if the payload holds exactly nargs well formed arguments
+int
+fsd_unpack_args(const std::string& payload, unsigned nargs, std::vector<std::string> *args)
+{
+    size_t pos = 0;
+    args->clear();
+    for(unsigned i = 0; i < nargs; i++){
+        uint32_t len;
+        if(payload.length() - pos < sizeof(len))
+            return -1;
+        memcpy(&len, payload.data() + pos, sizeof(len));
+        pos += sizeof(len);
+        if(payload.length() - pos < len)
+            return -1;
+        args->push_back(payload.substr(pos, len));
+        pos += len;
+    }
+    return pos == payload.length() ? 0 : -1;
+}
+
+int
+fsd_op_nargs(uint8_t op)
+{
+    switch(op){
+    case FSD_FORMAT: case FSD_LS: case FSD_PWD:
+        return 0;
+    case FSD_CAT: case FSD_RM: case FSD_MKDIR: case FSD_CD: case FSD_STAT:
+        return 1;
+    case FSD_CREATE: case FSD_CP: case FSD_MV: case FSD_APPEND: case FSD_CHMOD:
+        return 2;
+    default:
+        return -1;
+    }
+}
@@ -0,0 +1,64 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+// Wire protocol spoken between the filesystem daemon and its clients over a
+// Unix domain socket. Every message is a fixed size header followed by
+// `len` bytes of payload, all integers are in host byte order since both
+// ends always live on the same machine.
+//
+// Request payload:  `nargs` arguments, each a uint32_t length and the bytes
+// Response payload: the data of the operation, if any. The file content for
+//                   cat, the path for pwd, raw dir_entry structs for ls and
+//                   stat. Empty if the status is not FS_OK.
+
+#define FSD_DEFAULT_SOCKET "/tmp/filesystem.sock"
+#define FSD_MAGIC 0x4653        // "FS"
+#define FSD_MAX_PAYLOAD (1<<24) // no single message may be larger than 16 MiB
+#define FSD_ERR_PROTOCOL -100   // status sent back on a malformed request
+
+enum fsd_op : uint8_t {
+    FSD_FORMAT = 1,
+    FSD_CREATE,     // <filepath> <data>
+    FSD_CAT,        // <filepath>
+    FSD_LS,
+    FSD_CP,         // <sourcepath> <destpath>
+    FSD_MV,         // <sourcepath> <destpath>
+    FSD_RM,         // <filepath>
+    FSD_APPEND,     // <filepath1> <filepath2>
+    FSD_MKDIR,      // <dirpath>
+    FSD_CD,         // <dirpath>
+    FSD_PWD,
+    FSD_CHMOD,      // <accessrights> <filepath>
+    FSD_STAT,       // <path>
+    FSD_OP_COUNT
+};
+
+struct fsd_request_hdr {
+    uint16_t magic;
+    uint8_t op;     // one of fsd_op
+    uint8_t nargs;  // number of arguments in the payload
+    uint32_t len;   // payload length in bytes
+};
+
+struct fsd_response_hdr {
+    uint16_t magic;
+    int16_t status; // FS_OK or an FS_E* code from fatfs.h
+    uint32_t len;   // payload length in bytes
+};
+
+// reads/writes exactly len bytes, returns 0 on success and -1 on error or EOF
+int fsd_read_full(int fd, void *buf, size_t len);
+int fsd_write_full(int fd, const void *buf, size_t len);
+
+// packs the arguments of a request into a payload and back
+void fsd_pack_args(const std::vector<std::string>& args, std::string *payload);
+int fsd_unpack_args(const std::string& payload, unsigned nargs, std::vector<std::string> *args);
+
+// the number of arguments every operation expects, -1 for unknown ops
+int fsd_op_nargs(uint8_t op);
+
+#endif // __PROTOCOL_H__
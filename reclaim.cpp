@@ -0,0 +1,55 @@
+#include "reclaim.h"
+
+Reclaimer::Reclaimer(FS& fs, std::mutex& fs_lock) : filesystem(fs), fs_lock(fs_lock)
+{
+    stopping = false;
+    kicked = false;
+    thread = std::thread(&Reclaimer::run, this);
+}
+
+Reclaimer::~Reclaimer()
+{
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    thread.join();
+}
+
+void
+Reclaimer::kick()
+{
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        kicked = true;
+    }
+    wakeup.notify_one();
+}
+
+void
+Reclaimer::run()
+{
+    Disk::set_io_class(IO_BACKGROUND);
+    std::unique_lock<std::mutex> state(state_lock);
+    while (!stopping) {
+        if (!kicked) {
+            wakeup.wait(state);
+            continue;
+        }
+        kicked = false;
+        bool done = false;
+        while (!done && !stopping) {
+            state.unlock();
+            int ret_val;
+            {
+                std::lock_guard<std::mutex> guard(fs_lock);
+                ret_val = filesystem.reclaim_step(&done);
+            }
+            state.lock();
+            // a failed step is tried again on the next kick
+            if (ret_val != FS_OK)
+                break;
+        }
+    }
+}
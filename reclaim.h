@@ -0,0 +1,33 @@
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "fs.h"
+
+#ifndef __RECLAIM_H__
+#define __RECLAIM_H__
+
+// Frees the blocks of removed files in the background, see FS::orphans.
+// The thread sleeps until kicked, then runs FS::reclaim_step until no
+// orphans are left, holding fs_lock for each step like the Defragmenter,
+// so a foreground call waits for at most one file's chain.
+class Reclaimer {
+private:
+    FS& filesystem;
+    std::mutex& fs_lock;
+    std::thread thread;
+
+    std::mutex state_lock;          // guards everything below
+    std::condition_variable wakeup;
+    bool stopping;
+    bool kicked;
+
+    void run();
+public:
+    Reclaimer(FS& fs, std::mutex& fs_lock);
+    ~Reclaimer();
+    // wakes the thread up to reclaim what is pending. May be called with
+    // fs_lock held, the owner does after every call that may have left orphans.
+    void kick();
+};
+
+#endif // __RECLAIM_H__
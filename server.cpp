@@ -0,0 +1,249 @@
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+Server::Server(FS& fs, std::string socket_path, unsigned no_workers)
+    : filesystem(fs), socket_path(socket_path), no_workers(no_workers),
+      listen_fd(-1), running(false), format_generation(0), defragmenter(fs, fs_lock),
+      reclaimer(fs, fs_lock)
+{
+    if(this->no_workers == 0)
+        this->no_workers = 1;
+}
+
+Server::~Server()
+{
+    if(listen_fd != -1){
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+}
+
+void
+Server::start_defrag(unsigned io_per_sec)
+{
+    defragmenter.start(io_per_sec);
+}
+
+// binds the socket and serves clients until stop() is called
+int
+Server::run()
+{
+    struct sockaddr_un addr;
+    if(socket_path.length() >= sizeof(addr.sun_path)){
+        std::cerr << "Socket path too long: " << socket_path << "\n";
+        return 1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd == -1){
+        std::cerr << "socket: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str()); // remove a stale socket from an earlier run
+    if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, 64) == -1){
+        std::cerr << "bind/listen " << socket_path << ": " << strerror(errno) << "\n";
+        close(listen_fd);
+        listen_fd = -1;
+        return 1;
+    }
+
+    running = true;
+    for(unsigned i = 0; i < no_workers; i++)
+        workers.push_back(std::thread(&Server::worker, this));
+    std::cerr << "Serving on " << socket_path << " with " << no_workers << " workers\n";
+
+    while(running){
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd == -1){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(running)
+                std::cerr << "accept: " << strerror(errno) << "\n";
+            break;
+        }
+        std::lock_guard<std::mutex> guard(queue_lock);
+        pending.push_back(fd);
+        queue_cv.notify_one();
+    }
+
+    // Wake up every worker, including those blocked reading from a client
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        running = false;
+        for(std::set<int>::iterator it = active.begin(); it != active.end(); it++)
+            shutdown(*it, SHUT_RDWR);
+        queue_cv.notify_all();
+    }
+    for(unsigned i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+
+    for(unsigned i = 0; i < pending.size(); i++)
+        close(pending[i]);
+    pending.clear();
+    return 0;
+}
+
+// makes run() return, only touches the flag and the listening socket so that
+// it is safe to call from a signal handler
+void
+Server::stop()
+{
+    running = false;
+    if(listen_fd != -1)
+        shutdown(listen_fd, SHUT_RDWR);
+}
+
+// Worker thread main loop, picks up one connection at a time
+void
+Server::worker()
+{
+    for(;;){
+        int fd;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            while(running && pending.empty())
+                queue_cv.wait(guard);
+            if(!running)
+                return;
+            fd = pending.front();
+            pending.pop_front();
+            active.insert(fd);
+        }
+
+        serve(fd);
+
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            active.erase(fd);
+        }
+        close(fd);
+    }
+}
+
+// Serves requests on one connection until the client hangs up or misbehaves.
+// Every connection is a session with its own working directory.
+void
+Server::serve(int fd)
+{
+    int cwd = ROOT_BLOCK;
+    unsigned generation;
+    {
+        std::lock_guard<std::mutex> guard(fs_lock);
+        generation = format_generation;
+        session_dirs.insert(cwd);
+    }
+
+    std::string payload;
+    std::string out;
+    std::vector<std::string> args;
+    while(running){
+        fsd_request_hdr req;
+        if(fsd_read_full(fd, &req, sizeof(req)) == -1)
+            break;
+        if(req.magic != FSD_MAGIC || req.len > FSD_MAX_PAYLOAD)
+            break; // not one of ours, there is no way to resync the stream
+
+        payload.resize(req.len);
+        if(req.len > 0 && fsd_read_full(fd, &payload[0], req.len) == -1)
+            break;
+
+        fsd_response_hdr resp;
+        resp.magic = FSD_MAGIC;
+        out.clear();
+        if(fsd_op_nargs(req.op) != req.nargs || fsd_unpack_args(payload, req.nargs, &args) == -1)
+            resp.status = FSD_ERR_PROTOCOL;
+        else
+            resp.status = dispatch(req.op, args, &cwd, &generation, &out);
+        resp.len = out.length();
+
+        if(fsd_write_full(fd, &resp, sizeof(resp)) == -1)
+            break;
+        if(resp.len > 0 && fsd_write_full(fd, out.data(), out.length()) == -1)
+            break;
+    }
+
+    // the working directory may be removed once no session stands in it,
+    // unless a format already let go of it
+    std::lock_guard<std::mutex> guard(fs_lock);
+    if(generation == format_generation)
+        session_dirs.erase(session_dirs.find(cwd));
+}
+
+// Runs one operation on behalf of a session, the data it produces goes to out
+int
+Server::dispatch(uint8_t op, std::vector<std::string>& args,
+                 int *cwd, unsigned *generation, std::string *out)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+
+    // A format by another session invalidated our working directory
+    if(*generation != format_generation){
+        *generation = format_generation;
+        *cwd = ROOT_BLOCK;
+        session_dirs.insert(*cwd);
+    }
+    filesystem.set_current_directory_block(*cwd);
+
+    int ret_val;
+    std::vector<dir_entry> entries;
+    dir_entry entry;
+    switch(op){
+    case FSD_FORMAT:
+        ret_val = filesystem.format();
+        *generation = ++format_generation;
+        session_dirs.clear();
+        *cwd = ROOT_BLOCK;
+        session_dirs.insert(*cwd);
+        break;
+    case FSD_CREATE: ret_val = filesystem.create(args[0], args[1]); break;
+    case FSD_CAT:    ret_val = filesystem.cat(args[0], out); break;
+    case FSD_LS:
+        ret_val = filesystem.ls(&entries);
+        if(ret_val == FS_OK && !entries.empty())
+            out->assign((const char*)&entries[0], entries.size() * sizeof(dir_entry));
+        break;
+    case FSD_CP:     ret_val = filesystem.cp(args[0], args[1]); break;
+    case FSD_MV:     ret_val = filesystem.mv(args[0], args[1]); break;
+    case FSD_RM:
+        // FS::rm only knows the directory of the session it runs for, the
+        // blocks of the others' would go to other files while they use them
+        if(filesystem.stat(args[0], &entry) == FS_OK && entry.type == TYPE_DIR &&
+           session_dirs.count(entry.first_blk) > 0)
+            ret_val = FS_EINVAL;
+        else
+            ret_val = filesystem.rm(args[0]);
+        break;
+    case FSD_APPEND: ret_val = filesystem.append(args[0], args[1]); break;
+    case FSD_MKDIR:  ret_val = filesystem.mkdir(args[0]); break;
+    case FSD_CD:     ret_val = filesystem.cd(args[0]); break;
+    case FSD_PWD:    ret_val = filesystem.pwd(out); break;
+    case FSD_CHMOD:  ret_val = filesystem.chmod(args[0], args[1]); break;
+    case FSD_STAT:
+        ret_val = filesystem.stat(args[0], &entry);
+        if(ret_val == FS_OK)
+            out->assign((const char*)&entry, sizeof(entry));
+        break;
+    default:         ret_val = FSD_ERR_PROTOCOL; break;
+    }
+
+    if(filesystem.current_directory_block() != *cwd){
+        session_dirs.erase(session_dirs.find(*cwd));
+        *cwd = filesystem.current_directory_block();
+        session_dirs.insert(*cwd);
+    }
+    if(ret_val != FS_OK)
+        out->clear();
+    if(filesystem.pending_orphans() > 0)
+        reclaimer.kick();
+    return ret_val;
+}
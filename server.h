@@ -0,0 +1,59 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fs.h"
+#include "protocol.h"
+#include "defrag.h"
+#include "reclaim.h"
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#define FSD_DEFAULT_WORKERS 4
+
+// Serves one mounted FS to many local clients over a Unix domain socket.
+// The accept loop hands connections to a pool of worker threads, each
+// worker serves one connection at a time until the client hangs up.
+// The FS itself is not thread safe so every call into it is serialized.
+class Server {
+private:
+    FS& filesystem;
+    std::string socket_path;
+    unsigned no_workers;
+    int listen_fd;
+    std::atomic<bool> running;
+
+    std::mutex fs_lock;             // serializes all calls into the FS
+    unsigned format_generation;     // bumped on format so sessions drop their cwd
+    std::multiset<int> session_dirs; // the cwd of every session, rm may not take them
+    Defragmenter defragmenter;      // steps under fs_lock like every session
+    Reclaimer reclaimer;            // frees the blocks of removed files, the same way
+
+    std::mutex queue_lock;
+    std::condition_variable queue_cv;
+    std::deque<int> pending;        // accepted connections waiting for a worker
+    std::set<int> active;           // connections currently being served
+    std::vector<std::thread> workers;
+
+    void worker();
+    void serve(int fd);
+    int dispatch(uint8_t op, std::vector<std::string>& args,
+                 int *cwd, unsigned *generation, std::string *out);
+public:
+    Server(FS& fs, std::string socket_path, unsigned no_workers);
+    ~Server();
+    // binds the socket and serves clients until stop() is called
+    int run();
+    // makes run() return, may be called from a signal handler
+    void stop();
+    // defragments the disk in the background while serving, spending at
+    // most io_per_sec disk reads and writes a second on it
+    void start_defrag(unsigned io_per_sec);
+};
+
+#endif // __SERVER_H__
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "client.h"
+#include "server.h"
+
+// Checks the daemon against several sessions at once, run with
+// `make sessiontest`. The daemon runs in this process on a memory disk and
+// the sessions are FSClients on their own connections. Exits with 1 if a
+// check fails.
+
+static int failures = 0;
+
+// Counts a failed check and says which
+static void
+check(bool ok, const std::string& what)
+{
+    if(!ok){
+        std::cout << "FAIL: " << what << "\n";
+        failures++;
+    }
+}
+
+// One session must not remove the directory another one stands in: its
+// block would go to a new file while the other session still writes its
+// entries there
+static void
+test_rm_other_cwd(const std::string& socket_path)
+{
+    FSClient a, b;
+    check(a.connect(socket_path) == FS_OK && b.connect(socket_path) == FS_OK, "connect");
+    check(a.format() == FS_OK, "format");
+    check(a.mkdir("x") == FS_OK, "mkdir x");
+    check(a.cd("x") == FS_OK, "a: cd x");
+    check(b.rm("x") == FS_EINVAL, "b: rm x, a stands in it");
+
+    std::string victim(3 * BLOCK_SIZE, 'v');
+    check(b.create("victim", victim) == FS_OK, "b: create victim");
+    check(a.create("f", "in x") == FS_OK, "a: create f");
+    check(a.mkdir("y") == FS_OK, "a: mkdir y");
+    std::string data;
+    check(b.cat("victim", &data) == FS_OK && data == victim, "b: victim unchanged");
+    check(b.cat("x/f", &data) == FS_OK && data == "in x", "b: cat x/f");
+
+    // once a has left, x is b's to remove
+    check(a.cd("..") == FS_OK, "a: cd ..");
+    check(b.rm("x/f") == FS_OK && b.rm("x/y") == FS_OK, "b: empty x");
+    check(b.rm("x") == FS_OK, "b: rm x, nobody stands in it");
+
+    // and so it is when a hangs up inside it
+    check(b.mkdir("z") == FS_OK && a.cd("z") == FS_OK, "a: cd z");
+    check(b.rm("z") == FS_EINVAL, "b: rm z, a stands in it");
+    a.disconnect();
+    int ret_val = FS_EINVAL;
+    // the daemon notices the hang up on its own time
+    for(int i = 0; i < 100 && ret_val == FS_EINVAL; i++){
+        ret_val = b.rm("z");
+        if(ret_val == FS_EINVAL)
+            usleep(10000);
+    }
+    check(ret_val == FS_OK, "b: rm z, a is gone");
+
+    // a format lets go of every session's directory
+    FSClient c;
+    check(c.connect(socket_path) == FS_OK, "connect c");
+    check(b.mkdir("w") == FS_OK && c.cd("w") == FS_OK, "c: cd w");
+    check(b.format() == FS_OK, "b: format");
+    check(b.mkdir("w") == FS_OK && b.rm("w") == FS_OK, "b: rm w after format");
+}
+
+int
+main()
+{
+    // the memory disk starts empty as long as there is no such image
+    std::string image = "sessiontest-" + std::to_string(getpid()) + ".bin";
+    std::string socket_path = "/tmp/sessiontest-" + std::to_string(getpid()) + ".sock";
+    disk_config config;
+    config.backend = DISK_BACKEND_MEMORY;
+    FS filesystem(image, config);
+    Server server(filesystem, socket_path, 4);
+    std::thread daemon([&]{ server.run(); });
+
+    // wait for the socket to come up
+    FSClient probe;
+    for(int i = 0; i < 100 && probe.connect(socket_path) != FS_OK; i++)
+        usleep(10000);
+    check(probe.connected(), "daemon listening on " + socket_path);
+    probe.disconnect();
+
+    if(failures == 0)
+        test_rm_other_cwd(socket_path);
+
+    server.stop();
+    daemon.join();
+    std::cout << (failures == 0 ? "All session tests passed\n" : "Session tests failed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -1,21 +1,191 @@
 #include <iostream>
-#include <sstream>
 #include <string>
 #include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
 #include "shell.h"
 #include "fs.h"
+#include "trace.h"
+#include "frag.h"
+
+// Besides the data on the following rows ended with an empty row, create
+// accepts two payload forms that can hold any data, including empty rows:
+//   create <file> <<DELIM   data on the following rows up to a row "DELIM"
+//   create <file> :<bytes>  exactly <bytes> bytes of data starting on the
+//                           next row, followed by a newline
 
 std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
+    "chmod", "batch", "iostat", "stats", "trace", "frag", "defrag", "dedup",
+    "chattr", "compress", "sync", "fallocate",
     "help", "quit"
 };
 
-Shell::Shell()
+// Prints why a command failed
+static void
+print_error(const std::string& what, int ret_val)
+{
+    std::cout << "Error: " << what << " failed, error code " << ret_val
+              << " (" << fatfs_strerror(ret_val) << ")\n";
+}
+
+// Prints a directory listing in columns. Size is the size of the content,
+// Disk what its blocks and its part of a tail block take on the disk (none
+// for inline files), and a "c" after the access rights marks a file with
+// the COMPRESS attribute.
+static void
+print_ls(const std::vector<dir_entry>& entries, const int16_t *fat)
+{
+    std::string str;                            // String object of what to print out
+    std::cout << "  Type    Size      Disk      accessrights    Name\n";  // Layout
+    for (unsigned i = 0; i < entries.size(); i++) {
+        const dir_entry& entry = entries[i];
+        uint64_t disk_size = 0;
+        for (int b = entry.first_blk; entry.type != TYPE_DIR && b != ROOT_BLOCK && b >= 0 &&
+             disk_size < BLOCK_SIZE / 2 * BLOCK_SIZE; b = fat[b])
+            disk_size += BLOCK_SIZE;
+        if (entry.access_rights & TAIL)
+            disk_size += entry.size % BLOCK_SIZE;
+        str = "  ";
+        str.append(entry.type == TYPE_DIR ? "Dir" : "File");
+        str.append(10 - str.length(), ' ');
+        str.append(entry.type == TYPE_DIR ? "-" : std::to_string(entry.size));
+        str.append(str.length() < 20 ? 20 - str.length() : 1, ' ');
+        str.append(entry.type == TYPE_DIR ? "-" : std::to_string(disk_size));
+        str.append(str.length() < 30 ? 30 - str.length() : 1, ' ');
+        str.append((entry.access_rights & READ)    ? "r" : "-");
+        str.append((entry.access_rights & WRITE)   ? "w" : "-");
+        str.append((entry.access_rights & EXECUTE) ? "x" : "-");
+        if (entry.access_rights & COMPRESS)
+            str.append("c");
+        str.append(46 - str.length(), ' ');
+        str.append(entry.file_name);
+        str.append("\n");
+        std::cout << str;
+    }
+}
+
+// bytes divided by logical bytes, or "-" if nothing logical was asked for
+static std::string
+amplification(uint64_t bytes, uint64_t logical)
+{
+    if (logical == 0)
+        return "-";
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2fx", (double)bytes / logical);
+    return buf;
+}
+
+// Prints the I/O counters of io in full
+static void
+print_iostat(const io_stats& io)
+{
+    const disk_stats& d = io.disk;
+    std::cout << "  reads           " << d.reads << " blocks, " << d.bytes_read << " bytes\n";
+    std::cout << "  writes          " << d.writes << " blocks, " << d.bytes_written << " bytes\n";
+    std::cout << "  flushes         " << d.flushes << "\n";
+    std::cout << "  sequential      " << d.sequential << "\n";
+    std::cout << "  random          " << d.random << "\n";
+    std::cout << "  cache hits      " << d.cache_hits << "\n";
+    std::cout << "  readahead       " << d.readahead_hits << " reads read ahead, "
+              << d.readahead_unused << " blocks unused\n";
+    std::cout << "  offloaded       " << d.offloaded << " blocks copied by the host\n";
+    std::cout << "  written back    " << d.written_back << " blocks in " << d.write_runs << " runs\n";
+    std::cout << "  discarded       " << d.discarded << " blocks given back to the host\n";
+    std::cout << "  scheduler       " << d.dispatches << " dispatches, " << d.merged << " merged, "
+              << d.throttled << " throttled\n";
+    std::cout << "  seeks           " << d.seeks << ", " << d.seek_distance << " blocks in total\n";
+    std::cout << "  logical read    " << io.logical_read << " bytes, amplification "
+              << amplification(d.bytes_read, io.logical_read) << "\n";
+    std::cout << "  logical written " << io.logical_written << " bytes, amplification "
+              << amplification(d.bytes_written, io.logical_written) << "\n";
+}
+
+// Prints the I/O between before and after on one line
+static void
+print_io_report(const io_stats& before, const io_stats& after)
+{
+    const disk_stats& b = before.disk;
+    const disk_stats& a = after.disk;
+    uint64_t logical_read = after.logical_read - before.logical_read;
+    uint64_t logical_written = after.logical_written - before.logical_written;
+    std::cout << "io: " << a.reads - b.reads << " reads, "
+              << a.writes - b.writes << " writes, "
+              << a.flushes - b.flushes << " flushes, "
+              << a.seeks - b.seeks << " seeks, "
+              << a.sequential - b.sequential << " sequential, "
+              << a.random - b.random << " random; read "
+              << a.bytes_read - b.bytes_read << "/" << logical_read << " bytes ("
+              << amplification(a.bytes_read - b.bytes_read, logical_read) << "), wrote "
+              << a.bytes_written - b.bytes_written << "/" << logical_written << " bytes ("
+              << amplification(a.bytes_written - b.bytes_written, logical_written) << ")\n";
+}
+
+// Prints a table of the latency histograms that have seen any calls
+static void
+print_latency(const LatencyHistogram *hists)
+{
+    printf("  %-18s %9s %10s %10s %10s %10s %10s %10s\n",
+           "op", "count", "min us", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for (int op = 0; op < LAT_COUNT; op++) {
+        const LatencyHistogram& h = hists[op];
+        if (h.count() == 0)
+            continue;
+        printf("  %-18s %9llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               latency_op_name(op), (unsigned long long)h.count(),
+               h.min() / 1e3, h.mean() / 1e3, h.percentile(0.50) / 1e3,
+               h.percentile(0.90) / 1e3, h.percentile(0.99) / 1e3, h.max() / 1e3);
+    }
+    fflush(stdout);
+}
+
+// Splits a line into words, multiple blanks count as one. The strings
+// already in words are reused so a long script does not allocate per line.
+// With strip_comments everything from a word starting with // is ignored.
+static void
+split_line(const std::string& line, std::vector<std::string> *words, bool strip_comments)
+{
+    size_t no_words = 0;
+    size_t i = 0, len = line.length();
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+    while (i < len) {
+        while (i < len && (line[i] == ' ' || line[i] == '\t'))
+            i++;
+        size_t start = i;
+        while (i < len && line[i] != ' ' && line[i] != '\t')
+            i++;
+        if (i == start)
+            break;
+        if (strip_comments && i - start >= 2 && line[start] == '/' && line[start + 1] == '/')
+            break;
+        if (no_words < words->size())
+            (*words)[no_words].assign(line, start, i - start);
+        else
+            words->push_back(line.substr(start, i - start));
+        no_words++;
+    }
+    words->resize(no_words);
+}
+
+Shell::Shell(const std::string& diskname, const disk_config& config)
+    : filesystem(diskname, config), fs_guard(fs_lock, std::defer_lock),
+      defragmenter(filesystem, fs_lock), reclaimer(filesystem, fs_lock)
 {
     std::cout << "Starting shell...\n";
+    if (!filesystem.mounted()) {
+        std::cerr << "ERROR: Can't open diskfile: " << diskname << ", exiting..." << std::endl;
+        exit(-1);
+    }
+    interactive = true;
+    io_report = false;
 }
 
 Shell::~Shell()
@@ -23,230 +193,707 @@ Shell::~Shell()
     std::cout << "Exiting shell...\n";
 }
 
+// Reads the data for create from in, in whichever form cmd_line asks for.
+// Returns false if the data is missing or cut short.
+bool
+Shell::read_payload(std::istream& in, const std::vector<std::string>& cmd_line, std::string *data)
+{
+    std::string line;
+    data->clear();
+
+    // create <file>: rows until an empty row
+    if (cmd_line.size() == 2) {
+        while (std::getline(in, line) && !line.empty()) {
+            if (!data->empty())
+                *data += "\n";
+            *data += line;
+        }
+        return true;
+    }
+
+    // create <file> <<DELIM: rows until the delimiter row
+    const std::string& spec = cmd_line[2];
+    if (spec.length() > 2 && spec[0] == '<' && spec[1] == '<') {
+        std::string delim = spec.substr(2);
+        bool first = true;
+        while (std::getline(in, line)) {
+            if (line == delim)
+                return true;
+            if (!first)
+                *data += "\n";
+            *data += line;
+            first = false;
+        }
+        return false;
+    }
+
+    // create <file> :<bytes>: a length prefixed blob, no larger than the
+    // disk since it could never be stored
+    if (spec.length() > 1 && spec[0] == ':') {
+        char *end;
+        errno = 0;
+        unsigned long bytes = strtoul(spec.c_str() + 1, &end, 10);
+        if (*end != '\0' || errno == ERANGE || bytes > (uint64_t)filesystem.get_no_blocks() * BLOCK_SIZE)
+            return false;
+        data->resize(bytes);
+        if (bytes > 0 && !in.read(&(*data)[0], bytes))
+            return false;
+        if (in.peek() == '\n')
+            in.get();
+        return true;
+    }
+    return false;
+}
+
+// Reads the operations of a batch from in until a line with "end".
+// create takes its data in any of the forms the create command accepts.
+// Returns false if the batch was malformed.
+bool
+Shell::read_batch(std::istream& in, std::vector<batch_op> *ops)
+{
+    std::string line;
+    std::vector<std::string> words;
+    bool ok = true;
+    for (;;) {
+        if (interactive)
+            std::cout << "batch> ";
+        if (!std::getline(in, line))
+            return false;
+        split_line(line, &words, !interactive);
+        if (words.empty())
+            continue;
+        if (words[0] == "end")
+            return ok;
+
+        batch_op op;
+        if (words[0] == "create" && (words.size() == 2 || words.size() == 3)) {
+            op.type = BATCH_CREATE;
+            op.arg1 = words[1];
+            if (!read_payload(in, words, &op.arg2)) {
+                std::cout << "Missing or truncated data for create " << words[1] << "\n";
+                ok = false;
+                continue;
+            }
+        } else if (words[0] == "rm" && words.size() == 2) {
+            op.type = BATCH_RM;
+            op.arg1 = words[1];
+        } else if (words[0] == "mv" && words.size() == 3) {
+            op.type = BATCH_MV;
+            op.arg1 = words[1];
+            op.arg2 = words[2];
+        } else if (words[0] == "chmod" && words.size() == 3) {
+            op.type = BATCH_CHMOD;
+            op.arg1 = words[1];
+            op.arg2 = words[2];
+        } else if (words[0] == "mkdir" && words.size() == 2) {
+            op.type = BATCH_MKDIR;
+            op.arg1 = words[1];
+        } else {
+            std::cout << "Not allowed in a batch: " << line << "\n";
+            std::cout << "Usage: create <file>, rm <file>, mv <sourcepath> <destpath>, "
+                         "chmod <accessrights> <filepath>, mkdir <dirpath>\n";
+            ok = false;
+            continue;
+        }
+        ops->push_back(op);
+    }
+}
+
+// Writes a batch back in the form read_batch() reads it, for recordings
+static void
+record_batch(const std::vector<batch_op>& ops, std::string *payload)
+{
+    static const char *names[] = { "create", "rm", "mv", "chmod", "mkdir" };
+    for (unsigned i = 0; i < ops.size(); i++) {
+        const batch_op& op = ops[i];
+        *payload += std::string(names[op.type]) + " " + op.arg1;
+        if (op.type == BATCH_CREATE)
+            *payload += " :" + std::to_string(op.arg2.length()) + "\n" + op.arg2;
+        else if (op.type == BATCH_MV || op.type == BATCH_CHMOD)
+            *payload += " " + op.arg2;
+        *payload += "\n";
+    }
+    *payload += "end\n";
+}
+
 void
 Shell::run()
 {
-    bool running = true;
     std::string line;
-    std::string str;
-    char c;
     std::vector<std::string> cmd_line;
-    std::string cmd, arg1, arg2;
-    int ret_val = 0;
-    while (running) {
+    interactive = true;
+    for (;;) {
         std::cout << "filesystem> ";
-        std::getline(std::cin, line);
-        std::stringstream linestream(line);
-        cmd_line.clear();
-        str.clear();
-        while (linestream.get(c)) {
-            //std::cout << "parsing cmd line: " << c << "\n";
-            if (c != ' ') {
-                str += c;
-            } else {
-                // strip multiple blanks
-                if (!str.empty()) {
-                    cmd_line.push_back(str);
-                    str.clear();
-                }
-            }
-        }
-        if (!str.empty())
-            cmd_line.push_back(str);
-        if (line.empty())
-            cmd = "";
-        else
-            cmd = cmd_line[0];
+        if (!std::getline(std::cin, line))
+            break; // end of input, same as quit
+        split_line(line, &cmd_line, false);
 
         if (DEBUG) {
-            std::cout << "Line: " << line << std::endl;
-            std::cout << "cmd: " << cmd << std::endl;
+            std::cout << "Line: " << line << "\n";
             for (unsigned i = 0; i < cmd_line.size(); ++i)
                 std::cout << "cmd/arg: " << cmd_line[i] << "\n";
         }
 
-        if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.format();
-            if (ret_val) {
-                std::cout << "Error: format failed, error code " << ret_val << std::endl;
+        if (cmd_line.empty())
+            continue; // do nothing
+        if (run_command(cmd_line, std::cin) == SHELL_QUIT)
+            break;
+    }
+}
+
+int
+Shell::run_script(std::istream& in, bool stop_on_error, bool print_status)
+{
+    std::string line;
+    std::vector<std::string> cmd_line;
+    unsigned long no_cmds = 0;
+    int last_error = 0;
+    interactive = false;
+    while (std::getline(in, line)) {
+        split_line(line, &cmd_line, true);
+        if (cmd_line.empty())
+            continue;
+
+        int status = run_command(cmd_line, in);
+        if (status == SHELL_QUIT)
+            break;
+        no_cmds++;
+        if (print_status)
+            std::cout << "status " << no_cmds << " " << cmd_line[0] << " " << status << "\n";
+        if (status != 0) {
+            last_error = status;
+            if (stop_on_error) {
+                std::cout << "Stopped at command " << no_cmds << ": " << line << "\n";
+                break;
             }
         }
+    }
+    std::cout.flush();
+    return last_error;
+}
 
-        else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
-                continue;
+int
+Shell::run_command(const std::vector<std::string>& cmd_line, std::istream& in)
+{
+    uint64_t start_us = latency_now() / 1000;
+    record_line.clear();
+    record_payload.clear();
+
+    io_stats after;
+    bool report = io_report && cmd_line[0] != "iostat";
+    // create and batch lock once they have read their input, a person may
+    // still be typing it. defrag takes the lock itself, starting and
+    // stopping the background pass must not hold it.
+    if (cmd_line[0] == "defrag")
+        filesystem.get_io_stats(&io_before);
+    else if (cmd_line[0] != "create" && cmd_line[0] != "batch")
+        lock_fs();
+    int status = execute(cmd_line, in);
+    if (status == SHELL_QUIT) {
+        if (fs_guard.owns_lock())
+            fs_guard.unlock();
+        return status;
+    }
+    // rm leaves the blocks of the file for the reclaimer to free
+    if (fs_guard.owns_lock() && filesystem.pending_orphans() > 0)
+        reclaimer.kick();
+    // nothing to report of a create or batch that never got to the disk
+    if (report && (fs_guard.owns_lock() || cmd_line[0] == "defrag")) {
+        filesystem.get_io_stats(&after);
+        print_io_report(io_before, after);
+    }
+    if (fs_guard.owns_lock())
+        fs_guard.unlock();
+
+    if (recorder.is_open()) {
+        if (record_line.empty()) {
+            for (unsigned i = 0; i < cmd_line.size(); i++)
+                record_line += (i ? " " : "") + cmd_line[i];
+        }
+        recorder.record(start_us, record_line, record_payload, status);
+    }
+    return status;
+}
+
+void
+Shell::lock_fs()
+{
+    fs_guard.lock();
+    filesystem.get_io_stats(&io_before);
+}
+
+bool
+Shell::record(const std::string& path)
+{
+    return recorder.open(path);
+}
+
+long
+Shell::replay(const std::string& path, bool paced)
+{
+    WorkloadReader reader;
+    if (!reader.open(path))
+        return -1;
+
+    workload_record rec;
+    std::vector<std::string> cmd_line;
+    unsigned long no_cmds = 0;
+    long mismatches = 0;
+    interactive = false;
+    uint64_t start_us = latency_now() / 1000;
+    while (reader.next(&rec)) {
+        if (paced) {
+            uint64_t now_us = latency_now() / 1000;
+            if (rec.time_us > now_us - start_us)
+                usleep(rec.time_us - (now_us - start_us));
+        }
+        split_line(rec.line, &cmd_line, false);
+        if (cmd_line.empty())
+            continue;
+
+        // whatever the command reads comes from its recorded payload
+        std::istringstream in(rec.payload);
+        int status = run_command(cmd_line, in);
+        if (status == SHELL_QUIT)
+            break;
+        no_cmds++;
+        if (status != rec.status) {
+            mismatches++;
+            std::cerr << "replay: command " << no_cmds << " \"" << rec.line << "\" returned "
+                      << status << ", recorded " << rec.status << "\n";
+        }
+    }
+    double secs = (latency_now() / 1000 - start_us) / 1e6;
+
+    io_stats io;
+    filesystem.get_io_stats(&io);
+    std::cout.flush();
+    std::cerr << "Replayed " << no_cmds << " commands in " << secs << " s ("
+              << (secs > 0 ? no_cmds / secs : 0) << " commands/s), "
+              << mismatches << " status mismatches\n";
+    std::cerr << "Disk: " << io.disk.reads << " reads, " << io.disk.writes << " writes, "
+              << io.disk.cache_hits << " cache hits\n";
+    return mismatches;
+}
+
+int
+Shell::execute(const std::vector<std::string>& cmd_line, std::istream& in)
+{
+    const std::string& cmd = cmd_line[0];
+    std::string arg1, arg2;
+    int ret_val = 0;
+
+    if (cmd == "format") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: format\n";
+            return SHELL_USAGE;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.format();
+        if (ret_val)
+            print_error("format", ret_val);
+        else
+            std::cout << "Formatted the disk successfully\n";
+    }
+
+    else if (cmd == "create") {
+        if (cmd_line.size() != 2 && cmd_line.size() != 3) {
+            std::cout << "Usage: create <file> [<<DELIM | :<bytes>]\n";
+            return SHELL_USAGE;
+        }
+        arg1 = cmd_line[1];
+        std::string data;
+        if (interactive && cmd_line.size() == 2) {
+            // Don't make the user type it all for nothing
+            dir_entry entry;
+            std::unique_lock<std::mutex> guard(fs_lock);
+            ret_val = filesystem.stat(arg1, &entry);
+            guard.unlock();
+            if (ret_val == FS_OK) {
+                print_error("create " + arg1, FS_EEXIST);
+                return FS_EEXIST;
             }
-            arg1 = cmd_line[1];
             std::cout << "Enter data. Empty line to end.\n";
-            // check return value so everything is ok
-            ret_val = filesystem.create(arg1);
-            if (ret_val) {
-                std::cout << "Error: create " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
         }
+        if (!read_payload(in, cmd_line, &data)) {
+            std::cout << "Error: create " << arg1 << ", missing or truncated data\n";
+            return SHELL_USAGE;
+        }
+        record_line = "create " + arg1 + " :" + std::to_string(data.length());
+        record_payload = data + "\n";
+        lock_fs();
+        // check return value so everything is ok
+        ret_val = filesystem.create(arg1, data);
+        if (ret_val)
+            print_error("create " + arg1, ret_val);
+    }
 
-        else if (cmd == "cat") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
-            if (ret_val) {
-                std::cout << "Error: cat " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cat") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cat <file>\n";
+            return SHELL_USAGE;
         }
+        arg1 = cmd_line[1];
+        std::string data;
+        // check return value so everything is ok
+        ret_val = filesystem.cat(arg1, &data);
+        if (ret_val)
+            print_error("cat " + arg1, ret_val);
+        else
+            std::cout << data << "\n";
+    }
 
-        else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.ls();
-            if (ret_val) {
-                std::cout << "Error: ls failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "ls") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: ls\n";
+            return SHELL_USAGE;
         }
+        std::vector<dir_entry> entries;
+        // check return value so everything is ok
+        ret_val = filesystem.ls(&entries);
+        if (ret_val)
+            print_error("ls", ret_val);
+        else
+            print_ls(entries, filesystem.get_fat());
+    }
 
-        else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: cp " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cp") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: cp <oldfile> <newfile>\n";
+            return SHELL_USAGE;
         }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.cp(arg1, arg2);
+        if (ret_val)
+            print_error("cp " + arg1 + " " + arg2, ret_val);
+        else
+            std::cout << "Successfully copied " << arg1 << " into " << arg2 << "\n";
+    }
 
-        else if (cmd == "mv") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: mv <sourcepath> <destpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.mv(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: mv " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "mv") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: mv <sourcepath> <destpath>\n";
+            return SHELL_USAGE;
         }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.mv(arg1, arg2);
+        if (ret_val)
+            print_error("mv " + arg1 + " " + arg2, ret_val);
+        else
+            std::cout << "Successfully moved " << arg1 << " to " << arg2 << "\n";
+    }
 
-        else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
-            if (ret_val) {
-                std::cout << "Error: rm " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "rm") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: rm <file>\n";
+            return SHELL_USAGE;
         }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.rm(arg1);
+        if (ret_val)
+            print_error("rm " + arg1, ret_val);
+        else
+            std::cout << "Successfully removed " << arg1 << "\n";
+    }
 
-        else if (cmd == "append") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: append <filepath1> <filepath2>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.append(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: append " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "append") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: append <filepath1> <filepath2>\n";
+            return SHELL_USAGE;
         }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.append(arg1, arg2);
+        if (ret_val)
+            print_error("append " + arg1 + " " + arg2, ret_val);
+        else
+            std::cout << "Successfully appended " << arg1 << " to the end of " << arg2 << "\n";
+    }
 
-        else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
-            if (ret_val) {
-                std::cout << "Error: mkdir " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "mkdir") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: mkdir <dirpath>\n";
+            return SHELL_USAGE;
         }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.mkdir(arg1);
+        if (ret_val)
+            print_error("mkdir " + arg1, ret_val);
+        else
+            std::cout << "Successfully created directory " << arg1 << "\n";
+    }
 
-        else if (cmd == "cd") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cd <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cd(arg1);
-            if (ret_val) {
-                std::cout << "Error: cd " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cd") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cd <dirpath>\n";
+            return SHELL_USAGE;
         }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.cd(arg1);
+        if (ret_val)
+            print_error("cd " + arg1, ret_val);
+    }
 
-        else if (cmd == "pwd") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: pwd\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.pwd();
-            if (ret_val) {
-                std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "pwd") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: pwd\n";
+            return SHELL_USAGE;
         }
+        std::string path;
+        // check return value so everything is ok
+        ret_val = filesystem.pwd(&path);
+        if (ret_val)
+            print_error("pwd", ret_val);
+        else
+            std::cout << path << "\n";
+    }
 
-        else if (cmd == "chmod") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: chmod <accessrights> <filepath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.chmod(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: chmod " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
+    else if (cmd == "chmod") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: chmod <accessrights> <filepath>\n";
+            return SHELL_USAGE;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.chmod(arg1, arg2);
+        if (ret_val)
+            print_error("chmod " + arg1 + " " + arg2, ret_val);
+        else
+            std::cout << "Changed permissions of " << arg2 << " to " << arg1 << "\n";
+    }
+
+    else if (cmd == "chattr") {
+        // chattr +c | -c <filepath>
+        if (cmd_line.size() != 3 || (cmd_line[1] != "+c" && cmd_line[1] != "-c")) {
+            std::cout << "Usage: chattr +c | -c <filepath>\n";
+            return SHELL_USAGE;
+        }
+        ret_val = filesystem.compress(cmd_line[2], cmd_line[1] == "+c");
+        if (ret_val)
+            print_error("chattr " + cmd_line[1] + " " + cmd_line[2], ret_val);
+    }
+
+    else if (cmd == "compress") {
+        // compress [on | off], whether new files get the COMPRESS attribute
+        if (cmd_line.size() == 1) {
+            std::cout << "Compression of new files is " << (filesystem.get_compression() ? "on" : "off") << "\n";
+        } else if (cmd_line.size() == 2 && (cmd_line[1] == "on" || cmd_line[1] == "off")) {
+            filesystem.set_compression(cmd_line[1] == "on");
+        } else {
+            std::cout << "Usage: compress [on | off]\n";
+            return SHELL_USAGE;
+        }
+    }
+
+    else if (cmd == "sync") {
+        // sync [filepath], writes out what write back holds back
+        if (cmd_line.size() > 2) {
+            std::cout << "Usage: sync [filepath]\n";
+            return SHELL_USAGE;
+        }
+        ret_val = cmd_line.size() == 1 ? filesystem.sync() : filesystem.fsync(cmd_line[1]);
+        if (ret_val)
+            print_error(cmd_line.size() == 1 ? "sync" : "sync " + cmd_line[1], ret_val);
+    }
+
+    else if (cmd == "fallocate") {
+        // fallocate <filepath> <size>, preallocates blocks for the file to grow to size bytes
+        char *end = NULL;
+        unsigned long size = cmd_line.size() == 3 ? strtoul(cmd_line[2].c_str(), &end, 10) : 0;
+        if (cmd_line.size() != 3 || cmd_line[2].empty() || *end != '\0' || size > UINT32_MAX) {
+            std::cout << "Usage: fallocate <filepath> <size>\n";
+            return SHELL_USAGE;
+        }
+        ret_val = filesystem.fallocate(cmd_line[1], size);
+        if (ret_val)
+            print_error("fallocate " + cmd_line[1] + " " + cmd_line[2], ret_val);
+    }
+
+    else if (cmd == "batch") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: batch, followed by operations and a line with end\n";
+            return SHELL_USAGE;
+        }
+        std::vector<batch_op> ops;
+        if (!read_batch(in, &ops)) {
+            std::cout << "Error: batch discarded, nothing was written\n";
+            return SHELL_USAGE;
+        }
+        record_batch(ops, &record_payload);
+        lock_fs();
+        // check return value so everything is ok
+        unsigned failed_op = 0;
+        ret_val = filesystem.batch(ops, &failed_op);
+        if (ret_val) {
+            std::cout << "Batch aborted at operation " << failed_op + 1 << ", nothing was written\n";
+            print_error("batch", ret_val);
+        } else {
+            std::cout << "Batch of " << ops.size() << " operations done\n";
+        }
+    }
+
+    else if (cmd == "iostat") {
+        // iostat [reset | on | off]
+        if (cmd_line.size() == 1) {
+            io_stats io;
+            filesystem.get_io_stats(&io);
+            print_iostat(io);
+        } else if (cmd_line.size() == 2 && cmd_line[1] == "reset") {
+            filesystem.reset_io_stats();
+        } else if (cmd_line.size() == 2 && (cmd_line[1] == "on" || cmd_line[1] == "off")) {
+            io_report = cmd_line[1] == "on";
+        } else {
+            std::cout << "Usage: iostat [reset | on | off]\n";
+            return SHELL_USAGE;
+        }
+    }
+
+    else if (cmd == "stats") {
+        // stats [json [file] | reset]
+        if (cmd_line.size() == 1) {
+            std::cout.flush();
+            print_latency(filesystem.get_latencies());
+        } else if (cmd_line.size() == 2 && cmd_line[1] == "reset") {
+            filesystem.reset_latency();
+        } else if (cmd_line[1] == "json" && cmd_line.size() == 2) {
+            latency_write_json(std::cout, filesystem.get_latencies());
+        } else if (cmd_line[1] == "json" && cmd_line.size() == 3) {
+            std::ofstream out(cmd_line[2].c_str());
+            latency_write_json(out, filesystem.get_latencies());
+            if (!out.good()) {
+                std::cout << "Error: could not write " << cmd_line[2] << "\n";
+                return SHELL_USAGE;
             }
+        } else {
+            std::cout << "Usage: stats [json [file] | reset]\n";
+            return SHELL_USAGE;
         }
+    }
 
-        else if (cmd == "quit")
-            running = false;
+    else if (cmd == "trace") {
+        // trace start | stop | dump <file>
+        if (cmd_line.size() == 2 && cmd_line[1] == "start") {
+            trace_start();
+        } else if (cmd_line.size() == 2 && cmd_line[1] == "stop") {
+            trace_stop();
+        } else if (cmd_line.size() == 3 && cmd_line[1] == "dump") {
+            long no_events = trace_write_json(cmd_line[2]);
+            if (no_events < 0) {
+                std::cout << "Error: could not write " << cmd_line[2] << "\n";
+                return SHELL_USAGE;
+            }
+            std::cout << "Wrote " << no_events << " events to " << cmd_line[2] << "\n";
+        } else {
+            std::cout << "Usage: trace start | stop | dump <file>\n";
+            return SHELL_USAGE;
+        }
+    }
 
-        else if (cmd == "help") {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "frag") {
+        // frag [files | map [width] | json [file]]
+        bool files = cmd_line.size() == 2 && cmd_line[1] == "files";
+        if (cmd_line.size() == 1 || files) {
+            frag_report report;
+            ret_val = frag_analyze(filesystem, &report);
+            if (ret_val == 0)
+                frag_write_report(std::cout, report, files);
+        } else if (cmd_line[1] == "map" && cmd_line.size() <= 3) {
+            unsigned width = cmd_line.size() == 3 ? atoi(cmd_line[2].c_str()) : 64;
+            ret_val = frag_write_heatmap(std::cout, filesystem, width);
+        } else if (cmd_line[1] == "json" && cmd_line.size() <= 3) {
+            frag_report report;
+            ret_val = frag_analyze(filesystem, &report);
+            if (ret_val == 0 && cmd_line.size() == 2) {
+                frag_write_json(std::cout, report);
+            } else if (ret_val == 0) {
+                std::ofstream out(cmd_line[2].c_str());
+                frag_write_json(out, report);
+                if (!out.good()) {
+                    std::cout << "Error: could not write " << cmd_line[2] << "\n";
+                    return SHELL_USAGE;
+                }
+            }
+        } else {
+            std::cout << "Usage: frag [files | map [width] | json [file]]\n";
+            return SHELL_USAGE;
         }
+        if (ret_val)
+            print_error("frag", ret_val);
+    }
 
-        else if (cmd == "") {
-            ; // do nothing
+    else if (cmd == "defrag") {
+        // defrag [start [io_per_sec] | stop | status]
+        defrag_progress progress;
+        if (cmd_line.size() == 1) {
+            memset(&progress, 0, sizeof(progress));
+            std::lock_guard<std::mutex> guard(fs_lock);
+            ret_val = filesystem.defrag(&progress);
+            if (ret_val)
+                print_error("defrag", ret_val);
+            else
+                std::cout << "Moved " << progress.files_moved << " files, " << progress.blocks_moved
+                          << " blocks with " << progress.io << " disk I/Os\n";
+        } else if (cmd_line[1] == "start" && cmd_line.size() <= 3) {
+            unsigned io_per_sec = cmd_line.size() == 3 ? atoi(cmd_line[2].c_str()) : 0;
+            defragmenter.start(io_per_sec);
+        } else if (cmd_line[1] == "stop" && cmd_line.size() == 2) {
+            defragmenter.stop();
+        } else if (cmd_line[1] == "status" && cmd_line.size() == 2) {
+            bool running = defragmenter.running(&progress, &ret_val);
+            std::cout << (running ? "Running" : progress.done ? "Done" : "Stopped")
+                      << ": at block " << progress.cursor << ", moved " << progress.files_moved
+                      << " files, " << progress.blocks_moved << " blocks with " << progress.io
+                      << " disk I/Os\n";
+            if (ret_val)
+                print_error("defrag", ret_val);
+        } else {
+            std::cout << "Usage: defrag [start [io_per_sec] | stop | status]\n";
+            return SHELL_USAGE;
         }
+    }
 
-        else {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "dedup") {
+        // dedup [on | off | scan [threads]]
+        if (cmd_line.size() == 1) {
+            std::cout << "Dedup is " << (filesystem.get_dedup() ? "on" : "off") << "\n";
+        } else if ((cmd_line[1] == "on" || cmd_line[1] == "off") && cmd_line.size() == 2) {
+            ret_val = filesystem.set_dedup(cmd_line[1] == "on");
+        } else if (cmd_line[1] == "scan" && cmd_line.size() <= 3) {
+            unsigned no_threads = cmd_line.size() == 3 ? atoi(cmd_line[2].c_str()) : 4;
+            dedup_result result;
+            ret_val = filesystem.dedup_scan(no_threads, &result);
+            if (ret_val == 0)
+                std::cout << "Scanned " << result.files << " files, " << result.blocks << " blocks, freed "
+                          << result.freed << " blocks with " << result.io << " disk I/Os\n";
+        } else {
+            std::cout << "Usage: dedup [on | off | scan [threads]]\n";
+            return SHELL_USAGE;
         }
+        if (ret_val)
+            print_error("dedup", ret_val);
+    }
+
+    else if (cmd == "quit")
+        return SHELL_QUIT;
+
+    else if (cmd == "help") {
+        std::cout << "Available commands:\n";
+        std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, batch, iostat, stats, trace, frag, defrag, dedup, chattr, compress, sync, fallocate, help, quit\n";
+    }
+
+    else {
+        std::cout << "Available commands:\n";
+        std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, batch, iostat, stats, trace, frag, defrag, dedup, chattr, compress, sync, fallocate, help, quit\n";
+        return SHELL_USAGE;
     }
+    return ret_val;
 }
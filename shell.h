@@ -1,16 +1,63 @@
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "fs.h"
+#include "workload.h"
+#include "defrag.h"
+#include "reclaim.h"
 
 #ifndef __SHELL_H__
 #define __SHELL_H__
 
+#define SHELL_QUIT -1000    // execute() got "quit"
+#define SHELL_USAGE 2       // status of a malformed or unknown command
+
 class Shell {
 private:
     FS filesystem;
+    bool interactive;
+    // print the I/O of every command after it, see iostat
+    bool io_report;
+    // Recording of the session, see record(). execute() sets record_line and
+    // record_payload when the command read more than its own line.
+    WorkloadRecorder recorder;
+    std::string record_line;
+    std::string record_payload;
+    // every command holds fs_lock so an online defrag and the reclaimer
+    // can run next to them, but not while it reads its input, see lock_fs()
+    std::mutex fs_lock;
+    std::unique_lock<std::mutex> fs_guard;
+    // the I/O counters before the FS calls of the command, for its report
+    io_stats io_before;
+    Defragmenter defragmenter;
+    Reclaimer reclaimer;
+    // runs one already split command line, create payloads are read from in.
+    // Returns the status of the command, 0 on success.
+    int execute(const std::vector<std::string>& cmd_line, std::istream& in);
+    // execute() followed by the I/O report of the command if it is on
+    int run_command(const std::vector<std::string>& cmd_line, std::istream& in);
+    bool read_payload(std::istream& in, const std::vector<std::string>& cmd_line, std::string *data);
+    bool read_batch(std::istream& in, std::vector<batch_op> *ops);
+    // takes fs_lock for the rest of the command
+    void lock_fs();
 public:
-    Shell();
+    Shell(const std::string& diskname = DISKNAME, const disk_config& config = disk_config());
     ~Shell();
+    // records every command run from now on, with its payload and status,
+    // into the workload file path. Returns false if it can't be written.
+    bool record(const std::string& path);
+    // replays a recorded workload, at the pace it was recorded or as fast as
+    // possible. Returns the number of commands whose status differed from
+    // the recording, or -1 if the workload can't be read.
+    long replay(const std::string& path, bool paced);
+    // interactive shell on stdin, with a prompt for every line
     void run();
+    // runs the commands in `in` without prompts. Prints the status of every
+    // command if print_status is set, and stops at the first failing command
+    // if stop_on_error is set. Returns 0 if all commands succeeded, else the
+    // status of the last failing command.
+    int run_script(std::istream& in, bool stop_on_error, bool print_status);
 };
 
 #endif // __SHELL_H__
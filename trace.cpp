@@ -0,0 +1,123 @@
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include "trace.h"
+
+std::atomic<bool> trace_enabled(false);
+
+// Ring buffer of one thread. Only the owning thread writes events and head,
+// readers load head with acquire to see the events before it.
+struct trace_buffer {
+    trace_event events[TRACE_BUFFER_EVENTS];
+    std::atomic<uint64_t> head;     // number of events ever recorded
+    unsigned tid;
+    trace_buffer(unsigned tid) : head(0), tid(tid) {}
+};
+
+// Every buffer ever created. Buffers are never freed so a dump still sees
+// the events of threads that have exited.
+static std::mutex buffers_lock;
+static std::vector<trace_buffer*> buffers;
+// events that started before this belong to an earlier session
+static std::atomic<uint64_t> trace_epoch(0);
+
+static thread_local trace_buffer *my_buffer = NULL;
+
+// Registering is the only locked step, once per thread
+static trace_buffer *
+register_thread()
+{
+    std::lock_guard<std::mutex> guard(buffers_lock);
+    my_buffer = new trace_buffer(buffers.size() + 1);
+    buffers.push_back(my_buffer);
+    return my_buffer;
+}
+
+void
+trace_start()
+{
+    trace_epoch.store(latency_now(), std::memory_order_relaxed);
+    trace_enabled.store(true, std::memory_order_release);
+}
+
+void
+trace_stop()
+{
+    trace_enabled.store(false, std::memory_order_release);
+}
+
+void
+trace_record(const char *name, const char *cat, uint64_t start_ns, uint64_t end_ns, int64_t arg)
+{
+    trace_buffer *buf = my_buffer ? my_buffer : register_thread();
+    uint64_t head = buf->head.load(std::memory_order_relaxed);
+    trace_event& ev = buf->events[head % TRACE_BUFFER_EVENTS];
+    ev.name = name;
+    ev.cat = cat;
+    ev.start_ns = start_ns;
+    ev.dur_ns = end_ns - start_ns;
+    ev.arg = arg;
+    buf->head.store(head + 1, std::memory_order_release);
+}
+
+// Chrome wants microseconds, the nanoseconds are kept as decimals
+static void
+write_us(std::ostream& out, uint64_t ns)
+{
+    out << ns / 1000 << "." << std::setw(3) << std::setfill('0') << ns % 1000 << std::setfill(' ');
+}
+
+long
+trace_write_json(const std::string& path)
+{
+    std::ofstream out(path.c_str());
+    if(!out.good())
+        return -1;
+
+    uint64_t epoch = trace_epoch.load(std::memory_order_relaxed);
+    int pid = getpid();
+    long written = 0;
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+        << ", \"args\": {\"name\": \"filesystem\"}}";
+
+    std::lock_guard<std::mutex> guard(buffers_lock);
+    for(unsigned b = 0; b < buffers.size(); b++){
+        trace_buffer *buf = buffers[b];
+        uint64_t head = buf->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+
+        // Copy first, a thread still tracing may overwrite the oldest events
+        // while we read, those are dropped by checking head again
+        std::vector<trace_event> events;
+        for(uint64_t i = first; i < head; i++)
+            events.push_back(buf->events[i % TRACE_BUFFER_EVENTS]);
+        uint64_t head_after = buf->head.load(std::memory_order_acquire);
+        uint64_t skip = 0;
+        if(head_after > TRACE_BUFFER_EVENTS && head_after - TRACE_BUFFER_EVENTS > first)
+            skip = head_after - TRACE_BUFFER_EVENTS - first;
+
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+            << ", \"tid\": " << buf->tid << ", \"args\": {\"name\": \"thread " << buf->tid << "\"}}";
+        for(uint64_t i = skip; i < events.size(); i++){
+            const trace_event& ev = events[i];
+            if(ev.start_ns < epoch)
+                continue;
+            out << ",\n{\"name\": \"" << ev.name << "\", \"cat\": \"" << ev.cat
+                << "\", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << buf->tid
+                << ", \"ts\": ";
+            write_us(out, ev.start_ns - epoch);
+            out << ", \"dur\": ";
+            write_us(out, ev.dur_ns);
+            if(ev.arg >= 0)
+                out << ", \"args\": {\"block\": " << ev.arg << "}";
+            out << "}";
+            written++;
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    return out.good() ? written : -1;
+}
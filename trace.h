@@ -0,0 +1,62 @@
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "latency.h"
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Opt-in event tracing of FS and Disk internals, exported as Chrome trace
+// JSON that chrome://tracing and Perfetto open directly.
+//
+// Every thread records into its own ring buffer, so recording never takes a
+// lock: the owning thread is the only writer and publishes each event by
+// bumping the buffer's head. When the ring is full the oldest events are
+// overwritten. With tracing off a span costs one relaxed atomic load.
+
+// events kept per thread, the oldest are dropped beyond this
+#define TRACE_BUFFER_EVENTS (1 << 16)
+
+// One finished span, a Chrome "complete" event with begin and duration
+struct trace_event {
+    const char *name;       // string literal, never copied
+    const char *cat;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    int64_t arg;            // e.g. the block of a disk access, -1 if none
+};
+
+extern std::atomic<bool> trace_enabled;
+
+static inline bool
+trace_on()
+{
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+
+// starts recording, dropping what an earlier session recorded
+void trace_start();
+void trace_stop();
+// appends a finished span to the calling thread's ring buffer
+void trace_record(const char *name, const char *cat, uint64_t start_ns, uint64_t end_ns, int64_t arg);
+// writes everything recorded since trace_start() as Chrome trace JSON.
+// Returns the number of events written or -1 if the file could not be written.
+long trace_write_json(const std::string& path);
+
+// Records the span from its construction to the end of its scope
+class TraceSpan {
+private:
+    const char *name;
+    const char *cat;
+    int64_t arg;
+    uint64_t start;     // 0 when tracing was off at the start of the span
+public:
+    TraceSpan(const char *name, const char *cat = "fs", int64_t arg = -1)
+        : name(name), cat(cat), arg(arg), start(trace_on() ? latency_now() : 0) {}
+    ~TraceSpan() {
+        if(start != 0)
+            trace_record(name, cat, start, latency_now(), arg);
+    }
+};
+
+#endif // __TRACE_H__
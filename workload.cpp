@@ -0,0 +1,96 @@
+#include <cstring>
+#include "workload.h"
+
+bool
+WorkloadRecorder::open(const std::string& path)
+{
+    out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+        return false;
+    out.write(WORKLOAD_MAGIC, 4);
+    out.put((char)WORKLOAD_VERSION);
+    start_us = 0;
+    last_us = 0;
+    return out.good();
+}
+
+// 7 bits per byte, the high bit set on all but the last byte
+void
+WorkloadRecorder::put_varint(uint64_t v)
+{
+    while (v >= 0x80) {
+        out.put((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.put((char)v);
+}
+
+void
+WorkloadRecorder::put_string(const std::string& s)
+{
+    put_varint(s.length());
+    out.write(s.data(), s.length());
+}
+
+void
+WorkloadRecorder::record(uint64_t start_us, const std::string& line, const std::string& payload, int status)
+{
+    if (!out.is_open())
+        return;
+    if (this->start_us == 0)
+        this->start_us = last_us = start_us;
+    put_varint(start_us - last_us);
+    last_us = start_us;
+    put_string(line);
+    put_string(payload);
+    put_varint(((uint64_t)status << 1) ^ (uint64_t)(status >> 31));
+}
+
+bool
+WorkloadReader::open(const std::string& path)
+{
+    char magic[5];
+    in.open(path.c_str(), std::ios::binary);
+    if (!in.read(magic, 5))
+        return false;
+    time_us = 0;
+    return memcmp(magic, WORKLOAD_MAGIC, 4) == 0 && magic[4] == WORKLOAD_VERSION;
+}
+
+bool
+WorkloadReader::get_varint(uint64_t *v)
+{
+    *v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF)
+            return false;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool
+WorkloadReader::get_string(std::string *s)
+{
+    uint64_t len;
+    if (!get_varint(&len))
+        return false;
+    s->resize(len);
+    return len == 0 || in.read(&(*s)[0], len);
+}
+
+bool
+WorkloadReader::next(workload_record *rec)
+{
+    uint64_t delta, status;
+    if (!get_varint(&delta) || !get_string(&rec->line) ||
+        !get_string(&rec->payload) || !get_varint(&status))
+        return false;
+    time_us += delta;
+    rec->time_us = time_us;
+    rec->status = (int)(status >> 1) ^ -(int)(status & 1);
+    return true;
+}
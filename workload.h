@@ -0,0 +1,58 @@
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+// Recorded shell sessions. A workload file is the magic "FSWL", a version
+// byte, then one record per command:
+//   varint  microseconds since the previous command started
+//   varint  length, then the command line
+//   varint  length, then the payload the command read after its line
+//   varint  the status the command returned, zigzag encoded
+// Payloads are stored in the form the shell reads them back, create data
+// as "create <file> :<bytes>" so any data survives the round trip.
+
+#define WORKLOAD_MAGIC "FSWL"
+#define WORKLOAD_VERSION 1
+
+struct workload_record {
+    uint64_t time_us;       // since the first command of the recording
+    std::string line;
+    std::string payload;
+    int status;
+};
+
+class WorkloadRecorder {
+private:
+    std::ofstream out;
+    uint64_t start_us;
+    uint64_t last_us;
+    void put_varint(uint64_t v);
+    void put_string(const std::string& s);
+public:
+    WorkloadRecorder() : start_us(0), last_us(0) {}
+    // starts a new recording in path, returns false if it can't be written
+    bool open(const std::string& path);
+    bool is_open() { return out.is_open(); }
+    // adds one command that started at start_us (monotonic microseconds)
+    void record(uint64_t start_us, const std::string& line, const std::string& payload, int status);
+    void close() { out.close(); }
+};
+
+class WorkloadReader {
+private:
+    std::ifstream in;
+    uint64_t time_us;
+    bool get_varint(uint64_t *v);
+    bool get_string(std::string *s);
+public:
+    WorkloadReader() : time_us(0) {}
+    // opens a recording, returns false if it is missing or not a workload
+    bool open(const std::string& path);
+    // reads the next record, false at the end or on a damaged file
+    bool next(workload_record *rec);
+};
+
+#endif // __WORKLOAD_H__